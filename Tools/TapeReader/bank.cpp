@@ -0,0 +1,382 @@
+/*
+* Parallel bank of demodulator variants
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "wav.h"
+#include "demod.h"
+#include "decoder.h"
+#include "frontend.h"
+#include "bank.h"
+
+static const SDemodVariant TheVariants[BANK_MAX_VARIANTS] =
+{
+	{ 1.00,  0.00,  0.00 },		// nominal
+	{ 0.98,  0.00,  0.00 },		// slow tape
+	{ 1.02,  0.00,  0.00 },		// fast tape
+	{ 1.00,  0.15,  0.00 },		// favour 0 bits
+	{ 1.00, -0.15,  0.00 },		// favour 1 bits
+	{ 1.00,  0.00,  0.10 },		// sample early
+	{ 1.00,  0.00, -0.10 },		// sample late
+	{ 0.96,  0.00,  0.00 },
+	{ 1.04,  0.00,  0.00 },
+};
+
+// Decoder for one variant; keeps the blocks completed in the current chunk
+// for the arbiter
+class CBankDecoder : public CDecoder
+{
+public:
+	CBankDecoder(uint32_t aVariant) : iVariant(aVariant), iPos(0), iNPending(0), iDropped(0) {}
+	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData);
+	virtual void BadBlock(const SBlockHeader* aHdr, const uint8_t* aData, const uint8_t* aConf) { Block(aHdr, 0); }
+	virtual void File(const SBlockHeader* aHdr) {}
+	virtual void Eof() {}
+public:
+	uint32_t		iVariant;
+	uint64_t		iPos;			// position of chunk being demodulated
+	uint32_t		iNPending;		// blocks completed in this chunk
+	SBankBlock		iPending[BANK_MAX_PENDING];
+	uint32_t		iDropped;		// blocks lost because iPending was full
+};
+
+void CBankDecoder::Block(const SBlockHeader* aHdr, const uint8_t* aData)
+{
+	if (iNPending == BANK_MAX_PENDING)
+	{
+		++iDropped;
+		return;
+	}
+	SBankBlock& b = iPending[iNPending++];
+	b.iHdr = *aHdr;
+	b.iValid = (aData != 0);
+	if (aData)
+		memcpy(b.iData, aData, aHdr->iBlockLen);
+	b.iPos = iPos;
+	b.iVariant = iVariant;
+}
+
+class CBankSink : public CBitSink
+{
+public:
+	CBankSink(CDecoder* aDecoder) : iDecoder(aDecoder) {}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence) { iDecoder->Bit(aBit, aConfidence); }
+private:
+	CDecoder* iDecoder;
+};
+
+const SDemodVariant& CDemodulatorBank::Variant(uint32_t aIndex)
+{
+	return TheVariants[aIndex];
+}
+
+CDemodulatorBank::CDemodulatorBank(CSampleSource* aSrc, CFrontEnd* aFrontEnd, CDecoder* aOutput, CDemodulator** aDemods, uint32_t aCount, double aFs)
+:	iSrc(aSrc),
+	iFrontEnd(aFrontEnd),
+	iOutput(aOutput),
+	iCount(aCount),
+	iDemods(aDemods),
+	iDecoders(0),
+	iThreads(0),
+	iFs(aFs),
+	iChunkFrames(0),
+	iConv(0),
+	iEof(false),
+	iGeneration(0),
+	iBusy(0),
+	iStop(false),
+	iCur(0),
+	iCurCount(0),
+	iCurPos(0),
+	iHistoryCount(0),
+	iQueueCount(0),
+	iFileOpen(false),
+	iNextBlock(0),
+	iUsed(0)
+{
+	uint32_t i;
+	iChunkFrames = (uint32_t)(BANK_CHUNK_TIME * aSrc->SampleRate()) + 1;
+	for (i=0; i<2; ++i)
+	{
+		iData[i] = new int32_t[iChunkFrames];
+		iFData[i] = aFrontEnd ? new float[aFrontEnd->MaxOutput(iChunkFrames)] : 0;
+	}
+	iConv = aFrontEnd ? new float[iChunkFrames] : 0;
+	iDecoders = new CBankDecoder*[aCount];
+	iUsed = new uint32_t[aCount];
+	for (i=0; i<aCount; ++i)
+	{
+		iDecoders[i] = new CBankDecoder(i);
+		iDecoders[i]->SetRecovery(aDemods[i]->Recovery());
+		iUsed[i] = 0;
+	}
+}
+
+CDemodulatorBank::~CDemodulatorBank()
+{
+	uint32_t i;
+	for (i=0; i<iCount; ++i)
+	{
+		delete iDecoders[i];
+		delete iDemods[i];
+	}
+	delete[] iUsed;
+	delete[] iDecoders;
+	delete[] iDemods;
+	delete[] iConv;
+	for (i=0; i<2; ++i)
+	{
+		delete[] iFData[i];
+		delete[] iData[i];
+	}
+}
+
+// Read the next chunk into buffer aBuf, passing it through the front end
+// if there is one. Returns the number of samples for the demodulators.
+uint32_t CDemodulatorBank::Fill(uint32_t aBuf)
+{
+	uint32_t n = 0;
+	while (n < iChunkFrames && !iEof)
+	{
+		const uint8_t* frames;
+		uint32_t got = iSrc->ReadFrames(frames, iChunkFrames - n);
+		if (got == 0)
+		{
+			iEof = true;
+			break;
+		}
+		iSrc->GetSamples(iData[aBuf] + n, frames, got, 0);
+		n += got;
+	}
+	if (!iFrontEnd)
+		return n;
+	uint32_t i;
+	for (i=0; i<n; ++i)
+		iConv[i] = (float)iData[aBuf][i];
+	return iFrontEnd->Process(iConv, n, iFData[aBuf]);
+}
+
+void CDemodulatorBank::Worker(uint32_t aIndex)
+{
+	CDemodulator* pDemod = iDemods[aIndex];
+	CBankDecoder* pDecoder = iDecoders[aIndex];
+	CBankSink sink(pDecoder);
+	uint32_t gen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(iLock);
+			while (iGeneration == gen && !iStop)
+				iStart.wait(lock);
+			if (iStop)
+				return;
+			gen = iGeneration;
+		}
+		pDecoder->iPos = iCurPos;
+		if (iFrontEnd)
+			pDemod->Process(iFData[iCur], iCurCount, sink);
+		else
+			pDemod->Process(iData[iCur], iCurCount, sink);
+		pDecoder->Speed(pDemod->Speed() * TheVariants[aIndex].iSpeed);
+		pDecoder->Quality(pDemod->TakeQuality());
+		{
+			std::unique_lock<std::mutex> lock(iLock);
+			if (--iBusy == 0)
+				iDone.notify_one();
+		}
+	}
+}
+
+void CDemodulatorBank::Run()
+{
+	uint32_t i;
+	iThreads = new std::thread*[iCount];
+	for (i=0; i<iCount; ++i)
+		iThreads[i] = new std::thread(&CDemodulatorBank::Worker, this, i);
+
+	uint32_t cur = 0;
+	uint32_t n = Fill(cur);
+	uint64_t pos = 0;
+	while (n > 0 || !iEof)
+	{
+		{
+			std::unique_lock<std::mutex> lock(iLock);
+			iCur = cur;
+			iCurCount = n;
+			iCurPos = pos;
+			iBusy = iCount;
+			++iGeneration;
+		}
+		iStart.notify_all();
+		uint32_t next = Fill(cur ^ 1);
+		{
+			std::unique_lock<std::mutex> lock(iLock);
+			while (iBusy > 0)
+				iDone.wait(lock);
+		}
+		pos += n;
+		Arbitrate(pos, false);
+		cur ^= 1;
+		n = next;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(iLock);
+		iStop = true;
+	}
+	iStart.notify_all();
+	for (i=0; i<iCount; ++i)
+	{
+		iThreads[i]->join();
+		delete iThreads[i];
+	}
+	delete[] iThreads;
+	iThreads = 0;
+	Arbitrate(pos, true);
+
+	for (i=0; i<iCount; ++i)
+	{
+		const SDemodVariant& v = TheVariants[i];
+		printf("Variant %u (speed %.2f bias %+.2f phase %+.2f): %u blocks", i, v.iSpeed, v.iBias, v.iPhase, iUsed[i]);
+		if (iDecoders[i]->iDropped)
+			printf(", %u dropped with more than %u in a chunk", iDecoders[i]->iDropped, BANK_MAX_PENDING);
+		printf("\n");
+	}
+}
+
+// Queue blocks completed in the last chunk, then pass on those which have
+// waited long enough that no better copy can arrive. aPos is the position
+// reached; aFlush passes on everything.
+void CDemodulatorBank::Arbitrate(uint64_t aPos, bool aFlush)
+{
+	const SBankBlock* cand[BANK_MAX_VARIANTS * BANK_MAX_PENDING];
+	uint32_t nCand = 0;
+	uint32_t i;
+	uint32_t j;
+	for (i=0; i<iCount; ++i)
+	{
+		for (j=0; j<iDecoders[i]->iNPending; ++j)
+		{
+			// keep blocks of a file in order in case variants disagree on
+			// which of two blocks completed in this chunk
+			const SBankBlock* b = &iDecoders[i]->iPending[j];
+			uint32_t k = nCand++;
+			while (k > 0 && strcmp(cand[k-1]->iHdr.iName, b->iHdr.iName) == 0 && cand[k-1]->iHdr.iBlockNum > b->iHdr.iBlockNum)
+			{
+				cand[k] = cand[k-1];
+				--k;
+			}
+			cand[k] = b;
+		}
+	}
+	uint32_t nHistory = (iHistoryCount < BANK_HISTORY) ? iHistoryCount : BANK_HISTORY;
+	for (i=0; i<nCand; ++i)
+	{
+		const SBankBlock& b = *cand[i];
+		for (j=0; j<nHistory && !Copy(iHistory[j], b); ++j)
+		{
+		}
+		if (j < nHistory)
+			continue;
+		for (j=0; j<iQueueCount && !Copy(iQueue[j], b); ++j)
+		{
+		}
+		if (j < iQueueCount)
+		{
+			if (b.iValid && !iQueue[j].iValid)
+				iQueue[j] = b;
+			continue;
+		}
+		if (iQueueCount == BANK_QUEUE)
+		{
+			if (Emit(iQueue[0]) && iQueue[0].iValid)
+				++iUsed[iQueue[0].iVariant];
+			memmove(iQueue, iQueue + 1, --iQueueCount * sizeof(SBankBlock));
+		}
+		iQueue[iQueueCount++] = b;
+	}
+	for (i=0; i<iCount; ++i)
+		iDecoders[i]->iNPending = 0;
+
+	uint64_t window = (uint64_t)(BANK_DUPLICATE_TIME * iFs);
+	for (i=0; i<iQueueCount && (aFlush || iQueue[i].iPos + window < aPos); ++i)
+	{
+		if (Emit(iQueue[i]) && iQueue[i].iValid)
+			++iUsed[iQueue[i].iVariant];
+	}
+	iQueueCount -= i;
+	memmove(iQueue, iQueue + i, iQueueCount * sizeof(SBankBlock));
+}
+
+// blocks are copies of each other
+bool CDemodulatorBank::Copy(const SBankBlock& aA, const SBankBlock& aB) const
+{
+	uint64_t window = (uint64_t)(BANK_DUPLICATE_TIME * iFs);
+	uint64_t d = (aA.iPos > aB.iPos) ? aA.iPos - aB.iPos : aB.iPos - aA.iPos;
+	return aA.iHdr.iBlockNum == aB.iHdr.iBlockNum
+		&& aA.iHdr.iLoadAddr == aB.iHdr.iLoadAddr
+		&& strcmp(aA.iHdr.iName, aB.iHdr.iName) == 0
+		&& d <= window;
+}
+
+// Hand a block to the output decoder, opening and closing files as
+// CDecoder would for a single stream. Returns false if it doesn't belong
+// in the current file.
+bool CDemodulatorBank::Emit(const SBankBlock& aBlock)
+{
+	iHistory[iHistoryCount++ % BANK_HISTORY] = aBlock;
+	const SBlockHeader& hdr = aBlock.iHdr;
+	if (iFileOpen && hdr.iBlockNum != 0)
+	{
+		if (strcmp(hdr.iName, iFileHdr.iName) != 0)
+			return false;
+		if (hdr.iBlockNum != iNextBlock)
+		{
+			iOutput->Error(iNextBlock, CDecoder::ESkippedBlock, 0);
+			return false;
+		}
+	}
+	if (iFileOpen && hdr.iBlockNum == 0)
+	{
+		// old file has been truncated
+		iOutput->Eof();
+		iFileOpen = false;
+	}
+	if (!iFileOpen)
+	{
+		if (hdr.iBlockNum != 0)
+			return false;
+		iFileHdr = hdr;
+		iOutput->File(&iFileHdr);
+		iFileOpen = true;
+		iNextBlock = 0;
+	}
+	if (aBlock.iValid)
+		iOutput->Block(&hdr, aBlock.iData);
+	++iNextBlock;
+	if (hdr.iBlockFlag & BLOCK_FLAG_FINAL)
+	{
+		iOutput->Eof();
+		iFileOpen = false;
+	}
+	return true;
+}
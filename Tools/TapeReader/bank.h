@@ -0,0 +1,123 @@
+/*
+* Header file for parallel bank of demodulator variants
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#define	BANK_MAX_VARIANTS	(9)			// number of entries in the variant table
+#define	BANK_CHUNK_TIME		(0.1)		// seconds of input each variant processes between arbitrations
+#define	BANK_DUPLICATE_TIME	(1.0)		// copies of a block finish within this many seconds of each other
+#define	BANK_MAX_PENDING	(8)			// blocks one variant can complete in one chunk
+#define	BANK_HISTORY		(64)		// emitted blocks remembered to recognise copies
+#define	BANK_QUEUE			(64)		// blocks waiting in case a better copy turns up
+
+class CSampleSource;
+class CFrontEnd;
+class CDemodulator;
+class CDecoder;
+class CBankDecoder;
+
+// one configuration of the demodulator
+struct SDemodVariant
+{
+	double		iSpeed;			// tape speed relative to nominal, applied through the sample rate
+	double		iBias;			// decision threshold, see CDemodulator::Tune()
+	double		iPhase;			// sampling phase, see CDemodulator::Tune()
+};
+
+// block from one variant
+struct SBankBlock
+{
+	SBlockHeader	iHdr;
+	bool			iValid;			// data passed its CRC check
+	uint8_t			iData[MAX_BLOCK_LENGTH];
+	uint64_t		iPos;			// sample position of the chunk in which it completed
+	uint32_t		iVariant;		// which variant decoded it
+};
+
+/*
+* Runs several demodulator variants, each with its own decoder, on their
+* own threads over the same samples, and passes the first CRC-valid copy
+* of each block on to the output decoder. The main thread reads and
+* filters a chunk of BANK_CHUNK_TIME while the variants work on the
+* previous one, then collects the blocks they completed, including those
+* with a good header but bad data. Copies of a block have the same name,
+* load address and block number and finish within BANK_DUPLICATE_TIME of
+* each other, so each block waits that long in a queue for a good copy to
+* replace a bad one, and later copies are dropped. Within a chunk, lower
+* numbered variants win; variant 0 should be the nominal configuration.
+* Output files are opened, continued and closed by the same rules as
+* CDecoder applies to a single bit stream, so a bank of one variant gives
+* the same files as a normal run. Run() reports how many blocks each
+* variant supplied, and how many it lost by completing more than
+* BANK_MAX_PENDING in one chunk.
+*/
+class CDemodulatorBank
+{
+public:
+	static const SDemodVariant& Variant(uint32_t aIndex);
+public:
+	CDemodulatorBank(CSampleSource* aSrc, CFrontEnd* aFrontEnd, CDecoder* aOutput, CDemodulator** aDemods, uint32_t aCount, double aFs);
+	~CDemodulatorBank();
+	void Run();
+private:
+	uint32_t Fill(uint32_t aBuf);
+	void Worker(uint32_t aIndex);
+	void Arbitrate(uint64_t aPos, bool aFlush);
+	bool Copy(const SBankBlock& aA, const SBankBlock& aB) const;
+	bool Emit(const SBankBlock& aBlock);
+private:
+	CSampleSource*	iSrc;
+	CFrontEnd*		iFrontEnd;		// may be 0
+	CDecoder*		iOutput;		// receives the arbitrated blocks
+	uint32_t		iCount;			// number of variants
+	CDemodulator**	iDemods;		// one per variant, owned
+	CBankDecoder**	iDecoders;		// one per variant
+	std::thread**	iThreads;		// one per variant
+	double			iFs;			// demodulator sample rate
+	uint32_t		iChunkFrames;	// input frames per chunk
+	int32_t*		iData[2];		// chunk being filled and chunk being demodulated
+	float*			iFData[2];		// front end output, if there is a front end
+	float*			iConv;			// input converted to float for the front end
+	bool			iEof;			// source exhausted
+
+	std::mutex				iLock;
+	std::condition_variable	iStart;	// signalled when a chunk is published
+	std::condition_variable	iDone;	// signalled when the last variant finishes a chunk
+	uint32_t		iGeneration;	// incremented for each chunk published
+	uint32_t		iBusy;			// variants still working on current chunk
+	bool			iStop;
+	uint32_t		iCur;			// buffer index of chunk being demodulated
+	uint32_t		iCurCount;		// samples in chunk being demodulated
+	uint64_t		iCurPos;		// position of its first sample
+
+	SBankBlock		iHistory[BANK_HISTORY];	// recently emitted blocks
+	uint32_t		iHistoryCount;	// total emitted, index into iHistory modulo BANK_HISTORY
+	SBankBlock		iQueue[BANK_QUEUE];	// blocks not yet emitted, oldest first
+	uint32_t		iQueueCount;
+	bool			iFileOpen;		// output decoder has a file open
+	uint32_t		iNextBlock;		// block number expected next in open file
+	SBlockHeader	iFileHdr;		// header of first block of open file
+	uint32_t*		iUsed;			// blocks emitted from each variant
+};
@@ -0,0 +1,661 @@
+/*
+* Batch decoding of many captures
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#endif
+#include "wav.h"
+#include "demod.h"
+#include "decoder.h"
+#include "frontend.h"
+#include "segment.h"
+#include "batch.h"
+
+#define	BATCH_MAX_NUMBER	(1000)		// numbered copies of a file name tried in one directory
+#define	BATCH_FILE_ROOM		(1+MAX_NAME_LENGTH+4)	// "/NAME.NNN" after an output directory
+
+// block as recorded in the manifest
+struct SBatchBlock
+{
+	uint16_t		iBlockNum;
+	uint16_t		iBlockLen;
+	uint8_t			iBlockFlag;
+	double			iSpeed;
+	SBlockQuality	iQuality;
+};
+
+// file as recorded in the manifest
+struct SBatchFile
+{
+	SBlockHeader	iHdr;			// header of first block
+	char			iPath[BATCH_MAX_PATH];	// where it was written, empty if it couldn't be created
+	uint32_t		iLength;		// bytes written
+	bool			iComplete;		// final block was seen
+	std::vector<SBatchBlock>	iBlocks;
+};
+
+// error as recorded in the manifest
+struct SBatchError
+{
+	uint32_t		iBlockNum;		// block expected
+	uint32_t		iErr;			// see CDecoder::TError
+	bool			iHasName;		// a header was read
+	char			iName[MAX_NAME_LENGTH+1];	// file name from the header
+};
+
+// Output decoder for one input; writes files to its directory and keeps a
+// record of them for the manifest
+class CBatchDecoder : public CDecoder
+{
+public:
+	CBatchDecoder(const char* aDir) : iDir(aDir), iFile(0) {}
+	~CBatchDecoder() { Close(); }
+	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData);
+	virtual void File(const SBlockHeader* aHdr);
+	virtual void Eof();
+	virtual void Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr);
+	void Close();
+public:
+	const char*		iDir;			// output directory
+	FILE*			iFile;			// file being written
+	std::vector<SBatchFile>		iFiles;
+	std::vector<SBatchError>	iErrors;
+};
+
+void CBatchDecoder::Block(const SBlockHeader* aHdr, const uint8_t* aData)
+{
+	if (iFiles.empty())
+		return;
+	SBatchFile& f = iFiles.back();
+	SBatchBlock b;
+	b.iBlockNum = aHdr->iBlockNum;
+	b.iBlockLen = aHdr->iBlockLen;
+	b.iBlockFlag = aHdr->iBlockFlag;
+	b.iSpeed = aHdr->iSpeed;
+	b.iQuality = aHdr->iQuality;
+	f.iBlocks.push_back(b);
+	if (iFile)
+	{
+		fwrite(aData, 1, aHdr->iBlockLen, iFile);
+		f.iLength += aHdr->iBlockLen;
+	}
+}
+
+void CBatchDecoder::File(const SBlockHeader* aHdr)
+{
+	Close();
+	iFiles.emplace_back();
+	SBatchFile& f = iFiles.back();
+	f.iHdr = *aHdr;
+	f.iLength = 0;
+	f.iComplete = false;
+	uint32_t i;
+	for (i=0; i<BATCH_MAX_NUMBER; ++i)
+	{
+		int n = snprintf(f.iPath, BATCH_MAX_PATH, "%s/%s.%03u", iDir, aHdr->iName, i);
+		if (n < 0 || n >= BATCH_MAX_PATH)
+		{
+			// CBatch::AddInput leaves room for any name, so this shouldn't happen
+			fprintf(stderr, "Path too long for %s in %s\n", aHdr->iName, iDir);
+			f.iPath[0] = 0;
+			return;
+		}
+		FILE* x = fopen(f.iPath, "r");
+		if (!x)
+			break;
+		fclose(x);
+	}
+	iFile = fopen(f.iPath, "wb");
+	if (!iFile)
+	{
+		fprintf(stderr, "Can't create %s\n", f.iPath);
+		f.iPath[0] = 0;
+	}
+}
+
+void CBatchDecoder::Eof()
+{
+	if (!iFiles.empty())
+		iFiles.back().iComplete = true;
+	Close();
+}
+
+void CBatchDecoder::Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr)
+{
+	SBatchError e;
+	e.iBlockNum = aBlockNum;
+	e.iErr = aErr;
+	e.iHasName = (aHdr != 0);
+	if (aHdr)
+		memcpy(e.iName, aHdr->iName, sizeof(e.iName));
+	iErrors.push_back(e);
+}
+
+void CBatchDecoder::Close()
+{
+	if (iFile)
+		fclose(iFile);
+	iFile = 0;
+}
+
+// create directory aPath if it doesn't already exist
+static void make_dir(const char* aPath)
+{
+#ifdef _WIN32
+	CreateDirectoryA(aPath, 0);
+#else
+	mkdir(aPath, 0777);
+#endif
+}
+
+// name ends in .wav, in any case
+static bool is_wav_name(const char* aName)
+{
+	size_t n = strlen(aName);
+	if (n < 4)
+		return false;
+#ifdef _WIN32
+	return _stricmp(aName + n - 4, ".wav") == 0;
+#else
+	return strcasecmp(aName + n - 4, ".wav") == 0;
+#endif
+}
+
+// aDir/aName in a new buffer, however long it is, to be freed by the caller
+static char* join_path(const char* aDir, const char* aName)
+{
+	size_t n = strlen(aDir) + strlen(aName) + 2;
+	char* path = (char*)malloc(n);
+	snprintf(path, n, "%s/%s", aDir, aName);
+	return path;
+}
+
+// Add the paths of the WAV files in aDir to aNames. Returns false if
+// aDir isn't a directory. Paths too long for BATCH_MAX_PATH are added as
+// they are, so that CBatch::AddInput can record them as failed.
+static bool list_wav_files(const char* aDir, std::vector<char*>& aNames)
+{
+#ifdef _WIN32
+	DWORD attr = GetFileAttributesA(aDir);
+	if (attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY))
+		return false;
+	WIN32_FIND_DATAA fd;
+	char* pattern = join_path(aDir, "*.wav");
+	HANDLE h = FindFirstFileA(pattern, &fd);
+	free(pattern);
+	if (h == INVALID_HANDLE_VALUE)
+		return true;
+	do
+	{
+		if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && is_wav_name(fd.cFileName))
+			aNames.push_back(join_path(aDir, fd.cFileName));
+	} while (FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	DIR* d = opendir(aDir);
+	if (!d)
+		return false;
+	struct dirent* e;
+	while ((e = readdir(d)) != 0)
+	{
+		if (!is_wav_name(e->d_name))
+			continue;
+		struct stat st;
+		char* path = join_path(aDir, e->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			aNames.push_back(path);
+		else
+			free(path);
+	}
+	closedir(d);
+#endif
+	return true;
+}
+
+static bool less_name(const char* aA, const char* aB)
+{
+	return strcmp(aA, aB) < 0;
+}
+
+// Write aStr as a JSON string. Bytes from the tape above 0x7f are taken to
+// be Latin-1 if aLatin1 is set; otherwise they are copied, as for paths,
+// which are assumed to be UTF-8 already.
+static void json_string(FILE* aFile, const char* aStr, bool aLatin1)
+{
+	fputc('"', aFile);
+	for (; *aStr; ++aStr)
+	{
+		uint8_t c = (uint8_t)*aStr;
+		if (c == '"' || c == '\\')
+			fprintf(aFile, "\\%c", c);
+		else if (c < 0x20 || c == 0x7f || (c > 0x7f && aLatin1))
+			fprintf(aFile, "\\u%04x", c);
+		else
+			fputc(c, aFile);
+	}
+	fputc('"', aFile);
+}
+
+// level relative to full scale in dB, null if there was no signal
+static void json_dbfs(FILE* aFile, double aLevel, double aFullScale)
+{
+	if (aLevel > 0)
+		fprintf(aFile, "%.2f", 20 * log10(aLevel / aFullScale));
+	else
+		fprintf(aFile, "null");
+}
+
+// signal quality of a block, with levels relative to full scale
+static void json_quality(FILE* aFile, const SBlockQuality& aQuality, double aFullScale)
+{
+	fprintf(aFile, "{ \"bits\": %u, \"snr_db\": %.2f, \"margin_bins\": [", aQuality.iBits, aQuality.iSnr);
+	uint32_t i;
+	for (i=0; i<QUALITY_MARGIN_BINS; ++i)
+		fprintf(aFile, "%s%u", i ? ", " : "", aQuality.iMarginBins[i]);
+	fprintf(aFile, "], \"jitter\": %.4f, \"resyncs\": %u, \"dc_offset\": %.5f, \"level_dbfs\": ",
+		aQuality.iJitter, aQuality.iResyncs, aQuality.iDcOffset / aFullScale);
+	json_dbfs(aFile, aQuality.iLevel, aFullScale);
+	fprintf(aFile, ", \"peak_dbfs\": ");
+	json_dbfs(aFile, aQuality.iPeak, aFullScale);
+	fprintf(aFile, " }");
+}
+
+CBatch::CBatch(const char* aOutDir, CDemodFactory* aFactory, uint32_t aThreads)
+:	iFactory(aFactory),
+	iThreads(aThreads),
+	iInputs(0),
+	iCount(0),
+	iMax(0),
+	iQueues(0),
+	iQueueLocks(0),
+	iOutstanding(0),
+	iEpoch(0)
+{
+	snprintf(iOutDir, BATCH_MAX_PATH, "%s", aOutDir);
+	iEpoch = Now();
+}
+
+CBatch::~CBatch()
+{
+	uint32_t i;
+	for (i=0; i<iCount; ++i)
+	{
+		delete iInputs[i]->iDecoder;
+		delete iInputs[i];
+	}
+	free(iInputs);
+	delete[] iQueueLocks;
+	delete[] iQueues;
+}
+
+// Add the WAV files in directory aPath, in name order, or else those
+// listed one per line in file aPath. Returns false if aPath can't be read.
+bool CBatch::Add(const char* aPath)
+{
+	std::vector<char*> names;
+	char path[BATCH_MAX_PATH+1];	// one over, so that AddInput sees a name that's too long
+	uint32_t i;
+	if (list_wav_files(aPath, names))
+	{
+		std::sort(names.begin(), names.end(), less_name);
+		for (i=0; i<names.size(); ++i)
+		{
+			AddInput(names[i]);
+			free(names[i]);
+		}
+		return true;
+	}
+	FILE* f = fopen(aPath, "r");
+	if (!f)
+		return false;
+	while (fgets(path, sizeof(path), f))
+	{
+		size_t n = strlen(path);
+		if (n == BATCH_MAX_PATH && path[n-1] != '\n')
+		{
+			// skip the rest of a name that's too long
+			int c;
+			while ((c = fgetc(f)) != EOF && c != '\n')
+				;
+		}
+		while (n > 0 && (path[n-1] == '\n' || path[n-1] == '\r'))
+			path[--n] = 0;
+		if (n > 0)
+			AddInput(path);
+	}
+	fclose(f);
+	return true;
+}
+
+// Add one WAV file. Its output directory is named after it, with a suffix
+// if an earlier input has the same name. If its path, or its output
+// directory with room for a file name from the tape, doesn't fit in
+// BATCH_MAX_PATH, it's recorded as failed rather than decoded.
+void CBatch::AddInput(const char* aName)
+{
+	if (iCount == iMax)
+	{
+		iMax = iMax ? iMax * 2 : 64;
+		iInputs = (SBatchInput**)realloc(iInputs, iMax * sizeof(SBatchInput*));
+	}
+	SBatchInput* in = new SBatchInput;
+	int n = snprintf(in->iName, BATCH_MAX_PATH, "%s", aName);
+	in->iTooLong = (n < 0 || n >= BATCH_MAX_PATH);
+	const char* base = aName;
+	const char* p;
+	for (p=aName; *p; ++p)
+	{
+		if (*p == '/' || *p == '\\' || *p == ':')
+			base = p + 1;
+	}
+	char stem[BATCH_MAX_PATH];
+	snprintf(stem, BATCH_MAX_PATH, "%s", base);
+	if (is_wav_name(stem))
+		stem[strlen(stem) - 4] = 0;
+	n = snprintf(in->iOutDir, BATCH_MAX_PATH, "%s/%s", iOutDir, stem);
+	uint32_t i;
+	uint32_t copy = 1;
+	for (i=0; i<iCount; ++i)
+	{
+		if (strcmp(iInputs[i]->iOutDir, in->iOutDir) == 0)
+		{
+			n = snprintf(in->iOutDir, BATCH_MAX_PATH, "%s/%s_%u", iOutDir, stem, ++copy);
+			i = (uint32_t)-1;		// check the new name too
+		}
+	}
+	if (n < 0 || n + BATCH_FILE_ROOM >= BATCH_MAX_PATH)
+		in->iTooLong = true;
+	in->iSrc = 0;
+	in->iSegmenter = 0;
+	in->iDecoder = 0;
+	in->iSegments = 0;
+	in->iRemaining = 0;
+	in->iFullScale = 1;
+	in->iDuration = 0;
+	in->iStart = 0;
+	in->iTime = 0;
+	in->iError = EWavOk;
+	iInputs[iCount++] = in;
+}
+
+double CBatch::Now() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count() - iEpoch;
+}
+
+// Decode every input, then write the manifest. Returns false if an input
+// couldn't be read or the manifest couldn't be written.
+bool CBatch::Run()
+{
+	uint32_t i;
+	make_dir(iOutDir);
+	iQueues = new std::deque<SBatchTask>[iThreads];
+	iQueueLocks = new std::mutex[iThreads];
+	for (i=iCount; i-- > 0;)
+		Push(i % iThreads, i, -1);
+	std::thread** threads = new std::thread*[iThreads];
+	for (i=0; i<iThreads; ++i)
+		threads[i] = new std::thread(&CBatch::Worker, this, i);
+	for (i=0; i<iThreads; ++i)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	delete[] threads;
+	double t = Now();
+	printf("Decoded %u inputs in %.2f s\n", iCount, t);
+	bool ok = true;
+	for (i=0; i<iCount; ++i)
+	{
+		if (iInputs[i]->iError || iInputs[i]->iTooLong)
+			ok = false;
+	}
+	return WriteManifest(t) && ok;
+}
+
+void CBatch::Worker(uint32_t aIndex)
+{
+	SBatchTask t;
+	for (;;)
+	{
+		if (Take(aIndex, t))
+		{
+			if (t.iSegment < 0)
+				Open(aIndex, t.iInput);
+			else
+				Decode(t.iInput, (uint32_t)t.iSegment);
+			--iOutstanding;
+			continue;
+		}
+		if (iOutstanding == 0)
+			return;
+		// the tasks still running may queue more
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+// Take a task from the back of queue aIndex, or else from the front of
+// another thread's queue
+bool CBatch::Take(uint32_t aIndex, SBatchTask& aTask)
+{
+	uint32_t i;
+	for (i=0; i<iThreads; ++i)
+	{
+		uint32_t q = (aIndex + i) % iThreads;
+		std::unique_lock<std::mutex> lock(iQueueLocks[q]);
+		if (iQueues[q].empty())
+			continue;
+		if (i == 0)
+		{
+			aTask = iQueues[q].back();
+			iQueues[q].pop_back();
+		}
+		else
+		{
+			aTask = iQueues[q].front();
+			iQueues[q].pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+void CBatch::Push(uint32_t aIndex, uint32_t aInput, int32_t aSegment)
+{
+	SBatchTask t;
+	t.iInput = aInput;
+	t.iSegment = aSegment;
+	++iOutstanding;
+	std::unique_lock<std::mutex> lock(iQueueLocks[aIndex]);
+	iQueues[aIndex].push_back(t);
+}
+
+// Open an input, split it into segments and queue them on this thread,
+// first segment last so that it is taken first
+void CBatch::Open(uint32_t aIndex, uint32_t aInput)
+{
+	SBatchInput& in = *iInputs[aInput];
+	in.iStart = Now();
+	in.iDecoder = new CBatchDecoder(in.iOutDir);
+	if (in.iTooLong)
+	{
+		fprintf(stderr, "%s: path too long\n", in.iName);
+		return;
+	}
+	make_dir(in.iOutDir);
+	in.iSrc = new CWavFile(in.iName, false);
+	if (in.iSrc->Error())
+	{
+		in.iError = in.iSrc->Error();
+		fprintf(stderr, "%s: %s\n", in.iName, CSampleSource::ErrorText(in.iError));
+		delete in.iSrc;
+		in.iSrc = 0;
+		in.iTime = Now() - in.iStart;
+		return;
+	}
+	in.iDuration = (double)in.iSrc->Length() / in.iSrc->SampleRate();
+	in.iFullScale = in.iSrc->FullScale();
+	CFrontEnd* pFrontEnd = iFactory->NewFrontEnd((double)in.iSrc->SampleRate());
+	uint32_t align = pFrontEnd ? pFrontEnd->Decimation() : 1;
+	delete pFrontEnd;
+	in.iSegmenter = new CSegmenter(in.iSrc, in.iDecoder, 1, align);
+	in.iSegments = in.iSegmenter->Split(BATCH_SEGMENT_TIME);
+	in.iRemaining = in.iSegments;
+	uint32_t i;
+	for (i=in.iSegments; i-- > 0;)
+		Push(aIndex, aInput, (int32_t)i);
+}
+
+void CBatch::Decode(uint32_t aInput, uint32_t aSegment)
+{
+	SBatchInput& in = *iInputs[aInput];
+	double fs = (double)in.iSrc->SampleRate();
+	CFrontEnd* pFrontEnd = iFactory->NewFrontEnd(fs);
+	double demodFs = pFrontEnd ? pFrontEnd->OutputRate() : fs;
+	CDemodulator* pDemod = iFactory->NewDemodulator(demodFs, in.iSrc->BitsPerSample());
+	in.iSegmenter->Decode(aSegment, pFrontEnd, pDemod);
+	if (--in.iRemaining == 0)
+		Finish(aInput);
+}
+
+// all segments of an input are done; write its files
+void CBatch::Finish(uint32_t aInput)
+{
+	SBatchInput& in = *iInputs[aInput];
+	in.iSegmenter->Finish();
+	in.iDecoder->Close();
+	delete in.iSegmenter;
+	in.iSegmenter = 0;
+	in.iError = in.iSrc->Error();
+	if (in.iError)
+		fprintf(stderr, "%s: %s\n", in.iName, CSampleSource::ErrorText(in.iError));
+	delete in.iSrc;
+	in.iSrc = 0;
+	in.iTime = Now() - in.iStart;
+	uint32_t blocks = 0;
+	uint32_t i;
+	for (i=0; i<in.iDecoder->iFiles.size(); ++i)
+		blocks += (uint32_t)in.iDecoder->iFiles[i].iBlocks.size();
+	printf("%s: %u files, %u blocks, %u errors, %.2f s\n", in.iName, (uint32_t)in.iDecoder->iFiles.size(), blocks, (uint32_t)in.iDecoder->iErrors.size(), in.iTime);
+}
+
+bool CBatch::WriteManifest(double aTime)
+{
+	char path[BATCH_MAX_PATH];
+	int n = snprintf(path, BATCH_MAX_PATH, "%s/%s", iOutDir, BATCH_MANIFEST);
+	if (n < 0 || n >= BATCH_MAX_PATH)
+	{
+		fprintf(stderr, "Path too long for %s in %s\n", BATCH_MANIFEST, iOutDir);
+		return false;
+	}
+	FILE* f = fopen(path, "w");
+	if (!f)
+	{
+		fprintf(stderr, "Can't create %s\n", path);
+		return false;
+	}
+	uint32_t i;
+	uint32_t j;
+	uint32_t k;
+	fprintf(f, "{\n\t\"threads\": %u,\n\t\"seconds\": %.3f,\n\t\"inputs\": [", iThreads, aTime);
+	for (i=0; i<iCount; ++i)
+	{
+		const SBatchInput& in = *iInputs[i];
+		const CBatchDecoder& d = *in.iDecoder;
+		fprintf(f, "%s\n\t\t{\n\t\t\t\"input\": ", i ? "," : "");
+		json_string(f, in.iName, false);
+		fprintf(f, ",\n\t\t\t\"output\": ");
+		json_string(f, in.iOutDir, false);
+		fprintf(f, ",\n\t\t\t\"duration\": %.3f,\n\t\t\t\"segments\": %u,\n\t\t\t\"start\": %.3f,\n\t\t\t\"seconds\": %.3f,\n\t\t\t\"error\": ",
+			in.iDuration, in.iSegments, in.iStart, in.iTime);
+		if (in.iTooLong)
+			json_string(f, "path too long", false);
+		else if (in.iError)
+			json_string(f, CSampleSource::ErrorText(in.iError), false);
+		else
+			fprintf(f, "null");
+		fprintf(f, ",\n\t\t\t\"files\": [");
+		for (j=0; j<d.iFiles.size(); ++j)
+		{
+			const SBatchFile& file = d.iFiles[j];
+			fprintf(f, "%s\n\t\t\t\t{\n\t\t\t\t\t\"name\": ", j ? "," : "");
+			json_string(f, file.iHdr.iName, true);
+			fprintf(f, ",\n\t\t\t\t\t\"path\": ");
+			if (file.iPath[0])
+				json_string(f, file.iPath, false);
+			else
+				fprintf(f, "null");
+			fprintf(f, ",\n\t\t\t\t\t\"load\": %u,\n\t\t\t\t\t\"exec\": %u,\n\t\t\t\t\t\"length\": %u,\n\t\t\t\t\t\"complete\": %s,\n\t\t\t\t\t\"blocks\": [",
+				file.iHdr.iLoadAddr, file.iHdr.iExecAddr, file.iLength, file.iComplete ? "true" : "false");
+			for (k=0; k<file.iBlocks.size(); ++k)
+			{
+				const SBatchBlock& b = file.iBlocks[k];
+				fprintf(f, "%s\n\t\t\t\t\t\t{ \"block\": %u, \"length\": %u, \"flag\": %u, \"speed\": %.4f, \"quality\": ",
+					k ? "," : "", b.iBlockNum, b.iBlockLen, b.iBlockFlag, b.iSpeed);
+				json_quality(f, b.iQuality, in.iFullScale);
+				fprintf(f, " }");
+			}
+			fprintf(f, "\n\t\t\t\t\t]\n\t\t\t\t}");
+		}
+		fprintf(f, "\n\t\t\t],\n\t\t\t\"errors\": [");
+		for (j=0; j<d.iErrors.size(); ++j)
+		{
+			const SBatchError& e = d.iErrors[j];
+			fprintf(f, "%s\n\t\t\t\t{ \"block\": %u, \"name\": ", j ? "," : "", e.iBlockNum);
+			if (e.iHasName)
+				json_string(f, e.iName, true);
+			else
+				fprintf(f, "null");
+			fprintf(f, ", \"code\": %u, \"errors\": [", e.iErr);
+			const char* sep = "";
+			for (k=0; k<DECODER_ERROR_BITS; ++k)
+			{
+				if (e.iErr & (1U<<k))
+				{
+					fprintf(f, "%s\"%s\"", sep, CDecoder::ErrorName(k));
+					sep = ", ";
+				}
+			}
+			fprintf(f, "] }");
+		}
+		fprintf(f, "\n\t\t\t]\n\t\t}");
+	}
+	fprintf(f, "\n\t]\n}\n");
+	bool ok = (ferror(f) == 0);
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		fprintf(stderr, "Problem writing %s\n", path);
+	return ok;
+}
@@ -0,0 +1,116 @@
+/*
+* Header file for batch decoding of many captures
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+#define	BATCH_SEGMENT_TIME	(300.0)				// captures are split into segments of at least this many seconds
+#define	BATCH_MANIFEST		"manifest.json"		// written to the output directory
+#define	BATCH_MAX_PATH		(1024)				// longest path of an input or output file
+
+class CWavFile;
+class CFrontEnd;
+class CDemodulator;
+class CSegmenter;
+class CBatchDecoder;
+
+// makes the front end and demodulator for each piece of work
+class CDemodFactory
+{
+public:
+	virtual CFrontEnd* NewFrontEnd(double aFs)=0;	// 0 for none
+	virtual CDemodulator* NewDemodulator(double aFs, uint32_t aBitsPerSample)=0;
+};
+
+// one WAV file of the batch
+struct SBatchInput
+{
+	char			iName[BATCH_MAX_PATH];		// path of WAV file
+	char			iOutDir[BATCH_MAX_PATH];	// directory its files are written to
+	CWavFile*		iSrc;			// while being decoded
+	CSegmenter*		iSegmenter;		// while being decoded
+	CBatchDecoder*	iDecoder;		// writes the files and records them for the manifest
+	uint32_t		iSegments;		// number of segments the capture was split into
+	std::atomic<uint32_t>	iRemaining;	// segments still to be decoded
+	double			iDuration;		// length of capture in seconds
+	double			iFullScale;		// sample magnitude of a full scale signal, for levels in the manifest
+	double			iStart;			// when decoding started, seconds after the batch started
+	double			iTime;			// seconds taken to decode
+	TWavError		iError;			// why the WAV file couldn't be read, if it couldn't
+	bool			iTooLong;		// its path or output directory didn't fit in BATCH_MAX_PATH
+};
+
+// piece of work for the thread pool
+struct SBatchTask
+{
+	uint32_t		iInput;			// index into CBatch::iInputs
+	int32_t			iSegment;		// segment to decode, or -1 to open and split the input
+};
+
+/*
+* Decodes many WAV files, given as a directory or a file listing them, on
+* a work-stealing pool of threads. Each thread has its own queue, and takes
+* work from the back of it, or from the front of another thread's queue
+* when its own is empty. The inputs are dealt out among the queues first.
+* Opening an input splits it at leaders into segments of at least
+* BATCH_SEGMENT_TIME seconds with CSegmenter, and queues the segments on
+* the opening thread, where idle threads can steal them, so one long
+* capture doesn't hold up the end of the batch. Whichever thread decodes
+* the last segment of an input passes the results on in order. Each input
+* has its own output directory under the output root, named after it, and
+* a manifest of every input, file, block (with the signal quality the
+* demodulator measured over it), error and timing is written to
+* BATCH_MANIFEST in the output root at the end. An input which can't be
+* read is recorded in the manifest with its error, and the rest carry on.
+*/
+class CBatch
+{
+public:
+	CBatch(const char* aOutDir, CDemodFactory* aFactory, uint32_t aThreads);
+	~CBatch();
+	bool Add(const char* aPath);
+	uint32_t Count() const { return iCount; }
+	bool Run();
+private:
+	void AddInput(const char* aName);
+	void Worker(uint32_t aIndex);
+	bool Take(uint32_t aIndex, SBatchTask& aTask);
+	void Push(uint32_t aIndex, uint32_t aInput, int32_t aSegment);
+	void Open(uint32_t aIndex, uint32_t aInput);
+	void Decode(uint32_t aInput, uint32_t aSegment);
+	void Finish(uint32_t aInput);
+	bool WriteManifest(double aTime);
+	double Now() const;
+private:
+	char			iOutDir[BATCH_MAX_PATH];	// output root
+	CDemodFactory*	iFactory;
+	uint32_t		iThreads;		// size of thread pool
+	SBatchInput**	iInputs;		// in the order they were added
+	uint32_t		iCount;			// number of inputs
+	uint32_t		iMax;			// size of iInputs
+	std::deque<SBatchTask>*	iQueues;	// one per thread
+	std::mutex*		iQueueLocks;	// one per thread
+	std::atomic<uint32_t>	iOutstanding;	// tasks queued or running
+	double			iEpoch;			// steady clock seconds when the batch started
+};
@@ -1 +1,3 @@
-g++ -Ofast -o tape_reader tape_reader.cpp wav.cpp demod.cpp decoder.cpp -lm
+LIBSRC="wav.cpp cpu.cpp stream.cpp pipeline.cpp frontend.cpp demod.cpp demod_simd.cpp demod_fixed.cpp demod_rate.cpp demod_pulse.cpp fallback.cpp gate.cpp bank.cpp merge.cpp segment.cpp batch.cpp index.cpp checkpoint.cpp decoder.cpp eventlog.cpp stats.cpp serial.cpp tapereader.cpp"
+LIBOBJ=`echo $LIBSRC | sed 's/\.cpp/.o/g'`
+g++ -Ofast -c $LIBSRC && ar rcs libtapereader.a $LIBOBJ && rm -f $LIBOBJ && g++ -Ofast -o tape_reader tape_reader.cpp libtapereader.a -lm -pthread
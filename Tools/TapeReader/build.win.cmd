@@ -1,4 +1,5 @@
 @setlocal
+@set LIBSRC=wav.cpp cpu.cpp stream.cpp pipeline.cpp frontend.cpp demod.cpp demod_simd.cpp demod_fixed.cpp demod_rate.cpp demod_pulse.cpp fallback.cpp gate.cpp bank.cpp merge.cpp segment.cpp batch.cpp index.cpp checkpoint.cpp decoder.cpp eventlog.cpp stats.cpp serial.cpp tapereader.cpp
 @call :search cl.exe
 @if "%__searchres%"=="" (
     goto :gcc
@@ -10,12 +11,12 @@
 
 :msvc
 @echo Building with MSVC
-cl /nologo /O2 /Fe:tape_reader.exe tape_reader.cpp wav.cpp demod.cpp decoder.cpp
+cl /nologo /O2 /c %LIBSRC% && lib /nologo /out:tapereader.lib wav.obj cpu.obj stream.obj pipeline.obj frontend.obj demod.obj demod_simd.obj demod_fixed.obj demod_rate.obj demod_pulse.obj fallback.obj gate.obj bank.obj merge.obj segment.obj batch.obj index.obj checkpoint.obj decoder.obj eventlog.obj stats.obj serial.obj tapereader.obj && del wav.obj cpu.obj stream.obj pipeline.obj frontend.obj demod.obj demod_simd.obj demod_fixed.obj demod_rate.obj demod_pulse.obj fallback.obj gate.obj bank.obj merge.obj segment.obj batch.obj index.obj checkpoint.obj decoder.obj eventlog.obj stats.obj serial.obj tapereader.obj && cl /nologo /O2 /Fe:tape_reader.exe tape_reader.cpp tapereader.lib
 @goto :eof
 
 :gcc
 @echo Building with GCC
-g++ -Ofast -o tape_reader.exe tape_reader.cpp wav.cpp demod.cpp decoder.cpp -lm
+g++ -Ofast -c %LIBSRC% && ar rcs libtapereader.a wav.o cpu.o stream.o pipeline.o frontend.o demod.o demod_simd.o demod_fixed.o demod_rate.o demod_pulse.o fallback.o gate.o bank.o merge.o segment.o batch.o index.o checkpoint.o decoder.o eventlog.o stats.o serial.o tapereader.o && del wav.o cpu.o stream.o pipeline.o frontend.o demod.o demod_simd.o demod_fixed.o demod_rate.o demod_pulse.o fallback.o gate.o bank.o merge.o segment.o batch.o index.o checkpoint.o decoder.o eventlog.o stats.o serial.o tapereader.o && g++ -Ofast -o tape_reader.exe tape_reader.cpp libtapereader.a -lm -pthread
 @goto :eof
 
 :search
@@ -0,0 +1,106 @@
+/*
+* Saving and restoring the state of a decode
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "checkpoint.h"
+
+CCheckpoint::CCheckpoint(const char* aPath, bool aRestore)
+:	iFits(false),
+	iRestore(aRestore),
+	iFile(0),
+	iOk(false)
+{
+	snprintf(iPath, CHECKPOINT_MAX_PATH, "%s", aPath);
+	int n = snprintf(iTemp, CHECKPOINT_MAX_PATH, "%s%s", aPath, CHECKPOINT_TEMP_SUFFIX);
+	iFits = (n >= 0 && n < CHECKPOINT_MAX_PATH);
+}
+
+CCheckpoint::~CCheckpoint()
+{
+	if (iFile)
+	{
+		fclose(iFile);
+		if (!iRestore)
+			remove(iTemp);
+	}
+}
+
+// True if aPath, and every name made from it by adding a suffix, fits in
+// CHECKPOINT_MAX_PATH
+bool CCheckpoint::PathFits(const char* aPath)
+{
+	return strlen(aPath) + strlen(CHECKPOINT_LOG_SUFFIX) + strlen(CHECKPOINT_TEMP_SUFFIX) < CHECKPOINT_MAX_PATH;
+}
+
+// Start saving or restoring. Returns false if there is no checkpoint to
+// restore, it was written by a different version, or the path was too long.
+bool CCheckpoint::Open()
+{
+	if (!iFits)
+		return false;
+	iFile = fopen(iRestore ? iPath : iTemp, iRestore ? "rb" : "wb");
+	if (!iFile)
+		return false;
+	iOk = true;
+	uint32_t magic = CHECKPOINT_MAGIC;
+	uint32_t version = CHECKPOINT_VERSION;
+	Check(magic);
+	Check(version);
+	return iOk;
+}
+
+// Finish saving or restoring. Returns false if anything went wrong, or a
+// restore didn't use exactly what was saved.
+bool CCheckpoint::Close()
+{
+	if (!iFile)
+		return false;
+	if (iRestore && fgetc(iFile) != EOF)
+		iOk = false;
+	if (fclose(iFile) != 0)
+		iOk = false;
+	iFile = 0;
+	if (iRestore)
+		return iOk;
+	if (iOk)
+	{
+#ifdef _WIN32
+		// rename() won't replace an existing file on Windows
+		remove(iPath);
+#endif
+		iOk = (rename(iTemp, iPath) == 0);
+	}
+	if (!iOk)
+		remove(iTemp);
+	return iOk;
+}
+
+void CCheckpoint::State(void* aPtr, size_t aLen)
+{
+	if (!iOk || aLen == 0)
+		return;
+	if (iRestore)
+		iOk = (fread(aPtr, 1, aLen, iFile) == aLen);
+	else
+		iOk = (fwrite(aPtr, 1, aLen, iFile) == aLen);
+}
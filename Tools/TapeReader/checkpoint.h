@@ -0,0 +1,79 @@
+/*
+* Header file for saving and restoring the state of a decode
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+#define	CHECKPOINT_MAGIC		(0x50434954U)	// "TICP" little endian
+#define	CHECKPOINT_VERSION		(5)
+#define	CHECKPOINT_INTERVAL		(30.0)		// default seconds between checkpoints
+#define	CHECKPOINT_MAX_PATH		(1024)
+#define	CHECKPOINT_TEMP_SUFFIX	".tmp"		// checkpoint being written
+#define	CHECKPOINT_LOG_SUFFIX	".files"	// output files created, one per line
+
+/*
+* Checkpoint file holding the state of a decode, so that it can be carried
+* on from the same point if the process is killed. Each object passes its
+* members to State() in the same order whether saving or restoring, so one
+* function does both. Values are written as they are in memory, so a
+* checkpoint is only good for the build which wrote it. Check() records a
+* value when saving and fails the restore if it differs, to catch a resume
+* with a different input or options. A checkpoint is written to a
+* temporary file and renamed over the last one when complete, so a process
+* killed while saving leaves the previous checkpoint intact.
+*/
+class CCheckpoint
+{
+public:
+	CCheckpoint(const char* aPath, bool aRestore);
+	~CCheckpoint();
+	static bool PathFits(const char* aPath);
+	bool Open();
+	bool Close();
+	bool Restoring() const { return iRestore; }
+	void State(void* aPtr, size_t aLen);
+	template<class T> void State(T& aValue) { State(&aValue, sizeof(T)); }
+	template<class T> void State(std::vector<T>& aVector)
+	{
+		uint64_t n = aVector.size();
+		State(n);
+		if (iRestore)
+			aVector.resize(iOk ? (size_t)n : 0);
+		if (!aVector.empty())
+			State(&aVector[0], aVector.size() * sizeof(T));
+	}
+	template<class T> void Check(T aValue)
+	{
+		T v = aValue;
+		State(v);
+		if (iRestore && v != aValue)
+			iOk = false;
+	}
+private:
+	char			iPath[CHECKPOINT_MAX_PATH];
+	char			iTemp[CHECKPOINT_MAX_PATH];	// written and renamed to iPath
+	bool			iFits;			// aPath and the temporary name fitted
+	bool			iRestore;		// reading state back rather than saving it
+	FILE*			iFile;
+	bool			iOk;			// no error so far
+};
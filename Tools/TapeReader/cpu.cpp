@@ -0,0 +1,64 @@
+/*
+* CPU feature detection
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "cpu.h"
+
+#ifdef HAVE_SSE2
+#if !defined(__GNUC__)
+#include <intrin.h>
+
+// check CPUID leaf 1 ECX bit aBit, and that the OS saves YMM state
+static bool CpuHasAvxFeature(int aBit)
+{
+	int r[4];
+	__cpuid(r, 1);
+	if ((r[2] & (1<<27)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;			// no OSXSAVE or OS doesn't save YMM state
+	return (r[2] & (1<<aBit)) != 0;
+}
+#endif
+
+bool CpuHasAvx2()
+{
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	int r[4];
+	__cpuid(r, 0);
+	if (r[0] < 7 || !CpuHasAvxFeature(28))
+		return false;
+	__cpuidex(r, 7, 0);
+	return (r[1] & (1<<5)) != 0;
+#endif
+}
+
+bool CpuHasFma()
+{
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("fma") != 0;
+#else
+	return CpuHasAvxFeature(12);
+#endif
+}
+#endif
@@ -0,0 +1,40 @@
+/*
+* Header file for CPU feature detection
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Compile time SIMD support and run time CPU feature checks. HAVE_SSE2 is
+// defined when SSE2 can be assumed; AVX2 and FMA code must be marked with
+// TARGET_AVX2/TARGET_AVX2_FMA and only called if the CPU supports it.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define	HAVE_SSE2
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define	TARGET_AVX2		__attribute__((target("avx2")))
+#define	TARGET_AVX2_FMA	__attribute__((target("avx2,fma")))
+#else
+#define	TARGET_AVX2
+#define	TARGET_AVX2_FMA
+#endif
+
+bool CpuHasAvx2();
+bool CpuHasFma();
+#endif
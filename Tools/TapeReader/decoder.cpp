@@ -21,9 +21,12 @@
 */
 
 #include "decoder.h"
+#include "checkpoint.h"
+#include "eventlog.h"
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <math.h>
 
 uint32_t CDecoder::Crc(const uint8_t* aData, uint32_t aCount, uint32_t aCrc)
 {
@@ -45,6 +48,32 @@ uint32_t CDecoder::Crc(const uint8_t* aData, uint32_t aCount, uint32_t aCrc)
     return aCrc;                            /* Return updated CRC */
 }
 
+static const char* const TheErrorNames[DECODER_ERROR_BITS] =
+{
+	"invalid_name",
+	"invalid_length",
+	"invalid_flag",
+	"header_crc",
+	"data_crc",
+	"unexpected_block",
+	"skipped_block",
+	"repeat_block",
+	"truncated_block",
+	"truncated_header",
+};
+
+const char* CDecoder::ErrorName(uint32_t aBit)
+{
+	return aBit < DECODER_ERROR_BITS ? TheErrorNames[aBit] : "unknown";
+}
+
+// check the big endian CRC in the last two of aCount bytes
+bool CDecoder::CrcValid(const uint8_t* aData, uint32_t aCount)
+{
+	uint32_t crc = (aData[aCount-2] << 8) | aData[aCount-1];
+	return Crc(aData, aCount-2, 0) == crc;
+}
+
 CDecoder::CDecoder()
 :	iLdr(0),
 	iState(ELeader),
@@ -54,8 +83,18 @@ CDecoder::CDecoder()
 	iIndex2(0),
 	iByte(0),
 	iShift(0),
-	iFileOpen(false)
+	iFileOpen(false),
+	iRecovery(0),
+	iEventLog(0),
+	iSpeedSum(0),
+	iSpeedCount(0),
+	iLastSpeed(0),
+	iHeaderLen(0),
+	iLeaderBit(0),
+	iDataBit(0)
 {
+	memset(&iCounts, 0, sizeof(iCounts));
+	memset(&iQualitySum, 0, sizeof(iQualitySum));
 	InitBlockHeader(iFirstBlock);
 	InitBlockHeader(iCurrentBlock);
 }
@@ -76,28 +115,85 @@ void CDecoder::BeginLeaderSearch(bool aFirstBlock)
 	{
 		iBlockNum = 0;
 	}
+	if (iRecovery)
+	{
+		iRecovery->BlockEnd();
+	}
 }
 
-void CDecoder::Bit(uint32_t aBit)
+// Save or restore the state machine, including any block part received.
+// The recovery source and verbosity are set up by the owner.
+void CDecoder::Checkpoint(CCheckpoint& aCp)
+{
+	aCp.State(iLdr);
+	aCp.State(iState);
+	aCp.State(iBitCount);
+	aCp.State(iBlockNum);
+	aCp.State(iFirstBlock);
+	aCp.State(iCurrentBlock);
+	aCp.State(iIndex);
+	aCp.State(iIndex2);
+	aCp.State(iByte);
+	aCp.State(iShift);
+	aCp.State(iFileOpen);
+	aCp.State(iSpeedSum);
+	aCp.State(iSpeedCount);
+	aCp.State(iLastSpeed);
+	aCp.State(iQualitySum);
+	aCp.State(iHeaderLen);
+	aCp.State(iLeaderBit);
+	aCp.State(iDataBit);
+	aCp.State(iHeader);
+	aCp.State(iBuffer);
+	aCp.State(iConf);
+}
+
+// Tables for Bits()
+struct SFramingTables
+{
+	uint16_t	iReverse[1024];		// 10 bits in reverse order, to shift bits received LSB first into iLdr
+	uint8_t		iIdle[256];			// number of 1 bits before the first 0, LSB first
+	constexpr SFramingTables()
+	:	iReverse(),
+		iIdle()
+	{
+		int i = 0;
+		for (; i<1024; ++i)
+		{
+			int r = 0;
+			int b = 0;
+			for (; b<10; ++b)
+			{
+				if ((i >> b) & 1)
+					r |= 1 << (9 - b);
+			}
+			iReverse[i] = (uint16_t)r;
+		}
+		for (i=0; i<256; ++i)
+		{
+			int n = 0;
+			while (n < 8 && ((i >> n) & 1))
+				++n;
+			iIdle[i] = (uint8_t)n;
+		}
+	}
+};
+static constexpr SFramingTables KFraming;
+
+void CDecoder::Bit(uint32_t aBit, uint32_t aConfidence)
 {
 	uint32_t bit = aBit ? 1 : 0;
-	uint32_t err = 0;
 	++iBitCount;
+	iLdr <<= 1;
+	iLdr |= bit;
+
+	if (iLdr == LEADER_PATTERN)
+	{
+		LeaderFound();
+		return;
+	}
 	if (iState == ELeader)
 	{
-		iLdr <<= 1;
-		iLdr |= bit;
-
-		// 1 1 0 0 1 0 1 0 1 0 0 1
-		if (iLdr == 0xFFFFFFFFFFFFFCA9ULL)
-		{
-//			printf("Leader detected at %u\n", iBitCount);
-			iState = EHeaderName;
-			iIndex = 0;
-			iIndex2 = 0;
-			iByte = 0;
-			iShift = 0;
-		}
 		return;
 	}
 	if (iShift==0)
@@ -113,19 +209,100 @@ void CDecoder::Bit(uint32_t aBit)
 		}
 	}
 	iByte |= (bit << iShift);
+	if (iShift >= 1 && iShift <= 8)
+	{
+		iConf[iIndex*8 + iShift - 1] = (aConfidence < 255) ? (uint8_t)aConfidence : 255;
+	}
 	++iShift;
 	if (iShift < 10)
 		return;
+	iShift = 0;
+	Byte();
+}
 
+/*
+* Same as calling Bit() for each of aCount bits packed LSB first in aPacked,
+* with confidences from aConf if given. While the last bits seen rule out
+* the leader pattern completing within a frame, leader and idle bits are
+* skipped up to a byte at a time and whole frames are taken at once, using
+* table lookups to keep iLdr up to date. Elsewhere, and for the last few
+* bits, it falls back to Bit().
+*/
+void CDecoder::Bits(const uint8_t* aPacked, uint32_t aCount, const uint8_t* aConf)
+{
+	uint32_t i = 0;
+	while (i < aCount)
+	{
+		if ((~iLdr & LEADER_SKIP_MASK) != 0 && i + 24 <= aCount && (iState == ELeader || iShift == 0))
+		{
+			const uint8_t* p = aPacked + (i >> 3);
+			uint32_t w = ((p[0] | (p[1] << 8) | (p[2] << 16)) >> (i & 7)) & 0x3FFU;
+			uint32_t n = (iState == ELeader) ? 8 : KFraming.iIdle[w & 0xFFU];
+			if (n > 0)
+			{
+				// leader search, or idle time between bytes
+				iLdr = (iLdr << n) | (KFraming.iReverse[w & ((1U << n) - 1)] >> (10 - n));
+				iBitCount += n;
+				i += n;
+				continue;
+			}
+			// start bit followed by a whole frame
+			iLdr = (iLdr << 10) | KFraming.iReverse[w];
+			iBitCount += 10;
+			if (aConf)
+				memcpy(iConf + iIndex*8, aConf + i + 1, 8);
+			else
+				memset(iConf + iIndex*8, 255, 8);
+			iByte = w;
+			i += 10;
+			Byte();
+			continue;
+		}
+		Bit((aPacked[i >> 3] >> (i & 7)) & 1, aConf ? aConf[i] : 255);
+		++i;
+	}
+}
+
+void CDecoder::LeaderFound()
+{
+//	printf("Leader detected at %u\n", iBitCount);
+	if (iState != ELeader)
+	{
+		// every framed byte has a 0 start bit, so this must be the
+		// next block's leader; bits have been lost from this block
+		BlockTruncated();
+	}
+	++iCounts.iLeaders;
+	if (iRecovery)
+	{
+		iRecovery->BlockStart();
+	}
+	iLeaderBit = iBitCount;
+	iSpeedSum = 0;
+	iSpeedCount = 0;
+	memset(&iQualitySum, 0, sizeof(iQualitySum));
+	memset(&iCurrentBlock.iQuality, 0, sizeof(iCurrentBlock.iQuality));
+	iState = EHeaderName;
+	iIndex = 0;
+	iIndex2 = 0;
+	iByte = 0;
+	iShift = 0;
+}
+
+// Complete frame received in iByte
+void CDecoder::Byte()
+{
+	uint32_t err = 0;
 //	printf("%1x %02x %1x\n", iByte>>9, (iByte>>1)&0xff, iByte&1);
 	if ((iByte & 0x201U) != 0x200U)
 	{
 		// start or stop bit corrupted
-		printf("%1x %02x %1x (%u)\n", iByte>>9, (iByte>>1)&0xff, iByte&1, iBitCount);
+		if (iEventLog && iEventLog->Enabled(ESeverityDebug))
+			iEventLog->Add(EEventFraming, ESeverityDebug, iBitCount, BlockName(), iBlockNum, 0, iByte);
 	}
-	iShift = 0;
 	iBuffer[iIndex++] = (iByte >> 1) & 0xFFU;
 	iByte = 0;
+	++iCounts.iBytes;
 
 	switch (iState)
 	{
@@ -140,6 +317,19 @@ void CDecoder::Bit(uint32_t aBit)
 	case EHeaderRest:
 		if (iIndex == iIndex2)
 		{
+			if (!CrcValid(iBuffer, iIndex2))
+			{
+				uint32_t flips = Repair(iBuffer, iIndex2);
+				if (flips && iEventLog && iEventLog->Enabled(ESeverityInfo))
+					iEventLog->Add(EEventHeaderRepaired, ESeverityInfo, iBitCount, BlockName(), iBlockNum, 0, flips);
+				if (!flips && iRecovery)
+				{
+					RecoverHeader();
+				}
+			}
+			iHeaderLen = iIndex2;
+			iDataBit = iBitCount;
+			memcpy(iHeader, iBuffer, iHeaderLen);
 			iState = EData;
 			iIndex = 0;
 			if (iBlockNum > 0)
@@ -168,7 +358,7 @@ void CDecoder::Bit(uint32_t aBit)
 				}
 				if (err != 0)
 				{
-					printf("BlockNum %d err %08x\n", iBlockNum, err);
+					Fail(iBlockNum, err, &iCurrentBlock);
 					BeginLeaderSearch(false);
 				}
 			}
@@ -188,7 +378,7 @@ void CDecoder::Bit(uint32_t aBit)
 				}
 				else
 				{
-					printf("BlockNum %d err %08x\n", iBlockNum, err);
+					Fail(iBlockNum, err, &iCurrentBlock);
 					BeginLeaderSearch(false);
 				}
 			}
@@ -201,23 +391,16 @@ void CDecoder::Bit(uint32_t aBit)
 			uint32_t crcx = Crc(iBuffer, iCurrentBlock.iBlockLen, 0);
 			if (crc != crcx)
 			{
-				err |= EInvalidDataCrc;
-			}
-			if (err == 0)
-			{
-				Block(&iCurrentBlock, iBuffer);
-			}
-			if (iCurrentBlock.iBlockFlag & BLOCK_FLAG_FINAL)
-			{
-				Eof();
-				iFileOpen = false;
-				BeginLeaderSearch(true);
-			}
-			else
-			{
-				++iBlockNum;
-				BeginLeaderSearch(false);
+				uint32_t flips = Repair(iBuffer, iCurrentBlock.iBlockLen + 2);
+				if (flips && iEventLog && iEventLog->Enabled(ESeverityInfo))
+					iEventLog->Add(EEventBlockRepaired, ESeverityInfo, iBitCount, iCurrentBlock.iName, iCurrentBlock.iBlockNum, 0, flips);
+				if (!flips && !(iRecovery && RecoverData()))
+				{
+					err |= EInvalidDataCrc;
+					Fail(iBlockNum, err, &iCurrentBlock);
+				}
 			}
+			EndBlock(err == 0);
 		}
 		break;
 	default:
@@ -225,6 +408,276 @@ void CDecoder::Bit(uint32_t aBit)
 	}
 }
 
+// Pick up file aHdr->iName part way through, expecting block aHdr->iBlockNum
+// next as if the blocks before it had been decoded. File() is not called.
+void CDecoder::Continue(const SBlockHeader* aHdr)
+{
+	BeginLeaderSearch(aHdr->iBlockNum == 0);
+	if (aHdr->iBlockNum == 0)
+	{
+		iFileOpen = false;
+		return;
+	}
+	iFirstBlock = *aHdr;
+	iFirstBlock.iBlockNum = 0;
+	iCurrentBlock = *aHdr;
+	iCurrentBlock.iBlockNum = (uint16_t)(aHdr->iBlockNum - 1);
+	iBlockNum = aHdr->iBlockNum;
+	iFileOpen = true;
+}
+
+// Look for aFlips of the first aN bits whose effects on the CRC combine to
+// aTarget, returning their indices in aChosen.
+bool CDecoder::FindFlips(const uint32_t* aEffect, uint32_t aN, uint32_t aTarget, uint32_t aFlips, uint32_t* aChosen)
+{
+	uint32_t i;
+	for (i=aFlips-1; i<aN; ++i)
+	{
+		aChosen[0] = i;
+		if (aFlips == 1 ? aEffect[i] == aTarget : FindFlips(aEffect, i, aTarget ^ aEffect[i], aFlips - 1, aChosen + 1))
+			return true;
+	}
+	return false;
+}
+
+// Make aCount bytes ending in a CRC pass the check by inverting up to
+// REPAIR_MAX_FLIPS of the REPAIR_CANDIDATES least confident bits. The CRC
+// of a block with its CRC appended is zero, and is linear in the bits, so
+// the search only XORs each candidate's effect on it. Returns the number
+// of bits inverted, 0 if no repair was found.
+uint32_t CDecoder::Repair(uint8_t* aData, uint32_t aCount)
+{
+	static const uint8_t zeros[MAX_BLOCK_LENGTH+2] = {0};
+	uint32_t cand[REPAIR_CANDIDATES];
+	uint32_t effect[REPAIR_CANDIDATES];
+	uint32_t chosen[REPAIR_MAX_FLIPS];
+	uint32_t n = 0;
+	uint32_t i;
+	for (i=0; i<aCount*8; ++i)
+	{
+		if (n == REPAIR_CANDIDATES && iConf[i] >= iConf[cand[n-1]])
+			continue;
+		uint32_t k = (n < REPAIR_CANDIDATES) ? n++ : n - 1;
+		while (k > 0 && iConf[cand[k-1]] > iConf[i])
+		{
+			cand[k] = cand[k-1];
+			--k;
+		}
+		cand[k] = i;
+	}
+	if (n == 0 || iConf[cand[0]] == 255)
+	{
+		// hard decisions only
+		return 0;
+	}
+	for (i=0; i<n; ++i)
+	{
+		// CRC of a block with only this bit set
+		uint8_t b = (uint8_t)(1U << (cand[i] & 7));
+		effect[i] = Crc(zeros, aCount - 1 - cand[i] / 8, Crc(&b, 1, 0));
+	}
+	uint32_t syndrome = Crc(aData, aCount, 0);
+	uint32_t flips;
+	for (flips=1; flips<=REPAIR_MAX_FLIPS; ++flips)
+	{
+		if (FindFlips(effect, n, syndrome, flips, chosen))
+		{
+			for (i=0; i<flips; ++i)
+				aData[cand[chosen[i]] / 8] ^= (uint8_t)(1U << (cand[chosen[i]] & 7));
+			return flips;
+		}
+	}
+	return 0;
+}
+
+// Tape speed estimate from the demodulator, reported after each batch of
+// bits. Reports from the block's leader onwards are averaged into the
+// header passed to Block().
+void CDecoder::Speed(double aSpeed)
+{
+	iSpeedSum += aSpeed;
+	++iSpeedCount;
+	iLastSpeed = aSpeed;
+}
+
+// Signal measurements since the last report, added to the block's
+void CDecoder::Quality(const SSignalQuality& aQuality)
+{
+	AddQuality(iQualitySum, aQuality);
+}
+
+void CDecoder::AddQuality(SSignalQuality& aTo, const SSignalQuality& aFrom)
+{
+	aTo.iSamples += aFrom.iSamples;
+	aTo.iSum += aFrom.iSum;
+	aTo.iSumSq += aFrom.iSumSq;
+	if (aFrom.iPeak > aTo.iPeak)
+		aTo.iPeak = aFrom.iPeak;
+	aTo.iBits += aFrom.iBits;
+	aTo.iTransitions += aFrom.iTransitions;
+	aTo.iResyncs += aFrom.iResyncs;
+	uint32_t i;
+	for (i=0; i<QUALITY_MARGIN_BINS; ++i)
+		aTo.iMarginBins[i] += aFrom.iMarginBins[i];
+	aTo.iMarginSum += aFrom.iMarginSum;
+	aTo.iMarginSumSq += aFrom.iMarginSumSq;
+	aTo.iJitterSumSq += aFrom.iJitterSumSq;
+}
+
+void CDecoder::Summarise(const SSignalQuality& aSum, SBlockQuality& aQuality)
+{
+	memset(&aQuality, 0, sizeof(aQuality));
+	if (aSum.iBits > 1)
+	{
+		double mean = aSum.iMarginSum / aSum.iBits;
+		double var = aSum.iMarginSumSq / aSum.iBits - mean * mean;
+		aQuality.iSnr = (var > 0) ? 10 * log10(mean * mean / var) : QUALITY_MAX_SNR;
+		if (aQuality.iSnr > QUALITY_MAX_SNR)
+			aQuality.iSnr = QUALITY_MAX_SNR;
+	}
+	if (aSum.iTransitions)
+		aQuality.iJitter = sqrt(aSum.iJitterSumSq / aSum.iTransitions);
+	if (aSum.iSamples)
+	{
+		aQuality.iDcOffset = aSum.iSum / aSum.iSamples;
+		double var = aSum.iSumSq / aSum.iSamples - aQuality.iDcOffset * aQuality.iDcOffset;
+		aQuality.iLevel = (var > 0) ? sqrt(var) : 0;
+	}
+	aQuality.iPeak = aSum.iPeak;
+	aQuality.iBits = aSum.iBits;
+	aQuality.iResyncs = aSum.iResyncs;
+	memcpy(aQuality.iMarginBins, aSum.iMarginBins, sizeof(aQuality.iMarginBins));
+}
+
+void CDecoder::EndBlock(bool aValid)
+{
+	iCurrentBlock.iSpeed = iSpeedCount ? iSpeedSum / iSpeedCount : iLastSpeed;
+	Summarise(iQualitySum, iCurrentBlock.iQuality);
+	if (aValid)
+	{
+		++iCounts.iBlocks;
+		Block(&iCurrentBlock, iBuffer);
+	}
+	else
+	{
+		++iCounts.iBadBlocks;
+		BadBlock(&iCurrentBlock, iBuffer, iConf);
+	}
+	if (iCurrentBlock.iBlockFlag & BLOCK_FLAG_FINAL)
+	{
+		Eof();
+		iFileOpen = false;
+		BeginLeaderSearch(true);
+	}
+	else
+	{
+		++iBlockNum;
+		BeginLeaderSearch(false);
+	}
+}
+
+// Next leader found before the current block was complete. Data is given
+// up on as if the CRC had failed, unless it can be recovered.
+void CDecoder::BlockTruncated()
+{
+	if (iState == EData)
+	{
+		bool valid = iRecovery && RecoverData();
+		if (!valid)
+		{
+			memset(iConf + iIndex*8, 0, (iCurrentBlock.iBlockLen + 2 - iIndex) * 8);
+			Fail(iBlockNum, ETruncatedBlock, &iCurrentBlock);
+		}
+		EndBlock(valid);
+	}
+	else
+	{
+		Fail(iBlockNum, ETruncatedHeader, 0);
+	}
+}
+
+// Count the error bits then report them
+void CDecoder::Fail(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr)
+{
+	uint32_t i;
+	for (i=0; i<DECODER_ERROR_BITS; ++i)
+	{
+		if (aErr & (1U<<i))
+			++iCounts.iErrors[i];
+	}
+	Error(aBlockNum, aErr, aHdr);
+}
+
+// Replace a header which failed its CRC check, if the recovery source can
+// supply one which passes. The name length, and so the header length, may
+// differ; if so the data which follows will fail its CRC and be recovered
+// too.
+void CDecoder::RecoverHeader()
+{
+	uint8_t buf[MAX_HEADER_LENGTH];
+	uint32_t n = iRecovery->Recover(buf, MAX_HEADER_LENGTH);
+	uint32_t len = 0;
+	while (len < n && len <= MAX_NAME_LENGTH && buf[len] != 0)
+		++len;
+	len += 1 + HEADER_LENGTH_2;
+	if (len > n || !CrcValid(buf, len))
+		return;
+	memcpy(iBuffer, buf, len);
+	iIndex2 = len;
+	if (iEventLog && iEventLog->Enabled(ESeverityInfo))
+		iEventLog->Add(EEventHeaderRecovered, ESeverityInfo, iBitCount, BlockName(), iBlockNum);
+}
+
+// Replace data which failed its CRC check, if the recovery source can
+// supply the same header followed by data which passes
+bool CDecoder::RecoverData()
+{
+	uint8_t buf[MAX_HEADER_LENGTH+MAX_BLOCK_LENGTH+2];
+	uint32_t len = iCurrentBlock.iBlockLen + 2;
+	if (iRecovery->Recover(buf, iHeaderLen + len) != iHeaderLen + len)
+		return false;
+	if (memcmp(buf, iHeader, iHeaderLen) != 0 || !CrcValid(buf + iHeaderLen, len))
+		return false;
+	memcpy(iBuffer, buf + iHeaderLen, len);
+	if (iEventLog && iEventLog->Enabled(ESeverityInfo))
+		iEventLog->Add(EEventBlockRecovered, ESeverityInfo, iBitCount, iCurrentBlock.iName, iCurrentBlock.iBlockNum);
+	return true;
+}
+
+CLeaderCapture::CLeaderCapture(uint8_t* aBuffer, uint32_t aLen)
+:	iLdr(0),
+	iFound(false),
+	iBuffer(aBuffer),
+	iLen(aLen),
+	iIndex(0),
+	iByte(0),
+	iShift(0)
+{
+}
+
+void CLeaderCapture::Bit(uint32_t aBit)
+{
+	uint32_t bit = aBit ? 1 : 0;
+	if (!iFound)
+	{
+		iLdr <<= 1;
+		iLdr |= bit;
+		iFound = (iLdr == LEADER_PATTERN);
+		return;
+	}
+	if (iIndex == iLen || (iShift == 0 && bit != 0))
+	{
+		// finished, or idle between bytes
+		return;
+	}
+	iByte |= (bit << iShift);
+	if (++iShift < 10)
+		return;
+	iShift = 0;
+	iBuffer[iIndex++] = (iByte >> 1) & 0xFFU;
+	iByte = 0;
+}
+
 void CDecoder::InitBlockHeader(SBlockHeader& aHdr)
 {
 	memset(aHdr.iName, 0, sizeof(aHdr.iName));
@@ -234,6 +687,8 @@ void CDecoder::InitBlockHeader(SBlockHeader& aHdr)
 	aHdr.iBlockLen = 0;
 	aHdr.iNextFile = 0;
 	aHdr.iBlockFlag = 0;
+	aHdr.iSpeed = 0;
+	memset(&aHdr.iQuality, 0, sizeof(aHdr.iQuality));
 }
 
 uint32_t CDecoder::InitBlockHeader(SBlockHeader& aHdr, const uint8_t* aData, const SBlockHeader* aPrevBlock)
@@ -30,6 +30,60 @@
 #define	BLOCK_FLAG_EMPTY	(1<<6)
 #define	BLOCK_FLAG_FINAL	(1<<7)
 
+#define	MAX_HEADER_LENGTH	(MAX_NAME_LENGTH+1+HEADER_LENGTH_2)
+
+// last 64 bits of a leader, newest in bit 0: 1 bits then 1 1 0 0 1 0 1 0 1 0 0 1
+#define	LEADER_PATTERN		(0xFFFFFFFFFFFFFCA9ULL)
+// bits of iLdr which must all be 1 for LEADER_PATTERN to complete within 10 more bits
+#define	LEADER_SKIP_MASK	(0x003FFFFFFFFFF800ULL)
+
+#define	REPAIR_CANDIDATES	(16)		// least confident bits considered for repair
+#define	REPAIR_MAX_FLIPS	(2)			// most bits changed to repair a block
+#define	DECODER_ERROR_BITS	(10)		// number of CDecoder::TError bits
+#define	QUALITY_MARGIN_BINS	(8)			// decision margin histogram bins, each a quarter of the average margin wide
+#define	QUALITY_MAX_SNR		(99.0)		// SNR reported for a discriminant with no variation, in dB
+
+class CCheckpoint;
+class CEventLog;
+
+/*
+* Signal measurements made by the demodulator, kept as sums so that those
+* for any number of stretches of input can be added together. Samples are
+* in the demodulator's input units. The margin of a bit decision is the
+* magnitude of the discriminant at the sampling point; iMarginBins counts
+* decisions by margin relative to the demodulator's running average, so a
+* block with many in the lowest bins was close to failing. Timing errors are
+* those the symbol clock measures at 1 to 0 transitions; ones too large to
+* correct reset the clock phase instead and are counted in iResyncs.
+*/
+struct SSignalQuality
+{
+	uint64_t	iSamples;
+	double		iSum;			// of samples
+	double		iSumSq;			// of squared samples
+	double		iPeak;			// largest sample magnitude
+	uint32_t	iBits;			// bit decisions
+	uint32_t	iTransitions;	// timing errors corrected
+	uint32_t	iResyncs;		// timing errors which reset the clock phase
+	uint32_t	iMarginBins[QUALITY_MARGIN_BINS];
+	double		iMarginSum;		// of decision margins
+	double		iMarginSumSq;	// of squared decision margins
+	double		iJitterSumSq;	// of squared timing errors corrected, in symbols
+};
+
+// signal quality over a block, worked out from SSignalQuality sums
+struct SBlockQuality
+{
+	double		iSnr;			// decision margin mean squared over its variance, in dB
+	double		iJitter;		// RMS timing error at 1 to 0 transitions, in symbols
+	double		iDcOffset;		// mean sample value
+	double		iLevel;			// RMS sample value about iDcOffset
+	double		iPeak;			// largest sample magnitude
+	uint32_t	iBits;			// bit decisions
+	uint32_t	iResyncs;		// see SSignalQuality
+	uint32_t	iMarginBins[QUALITY_MARGIN_BINS];	// see SSignalQuality
+};
+
 struct SBlockHeader
 {
 	char		iName[MAX_NAME_LENGTH+1];
@@ -39,6 +93,55 @@ struct SBlockHeader
 	uint16_t	iBlockLen;
 	uint32_t	iNextFile;
 	uint8_t		iBlockFlag;
+	double		iSpeed;			// tape speed relative to nominal measured over the block, 0 if unknown
+	SBlockQuality	iQuality;	// measured from the leader to the end of the block, all 0 if unknown
+};
+
+// running totals kept by the decoder, for performance reports
+struct SDecoderCounts
+{
+	uint64_t	iBytes;			// framed bytes received
+	uint64_t	iLeaders;		// leaders found
+	uint64_t	iBlocks;		// blocks passed to Block()
+	uint64_t	iBadBlocks;		// blocks passed to BadBlock()
+	uint64_t	iErrors[DECODER_ERROR_BITS];	// calls to Error() with each TError bit set
+};
+
+/*
+* Second source for the bytes of a block which failed its CRC check or was
+* cut short by the next leader, for instance by demodulating the same
+* stretch of signal again with a different engine. BlockStart() is called
+* when the decoder detects a leader and BlockEnd() when it goes back to
+* looking for one; Recover() should fill aBuffer with up to aLen bytes
+* following that leader and return how many it found.
+*/
+class CBlockRecovery
+{
+public:
+	virtual void BlockStart()=0;
+	virtual void BlockEnd()=0;
+	virtual uint32_t Recover(uint8_t* aBuffer, uint32_t aLen)=0;
+};
+
+/*
+* Searches a bit stream for a leader and collects the bytes following it,
+* framed the same way as CDecoder does.
+*/
+class CLeaderCapture
+{
+public:
+	CLeaderCapture(uint8_t* aBuffer, uint32_t aLen);
+	void Bit(uint32_t aBit);
+	bool Complete() const { return iIndex == iLen; }
+	uint32_t Count() const { return iIndex; }
+private:
+	uint64_t		iLdr;			// last 64 bits, while searching for leader
+	bool			iFound;			// leader has been seen
+	uint8_t*		iBuffer;		// bytes collected
+	uint32_t		iLen;			// number of bytes wanted
+	uint32_t		iIndex;			// number of bytes collected so far
+	uint32_t		iByte;			// byte being assembled, including start and stop bits
+	uint32_t		iShift;			// number of bits of iByte received
 };
 
 class CDecoder
@@ -46,10 +149,32 @@ class CDecoder
 public:
 	CDecoder();
 	virtual ~CDecoder();
-	void Bit(uint32_t aBit);
+	void SetRecovery(CBlockRecovery* aRecovery) { iRecovery = aRecovery; }
+	void SetEventLog(CEventLog* aLog) { iEventLog = aLog; }
+	CEventLog* EventLog() const { return iEventLog; }
+	void Bit(uint32_t aBit, uint32_t aConfidence);
+	void Bits(const uint8_t* aPacked, uint32_t aCount, const uint8_t* aConf = 0);
+	void Speed(double aSpeed);
+	void Quality(const SSignalQuality& aQuality);
+	bool Idle() const { return iState == ELeader && !iFileOpen; }	// between files, waiting for a leader
+	void Continue(const SBlockHeader* aHdr);
+	uint32_t BitCount() const { return iBitCount; }		// bits received so far
+	uint32_t LeaderBit() const { return iLeaderBit; }	// BitCount() when the current block's leader was found
+	uint32_t DataBit() const { return iDataBit; }		// BitCount() when the current block's header was complete
+	const SDecoderCounts& Counts() const { return iCounts; }
 	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData)=0;
 	virtual void File(const SBlockHeader* aHdr)=0;
 	virtual void Eof()=0;
+	// data which failed its CRC check, with the confidence of each bit;
+	// bytes never received have confidence 0
+	virtual void BadBlock(const SBlockHeader* aHdr, const uint8_t* aData, const uint8_t* aConf) {}
+	// block aBlockNum of the current file was lost or damaged, see TError;
+	// aHdr is its header, if one was read
+	virtual void Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr) {}
+	virtual void Checkpoint(CCheckpoint& aCp);
+	static bool CrcValid(const uint8_t* aData, uint32_t aCount);
+	static const char* ErrorName(uint32_t aBit);	// short name of TError bit aBit, e.g. "data_crc"
+	static void AddQuality(SSignalQuality& aTo, const SSignalQuality& aFrom);
 public:
 	enum TError
 	{
@@ -61,12 +186,25 @@ public:
 		EUnexpectedBlock = (1U<<5),
 		ESkippedBlock = (1U<<6),
 		ERepeatBlock = (1U<<7),
+		ETruncatedBlock = (1U<<8),
+		ETruncatedHeader = (1U<<9),
 	};
 private:
 	static void InitBlockHeader(SBlockHeader& aHdr);
+	static void Summarise(const SSignalQuality& aSum, SBlockQuality& aQuality);
 	static uint32_t InitBlockHeader(SBlockHeader& aHdr, const uint8_t* aData, const SBlockHeader* aPrevBlock);
 	static uint32_t Crc(const uint8_t* aData, uint32_t aCount, uint32_t aCrc);
+	static bool FindFlips(const uint32_t* aEffect, uint32_t aN, uint32_t aTarget, uint32_t aFlips, uint32_t* aChosen);
+	uint32_t Repair(uint8_t* aData, uint32_t aCount);
+	const char* BlockName() const { return iFileOpen ? iFirstBlock.iName : 0; }	// file being read, for the event log
 	void BeginLeaderSearch(bool aFirstBlock);
+	void LeaderFound();
+	void Byte();
+	void EndBlock(bool aValid);
+	void BlockTruncated();
+	void Fail(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr);
+	void RecoverHeader();
+	bool RecoverData();
 private:
 	enum TState
 	{
@@ -87,5 +225,17 @@ private:
 	uint32_t		iByte;
 	uint32_t		iShift;
 	bool			iFileOpen;
+	CBlockRecovery*	iRecovery;		// where to get a second opinion on blocks with bad CRC
+	CEventLog*		iEventLog;		// framing errors, repairs and recoveries are logged here, if set
+	double			iSpeedSum;		// sum of speed reports since the block's leader
+	uint32_t		iSpeedCount;	// number of speed reports since the block's leader
+	SSignalQuality	iQualitySum;	// quality reports since the block's leader
+	double			iLastSpeed;		// most recent speed report
+	uint32_t		iHeaderLen;		// length of current block header including CRC
+	uint32_t		iLeaderBit;		// iBitCount when the current block's leader was found
+	uint32_t		iDataBit;		// iBitCount when the current block's header was complete
+	SDecoderCounts	iCounts;		// not checkpointed, so cover this run only
+	uint8_t			iHeader[MAX_HEADER_LENGTH];
 	uint8_t			iBuffer[MAX_BLOCK_LENGTH+2];
+	uint8_t			iConf[(MAX_BLOCK_LENGTH+2)*8];	// confidence of each data bit in iBuffer
 };
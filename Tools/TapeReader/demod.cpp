@@ -23,9 +23,9 @@
 #include <math.h>
 #include <string.h>
 #include "demod.h"
-
-#define	FREQ0	(16000000.0 / 13312.0)	// tone frequency used for a 0 bit
-#define	FREQ1	(2.0 * FREQ0)			// tone frequency used for a 1 bit
+#include "checkpoint.h"
+#include "decoder.h"
+#include "fallback.h"
 
 #ifndef PI
 #define PI		(3.14159265358979323846)
@@ -38,16 +38,34 @@ CDemodulator::CDemodulator(double aFs)
 	iPhase(-2 * PI),
 	iPhaseDelta(0),
 	iPrevY(0),
+	iBias(0),
+	iLevel(0),
+	iLevelRate(0),
+	iPhaseReset(0),
+	iRate(1),
+	iLockError(0.5),
+	iHeldRate(1),
+	iCapture(PLL_CAPTURE),
+	iAcquire(0),
+	iSymbols(0),
+	iMargin(0),
+	iConfidence(0),
 	iNSamples(0),
 	iSymL(0),
 	iSym0I(0),
 	iSym0Q(0),
 	iSym1I(0),
 	iSym1Q(0),
-	iHistory(0)
+	iHistory(0),
+	iQuality(0)
 {
+	iQuality = new SSignalQuality[2];
+	memset(iQuality, 0, 2 * sizeof(SSignalQuality));
 	iPhaseDelta = 2 * PI * iF1 / iFs;
 	iSymL = (int)ceil(iFs/iF0);		// number of samples per symbol period
+	if (PLL_CAPTURE_SAMPLES * iF0 / iFs > iCapture)
+		iCapture = PLL_CAPTURE_SAMPLES * iF0 / iFs;
+	iLevelRate = 1.0 / (8 * iSymL);
 	iSym0I = new double[iSymL];
 	iSym0Q = new double[iSymL];
 	iSym1I = new double[iSymL];
@@ -67,6 +85,7 @@ CDemodulator::CDemodulator(double aFs)
 
 CDemodulator::~CDemodulator()
 {
+	delete[] iQuality;
 	delete[] iHistory;
 	delete[] iSym1Q;
 	delete[] iSym1I;
@@ -76,7 +95,6 @@ CDemodulator::~CDemodulator()
 
 int CDemodulator::Sample(int aSample)
 {
-	int ret = NO_BIT;
 	int i;
 	memmove(iHistory+1, iHistory, (iSymL-1)*sizeof(double));
 	iHistory[0] = (double)aSample;
@@ -94,23 +112,377 @@ int CDemodulator::Sample(int aSample)
 		q1 += iHistory[i] * iSym1Q[i];
 	}
 	double y = i1*i1 + q1*q1 - i0*i0 - q0*q0;
-	if (iNSamples >= iSymL)
+	return Decide(y);
+}
+
+// Save or restore what changes as samples are processed. Engines with
+// state of their own add it after calling this.
+void CDemodulator::Checkpoint(CCheckpoint& aCp)
+{
+	aCp.State(iPhase);
+	aCp.State(iPrevY);
+	aCp.State(iBias);
+	aCp.State(iLevel);
+	aCp.State(iPhaseReset);
+	aCp.State(iRate);
+	aCp.State(iLockError);
+	aCp.State(iHeldRate);
+	aCp.State(iAcquire);
+	aCp.State(iSymbols);
+	aCp.State(iMargin);
+	aCp.State(iConfidence);
+	aCp.State(iNSamples);
+	aCp.State(iHistory, iSymL * sizeof(double));
+}
+
+// Go back to the state of a newly constructed engine, keeping the tuning,
+// so that one instance can be reused on unrelated stretches of input.
+// Engines with state of their own reset it after calling this.
+void CDemodulator::Reset()
+{
+	iPhase = -2 * PI;
+	iPrevY = 0;
+	iLevel = 0;
+	iRate = 1;
+	iLockError = 0.5;
+	iHeldRate = 1;
+	iAcquire = 0;
+	iSymbols = 0;
+	iMargin = 0;
+	iConfidence = 0;
+	iNSamples = 0;
+	memset(iHistory, 0, iSymL * sizeof(double));
+	memset(iQuality, 0, 2 * sizeof(SSignalQuality));
+}
+
+// Symbol timing and bit decision, common to all engines. The symbol clock
+// is a second order loop: each 1 to 0 transition of the discriminant gives
+// a timing error, which corrects the clock phase and, divided by the symbols
+// since the previous transition, its rate. An error too large to be drift
+// (after a dropout) resets the phase instead; the window is at least
+// PLL_CAPTURE_SAMPLES wide, as at low sample rates a symbol is only a few
+// samples and the error can't be measured much more finely than one. A
+// run of symbols longer than any byte gives is a leader or a gap. The rate
+// is held when one begins while the loop is locked, and when it ends the
+// phase is resynchronised and the rate put back, so noise in a gap can't
+// carry a wrong rate into the next block. The rate gain then starts high,
+// averaging the first few transitions so a tape off speed is acquired
+// within the block header, and falls to PLL_RATE_GAIN. After that the rate
+// is only adjusted while the average error shows the loop is locked.
+int CDemodulator::Decide(double aY)
+{
+	double y = aY;
+	int ret = NO_BIT;
+	if (iBias != 0)
+	{
+		// move the threshold relative to the recent discriminant level
+		iLevel += (fabs(y) - iLevel) * iLevelRate;
+		y -= iBias * iLevel;
+	}
+	if (iNSamples >= (uint32_t)iSymL)
 	{
 		if (iPrevY>0 && y<0)
 		{
-			// 1 to 0 transition detected, so synchronize symbol timing
-			iPhase = 0;
+			// 1 to 0 transition detected, so synchronize symbol timing;
+			// t is how far before this sample the discriminant crossed zero
+			double t = iPrevY / (iPrevY - y);
+			double err = iPhase - iPhaseReset + t * iPhaseDelta * iRate;
+			if (err >= 2*PI)
+				err -= 4*PI;
+			else if (err < -2*PI)
+				err += 4*PI;
+			err /= 4*PI;					// in symbols, positive if clock is early
+			bool idle = (iSymbols > PLL_IDLE_SYMBOLS);
+			bool resync = (idle || fabs(err) > iCapture || iSymbols == 0);
+			iLockError += ((resync ? 0.5 : fabs(err)) - iLockError) * PLL_LOCK_RATE;
+			if (idle)
+			{
+				iRate = iHeldRate;
+				iAcquire = 0;
+			}
+			if (resync)
+			{
+				iPhase = iPhaseReset - t * iPhaseDelta * iRate;
+				++iQuality->iResyncs;
+			}
+			else
+			{
+				++iQuality->iTransitions;
+				iQuality->iJitterSumSq += err * err;
+				iPhase -= PLL_PHASE_GAIN * err * 4*PI;
+				// rate gain of 1/2, 1/3, ... averages the first estimates
+				double gain = 1.0 / (iAcquire + 2);
+				bool acquiring = (gain > PLL_RATE_GAIN);
+				if (acquiring)
+					++iAcquire;
+				else
+					gain = PLL_RATE_GAIN;
+				if (acquiring || iLockError < PLL_LOCK_ERROR)
+				{
+					iRate -= gain * err / iSymbols;
+					if (iRate > 1 + PLL_MAX_DEVIATION)
+						iRate = 1 + PLL_MAX_DEVIATION;
+					if (iRate < 1 - PLL_MAX_DEVIATION)
+						iRate = 1 - PLL_MAX_DEVIATION;
+				}
+			}
+			iSymbols = 0;
 		}
-		iPhase += iPhaseDelta;
+		iPhase += iPhaseDelta * iRate;
 		if (iPhase >= 2*PI)
 		{
 			// half way through symbol period
 			// so this is best time to sample
 			iPhase -= 4*PI;
 			ret = (y >= 0) ? BIT_1 : BIT_0;
+			if (++iSymbols == PLL_IDLE_SYMBOLS && iLockError < PLL_LOCK_ERROR)
+				iHeldRate = iRate;
+			double m = fabs(y);
+			double c = (iMargin > 0) ? CONFIDENCE_AVERAGE * m / iMargin : CONFIDENCE_AVERAGE;
+			iConfidence = (c < CONFIDENCE_MAX) ? (uint32_t)c : CONFIDENCE_MAX;
+			iMargin += (m - iMargin) * CONFIDENCE_RATE;
+			double bin = c * (QUALITY_MARGIN_BINS / 2) / CONFIDENCE_AVERAGE;
+			++iQuality->iMarginBins[bin < QUALITY_MARGIN_BINS ? (uint32_t)bin : QUALITY_MARGIN_BINS - 1];
+			++iQuality->iBits;
+			iQuality->iMarginSum += m;
+			iQuality->iMarginSumSq += m * m;
 		}
 	}
 	iPrevY = y;
 	return ret;
 }
 
+// Signal measurements since the last call. Engines measure their input in
+// Process(); samples passed one at a time to Sample() aren't measured.
+const SSignalQuality& CDemodulator::TakeQuality()
+{
+	iQuality[1] = iQuality[0];
+	memset(iQuality, 0, sizeof(SSignalQuality));
+	return iQuality[1];
+}
+
+void CDemodulator::Measure(const float* aIn, uint32_t aN)
+{
+	double sum = 0;
+	double sumSq = 0;
+	double peak = iQuality->iPeak;
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		double x = aIn[i];
+		sum += x;
+		sumSq += x * x;
+		if (fabs(x) > peak)
+			peak = fabs(x);
+	}
+	iQuality->iSamples += aN;
+	iQuality->iSum += sum;
+	iQuality->iSumSq += sumSq;
+	iQuality->iPeak = peak;
+}
+
+void CDemodulator::Measure(const int32_t* aIn, uint32_t aN)
+{
+	double sum = 0;
+	double sumSq = 0;
+	double peak = iQuality->iPeak;
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		double x = aIn[i];
+		sum += x;
+		sumSq += x * x;
+		if (fabs(x) > peak)
+			peak = fabs(x);
+	}
+	iQuality->iSamples += aN;
+	iQuality->iSum += sum;
+	iQuality->iSumSq += sumSq;
+	iQuality->iPeak = peak;
+}
+
+// Alter the decision rule: aBias moves the threshold between 0 and 1 by
+// that fraction of the average discriminant magnitude, aPhase moves the
+// sampling point earlier by that fraction of a symbol.
+void CDemodulator::Tune(double aBias, double aPhase)
+{
+	iBias = aBias;
+	iPhaseReset = aPhase * 4 * PI;
+}
+
+// Default block interface: feed samples one at a time. Samples are in the
+// same units as for Sample().
+void CDemodulator::Process(const float* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Measure(aIn, aN);
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		int bit = Sample((int)aIn[i]);
+		if (bit != NO_BIT)
+			aSink.Bit((uint32_t)bit, iConfidence);
+	}
+}
+
+void CDemodulator::Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Measure(aIn, aN);
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		int bit = Sample(aIn[i]);
+		if (bit != NO_BIT)
+			aSink.Bit((uint32_t)bit, iConfidence);
+	}
+}
+
+CDemodulator* CDemodulator::New(double aFs, TEngine aEngine, uint32_t aBitsPerSample)
+{
+	switch (aEngine)
+	{
+	case EFixed:
+		if (aBitsPerSample <= 8)
+			return new CDemodulatorT<int8_t, int32_t>(aFs);
+		if (aBitsPerSample <= 16)
+			return new CDemodulatorT<int16_t, int32_t>(aFs);
+		return new CDemodulatorT<int32_t, int64_t>(aFs);
+	case ECorrelator:
+		if (aFs == 44100.0)
+			return new CRateDemodulator<44100>();
+		if (aFs == 48000.0)
+			return new CRateDemodulator<48000>();
+		if (aFs == 88200.0)
+			return new CRateDemodulator<88200>();
+		if (aFs == 96000.0)
+			return new CRateDemodulator<96000>();
+		return new CDemodulator(aFs);
+	case ESlidingDft: return new CSdftDemodulator(aFs);
+	case ESimd: return new CSimdDemodulator(aFs);
+	case EPulse: return new CFallbackDemodulator(aFs, new CPulseDemodulator(aFs));
+	default: return new CDemodulator(aFs);
+	}
+}
+
+bool CDemodulator::EngineFromName(const char* aName, TEngine& aEngine)
+{
+	static const struct { const char* iName; TEngine iEngine; } names[] =
+	{
+		{ "correlator", ECorrelator },
+		{ "sdft", ESlidingDft },
+		{ "simd", ESimd },
+		{ "fixed", EFixed },
+		{ "generic", EGeneric },
+		{ "pulse", EPulse },
+	};
+	uint32_t i;
+	for (i=0; i<sizeof(names)/sizeof(names[0]); ++i)
+	{
+		if (strcmp(aName, names[i].iName) == 0)
+		{
+			aEngine = names[i].iEngine;
+			return true;
+		}
+	}
+	return false;
+}
+
+CSdftDemodulator::CSdftDemodulator(double aFs)
+:	CDemodulator(aFs),
+	iPos(0),
+	iResyncCount(SDFT_RESYNC_INTERVAL),
+	iS0I(0),
+	iS0Q(0),
+	iS1I(0),
+	iS1Q(0)
+{
+	// S(n) = x(n) + exp(jw)*S(n-1) - x(n-L)*exp(jwL)
+	double w0 = iPhaseDelta / 2;
+	double w1 = iPhaseDelta;
+	iRot0I = cos(w0);
+	iRot0Q = sin(w0);
+	iRot1I = cos(w1);
+	iRot1Q = sin(w1);
+	iOut0I = cos(w0 * iSymL);
+	iOut0Q = sin(w0 * iSymL);
+	iOut1I = cos(w1 * iSymL);
+	iOut1Q = sin(w1 * iSymL);
+}
+
+CSdftDemodulator::~CSdftDemodulator()
+{
+}
+
+// recompute sums directly from the history ring
+void CSdftDemodulator::Resync()
+{
+	double i0 = 0;
+	double q0 = 0;
+	double i1 = 0;
+	double q1 = 0;
+	int i;
+	int j = iPos;
+	for (i=0; i<iSymL; ++i)
+	{
+		j = (j == 0) ? iSymL - 1 : j - 1;		// newest sample first
+		i0 += iHistory[j] * iSym0I[i];
+		q0 += iHistory[j] * iSym0Q[i];
+		i1 += iHistory[j] * iSym1I[i];
+		q1 += iHistory[j] * iSym1Q[i];
+	}
+	iS0I = i0;
+	iS0Q = q0;
+	iS1I = i1;
+	iS1Q = q1;
+	iResyncCount = SDFT_RESYNC_INTERVAL;
+}
+
+void CSdftDemodulator::Checkpoint(CCheckpoint& aCp)
+{
+	CDemodulator::Checkpoint(aCp);
+	aCp.State(iPos);
+	aCp.State(iResyncCount);
+	aCp.State(iS0I);
+	aCp.State(iS0Q);
+	aCp.State(iS1I);
+	aCp.State(iS1Q);
+}
+
+void CSdftDemodulator::Reset()
+{
+	CDemodulator::Reset();
+	iPos = 0;
+	iResyncCount = SDFT_RESYNC_INTERVAL;
+	iS0I = 0;
+	iS0Q = 0;
+	iS1I = 0;
+	iS1Q = 0;
+}
+
+int CSdftDemodulator::Sample(int aSample)
+{
+	double x = (double)aSample;
+	double xo = iHistory[iPos];
+	iHistory[iPos] = x;
+	if (++iPos == iSymL)
+		iPos = 0;
+	++iNSamples;
+
+	if (--iResyncCount == 0)
+	{
+		Resync();
+	}
+	else
+	{
+		double a, b;
+		a = iRot0I * iS0I - iRot0Q * iS0Q + x - xo * iOut0I;
+		b = iRot0Q * iS0I + iRot0I * iS0Q - xo * iOut0Q;
+		iS0I = a;
+		iS0Q = b;
+		a = iRot1I * iS1I - iRot1Q * iS1Q + x - xo * iOut1I;
+		b = iRot1Q * iS1I + iRot1I * iS1Q - xo * iOut1Q;
+		iS1I = a;
+		iS1Q = b;
+	}
+	double y = iS1I*iS1I + iS1Q*iS1Q - iS0I*iS0I - iS0Q*iS0Q;
+	return Decide(y);
+}
@@ -22,24 +22,94 @@
 
 #include <stdint.h>
 
+#define	FREQ0	(16000000.0 / 13312.0)	// tone frequency used for a 0 bit
+#define	FREQ1	(2.0 * FREQ0)			// tone frequency used for a 1 bit
+
 // return values from Sample() function
 #define	NO_BIT		(-1)			// no bit demodulated on this sample
 #define	BIT_0		(0)				// a 0 bit has been demodulated on this sample
 #define	BIT_1		(1)				// a 1 bit has been demodulated on this sample
 
+#define	SIMD_BLOCK_SIZE			(1024)	// samples correlated per pass by the SIMD engine
+#define	SDFT_RESYNC_INTERVAL	(4096)	// samples between recomputations of sliding DFT sums
+
+#define	PLL_PHASE_GAIN			(0.6)	// fraction of symbol timing error corrected per transition
+#define	PLL_RATE_GAIN			(0.05)	// fraction of implied bit rate error corrected per transition, once acquired
+#define	PLL_CAPTURE				(0.4)	// timing error in symbols beyond which the clock is resynchronised
+#define	PLL_CAPTURE_SAMPLES		(4.0)	// least timing error in samples which resynchronises the clock
+#define	PLL_IDLE_SYMBOLS		(12)	// symbols without a 1 to 0 transition taken as a leader or a gap
+#define	PLL_MAX_DEVIATION		(0.1)	// largest tracked departure from nominal tape speed
+#define	PLL_LOCK_RATE			(1.0/16)	// smoothing factor for average timing error
+#define	PLL_LOCK_ERROR			(0.3)	// average timing error below which the rate is tracked
+
+#define	CONFIDENCE_AVERAGE		(64)	// confidence of a bit decided with the average margin
+#define	CONFIDENCE_MAX			(255)	// highest confidence reported
+#define	CONFIDENCE_RATE			(1.0/64)	// smoothing factor for average decision margin
+
+class CBlockRecovery;
+class CCheckpoint;
+struct SSignalQuality;
+
+// receiver for bits produced by CDemodulator::Process(); aConfidence is the
+// margin by which the bit was decided, scaled so that CONFIDENCE_AVERAGE is
+// typical, up to CONFIDENCE_MAX
+class CBitSink
+{
+public:
+	virtual ~CBitSink() {}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence)=0;
+};
+
 class CDemodulator
 {
+public:
+	enum TEngine
+	{
+		ECorrelator = 0,			// direct correlation against reference tables
+		ESlidingDft = 1,			// recursive sliding DFT
+		ESimd = 2,					// block correlator using float SIMD kernels
+		EFixed = 3,					// integer correlator, sample type chosen from bits/sample
+		EGeneric = 4,				// correlator with run time tables even at standard rates
+		EPulse = 5,					// zero crossing pulse width, correlator on CRC failure
+	};
+	static CDemodulator* New(double aFs, TEngine aEngine, uint32_t aBitsPerSample = 16);
+	static bool EngineFromName(const char* aName, TEngine& aEngine);
 public:
 	CDemodulator(double Fs);
 	virtual ~CDemodulator();
-	int Sample(int aSample);
-private:
+	virtual int Sample(int aSample);
+	virtual void Process(const float* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink);
+	virtual CBlockRecovery* Recovery() { return 0; }
+	virtual void Tune(double aBias, double aPhase);
+	virtual double Speed() const { return iRate; }
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+	virtual const SSignalQuality& TakeQuality();
+	uint32_t SampleCount() const { return iNSamples; }
+protected:
+	int Decide(double aY);
+	void Measure(const float* aIn, uint32_t aN);
+	void Measure(const int32_t* aIn, uint32_t aN);
+protected:
 	double			iFs;			// sample rate
 	double			iF0;			// frequency for 0 bit
 	double			iF1;			// frequency for 1 bit
 	double			iPhase;			// phase relative to symbol clock (4*pi per symbol)
 	double			iPhaseDelta;	// phase delta per sample
 	double			iPrevY;			// previous bit discriminant
+	double			iBias;			// decision threshold as a fraction of iLevel
+	double			iLevel;			// average magnitude of discriminant, tracked if iBias != 0
+	double			iLevelRate;		// smoothing factor for iLevel
+	double			iPhaseReset;	// value iPhase should have on a 1 to 0 transition
+	double			iRate;			// bit rate relative to nominal, tracked by the symbol clock loop
+	double			iLockError;		// average timing error magnitude in symbols
+	double			iHeldRate;		// iRate when the last leader began while locked
+	double			iCapture;		// timing error in symbols beyond which the clock is resynchronised
+	uint32_t		iAcquire;		// transitions since the last leader, while the rate gain is falling
+	uint32_t		iSymbols;		// symbols since the last 1 to 0 transition
+	double			iMargin;		// average magnitude of discriminant at bit decisions
+	uint32_t		iConfidence;	// confidence of the last bit decided
 	uint32_t		iNSamples;		// number of samples processed
 	int				iSymL;			// length of each symbol in samples (rounded up)
 	double*			iSym0I;			// in-phase reference signal for 0 bit
@@ -47,4 +117,176 @@ private:
 	double*			iSym1I;			// in-phase reference signal for 1 bit
 	double*			iSym1Q;			// quadrature reference signal for 1 bit
 	double*			iHistory;		// sample history
+	SSignalQuality*	iQuality;		// [0] being measured, [1] as last taken; not checkpointed
+};
+
+/*
+* Sliding DFT demodulator. Keeps the 0 and 1 tone correlations as running
+* complex sums which are rotated by one sample and corrected for the sample
+* entering and leaving the window, giving O(1) work per sample instead of
+* O(iSymL). The sums are recomputed directly every SDFT_RESYNC_INTERVAL
+* samples to stop rounding error building up. Between resyncs the
+* discriminant differs from the correlator's by a relative error of around
+* 1e-12, so bit decisions are the same except where the discriminant is
+* within that margin of zero.
+*/
+class CSdftDemodulator : public CDemodulator
+{
+public:
+	CSdftDemodulator(double aFs);
+	virtual ~CSdftDemodulator();
+	virtual int Sample(int aSample);
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+private:
+	void Resync();
+private:
+	int				iPos;			// position of oldest sample in iHistory ring
+	uint32_t		iResyncCount;	// samples until next resync
+	double			iRot0I;			// rotation per sample for 0 tone
+	double			iRot0Q;
+	double			iRot1I;			// rotation per sample for 1 tone
+	double			iRot1Q;
+	double			iOut0I;			// rotation for sample leaving the window, 0 tone
+	double			iOut0Q;
+	double			iOut1I;			// rotation for sample leaving the window, 1 tone
+	double			iOut1Q;
+	double			iS0I;			// running sums
+	double			iS0Q;
+	double			iS1I;
+	double			iS1Q;
+};
+
+/*
+* Block correlator. Computes the same correlations as CDemodulator, but in
+* float over a block of samples at a time using SSE or AVX2/FMA kernels
+* chosen at run time. History is kept as the last few samples of a linear
+* work buffer which the next block is appended to, so each output's window
+* is contiguous and nothing is moved per sample. Reference tables are
+* reversed and zero padded to a multiple of 8 taps. Float accumulation gives
+* a relative error of around 1e-6 in the discriminant, so bit decisions can
+* differ from the double correlator where it is that close to zero.
+*/
+class CSimdDemodulator : public CDemodulator
+{
+public:
+	typedef void (*TCorrelateFn)(const float* aX, const float* aRef, uint32_t aTaps, uint32_t aN, float* aY);
+public:
+	CSimdDemodulator(double aFs);
+	virtual ~CSimdDemodulator();
+	virtual int Sample(int aSample);
+	virtual void Process(const float* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+private:
+	uint32_t		iTaps;			// iSymL rounded up to multiple of 8
+	float*			iRef;			// 4 reversed reference tables of iTaps each
+	float*			iWork;			// iTaps-1 samples of history followed by current block
+	float*			iY;				// discriminant for each sample of current block
+	TCorrelateFn	iCorrelate;		// kernel selected for this CPU
+};
+
+/*
+* Integer correlator, templated on the sample type and accumulator type
+* (int8_t/int32_t, int16_t/int32_t, int32_t/int64_t). Reference tables are
+* quantised to 15 fractional bits, scaled by 2^15-1 so that 1.0 fits in an
+* int16_t, and reduced where necessary so that the sum over iSymL taps of
+* full scale samples can't overflow the accumulator. History is a
+* doubled ring so each window is contiguous and the tap loop has a fixed
+* stride, which lets the compiler vectorise it (pmaddwd for 16 bit samples).
+* Only the final discriminant is converted to floating point.
+*/
+template<class TSample, class TAcc> class CDemodulatorT : public CDemodulator
+{
+public:
+	CDemodulatorT(double aFs);
+	virtual ~CDemodulatorT();
+	virtual int Sample(int aSample);
+	virtual void Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+private:
+	inline double Correlate(TSample aSample);
+private:
+	int				iShift;			// fractional bits in reference tables
+	int				iPos;			// ring position for next sample
+	int16_t*		iRef;			// 4 reversed reference tables of iSymL each
+	TSample*		iRing;			// 2*iSymL samples, each written twice
+};
+
+/*
+* Correlator specialised at compile time for a standard capture rate
+* (44100, 48000, 88200 or 96000 Hz). The symbol length is a compile time
+* constant and the reference tables are generated by constexpr functions,
+* so the tap loop has a fixed trip count which the compiler unrolls and
+* vectorises. History is a doubled ring filled backwards so each window is
+* contiguous with the newest sample first, summing in the same order as
+* CDemodulator. New() uses this for the correlator engine when the sample
+* rate matches and falls back to CDemodulator otherwise.
+*/
+template<uint32_t FS> class CRateDemodulator : public CDemodulator
+{
+public:
+	CRateDemodulator();
+	virtual ~CRateDemodulator();
+	virtual int Sample(int aSample);
+	virtual void Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+private:
+	inline double Correlate(double aSample);
+private:
+	int				iPos;			// ring position of newest sample
+	double*			iRing;			// 2*iSymL samples, each written twice
+};
+
+/*
+* Pulse width demodulator. Measures the time between zero crossings of the
+* input, interpolated to a fraction of a sample; a 1200Hz half cycle lasts
+* as long as two 2400Hz ones. Each half cycle gives the threshold half way
+* between the two lengths minus its own length, positive for 1 and negative
+* for 0. That is held until the next crossing and summed over PULSE_WINDOW
+* of a symbol, short enough for a lone 0 between 1s to give a clear
+* negative value; the sum is the discriminant passed to Decide(), so bit
+* timing works the same way as the correlator's. Summing, rather than
+* using the last half cycle alone, copes with half cycles that straddle a
+* bit boundary, which most do once the tone phase has drifted from the bit
+* clock. The input is band pass filtered first and crossings need the
+* signal to move past a hysteresis level proportional to a decaying peak
+* amplitude, so noise doesn't add crossings. Much cheaper than correlation
+* but less tolerant of noise and distortion, so New() wraps it in
+* CFallbackDemodulator.
+*/
+class CPulseDemodulator : public CDemodulator
+{
+public:
+	CPulseDemodulator(double aFs);
+	virtual int Sample(int aSample);
+	virtual void Process(const float* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Tune(double aBias, double aPhase);
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+private:
+	inline int Step(double aSample);
+private:
+	double			iBpB0;			// band pass filter coefficients
+	double			iBpA1;
+	double			iBpA2;
+	double			iBpX1;			// band pass filter previous inputs
+	double			iBpX2;
+	double			iBpY1;			// band pass filter previous outputs
+	double			iBpY2;
+	double			iThreshold;		// half cycles shorter than this are short
+	double			iPeak;			// decaying peak absolute amplitude
+	double			iDecay;			// per sample decay factor for iPeak
+	double			iLast;			// previous filtered sample
+	double			iZero;			// time of last change of sign, in samples
+	double			iCrossing;		// time of the zero crossing which ended the last half cycle
+	double			iY;				// discriminant from last complete half cycle
+	double			iSum;			// iY summed over the last iWindow samples
+	int				iWindow;		// samples summed, no more than iSymL
+	int				iPos;			// position of oldest value in iHistory ring
+	bool			iHigh;			// signal is currently above zero
 };
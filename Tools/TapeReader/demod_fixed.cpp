@@ -0,0 +1,135 @@
+/*
+* Fixed point binary FSK demodulator
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "demod.h"
+#include "checkpoint.h"
+
+// saturate a sample to the range of TSample
+template<class TSample> inline TSample Saturate(int32_t aX)
+{
+	const int32_t hi = (int32_t)((1ULL << (8*sizeof(TSample) - 1)) - 1);
+	const int32_t lo = -hi - 1;
+	return (TSample)((aX > hi) ? hi : (aX < lo) ? lo : aX);
+}
+
+template<class TSample, class TAcc> CDemodulatorT<TSample, TAcc>::CDemodulatorT(double aFs)
+:	CDemodulator(aFs),
+	iShift(15),
+	iPos(0),
+	iRef(0),
+	iRing(0)
+{
+	// headroom: sample bits + table bits + log2(taps) must fit the accumulator
+	int sampleBits = 8*sizeof(TSample) - 1;
+	int accBits = 8*sizeof(TAcc) - 1;
+	int tapBits = 0;
+	while ((1 << tapBits) < iSymL)
+		++tapBits;
+	if (iShift > accBits - sampleBits - tapBits)
+		iShift = accBits - sampleBits - tapBits;
+
+	iRef = new int16_t[4 * iSymL];
+	iRing = new TSample[2 * iSymL];
+	memset(iRing, 0, 2 * iSymL * sizeof(TSample));
+	double scale = (double)((1 << iShift) - 1);		// so that a tap of 1.0 fits in int16_t
+	int j;
+	for (j=0; j<iSymL; ++j)
+	{
+		int k = iSymL - 1 - j;		// age of sample this tap applies to
+		iRef[j] = (int16_t)floor(iSym0I[k] * scale + 0.5);
+		iRef[j + iSymL] = (int16_t)floor(iSym0Q[k] * scale + 0.5);
+		iRef[j + 2*iSymL] = (int16_t)floor(iSym1I[k] * scale + 0.5);
+		iRef[j + 3*iSymL] = (int16_t)floor(iSym1Q[k] * scale + 0.5);
+	}
+}
+
+template<class TSample, class TAcc> CDemodulatorT<TSample, TAcc>::~CDemodulatorT()
+{
+	delete[] iRing;
+	delete[] iRef;
+}
+
+template<class TSample, class TAcc> void CDemodulatorT<TSample, TAcc>::Checkpoint(CCheckpoint& aCp)
+{
+	CDemodulator::Checkpoint(aCp);
+	aCp.State(iPos);
+	aCp.State(iRing, 2 * iSymL * sizeof(TSample));
+}
+
+template<class TSample, class TAcc> void CDemodulatorT<TSample, TAcc>::Reset()
+{
+	CDemodulator::Reset();
+	iPos = 0;
+	memset(iRing, 0, 2 * iSymL * sizeof(TSample));
+}
+
+template<class TSample, class TAcc> inline double CDemodulatorT<TSample, TAcc>::Correlate(TSample aSample)
+{
+	iRing[iPos] = aSample;
+	iRing[iPos + iSymL] = aSample;
+	if (++iPos == iSymL)
+		iPos = 0;
+	++iNSamples;
+
+	const TSample* w = iRing + iPos;		// oldest sample first
+	const int16_t* r0i = iRef;
+	const int16_t* r0q = iRef + iSymL;
+	const int16_t* r1i = iRef + 2*iSymL;
+	const int16_t* r1q = iRef + 3*iSymL;
+	TAcc i0 = 0;
+	TAcc q0 = 0;
+	TAcc i1 = 0;
+	TAcc q1 = 0;
+	int j;
+	for (j=0; j<iSymL; ++j)
+	{
+		TAcc x = w[j];
+		i0 += x * r0i[j];
+		q0 += x * r0q[j];
+		i1 += x * r1i[j];
+		q1 += x * r1q[j];
+	}
+	return (double)i1*i1 + (double)q1*q1 - (double)i0*i0 - (double)q0*q0;
+}
+
+template<class TSample, class TAcc> int CDemodulatorT<TSample, TAcc>::Sample(int aSample)
+{
+	return Decide(Correlate(Saturate<TSample>(aSample)));
+}
+
+template<class TSample, class TAcc> void CDemodulatorT<TSample, TAcc>::Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Measure(aIn, aN);
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		int bit = Decide(Correlate(Saturate<TSample>(aIn[i])));
+		if (bit != NO_BIT)
+			aSink.Bit((uint32_t)bit, iConfidence);
+	}
+}
+
+template class CDemodulatorT<int8_t, int32_t>;
+template class CDemodulatorT<int16_t, int32_t>;
+template class CDemodulatorT<int32_t, int64_t>;
@@ -0,0 +1,177 @@
+/*
+* Pulse width binary FSK demodulator
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include "demod.h"
+#include "checkpoint.h"
+
+#ifndef PI
+#define PI		(3.14159265358979323846)
+#endif
+
+#define	PULSE_FILTER_Q		(0.7)		// Q of the band pass filter ahead of the crossing detector
+#define	PULSE_HYSTERESIS	(0.125)		// crossing hysteresis as a fraction of peak amplitude
+#define	PULSE_PEAK_DECAY	(0.05)		// seconds for the peak tracker to fall by a factor of e
+#define	PULSE_WINDOW		(0.75)		// symbols over which the discriminant is summed
+#define	PULSE_PHASE			(0.225)		// sampling point, in symbols, earlier than the correlator's
+
+CPulseDemodulator::CPulseDemodulator(double aFs)
+:	CDemodulator(aFs),
+	iBpB0(0),
+	iBpA1(0),
+	iBpA2(0),
+	iBpX1(0),
+	iBpX2(0),
+	iBpY1(0),
+	iBpY2(0),
+	iThreshold(3.0 * aFs / (8.0 * FREQ0)),
+	iPeak(0),
+	iDecay(exp(-1.0 / (PULSE_PEAK_DECAY * aFs))),
+	iLast(0),
+	iZero(0),
+	iCrossing(0),
+	iY(0),
+	iSum(0),
+	iWindow(0),
+	iPos(0),
+	iHigh(false)
+{
+	// band pass centred between the two tones, unity gain at the centre
+	double w = 2 * PI * sqrt(FREQ0 * FREQ1) / aFs;
+	double alpha = sin(w) / (2 * PULSE_FILTER_Q);
+	iBpB0 = alpha / (1 + alpha);
+	iBpA1 = -2 * cos(w) / (1 + alpha);
+	iBpA2 = (1 - alpha) / (1 + alpha);
+
+	iWindow = (int)(PULSE_WINDOW * aFs / FREQ0 + 0.5);
+	if (iWindow < 1)
+		iWindow = 1;
+	if (iWindow > iSymL)
+		iWindow = iSymL;
+	iPhaseReset = PULSE_PHASE * 4 * PI;
+}
+
+// aPhase is relative to this engine's own sampling point
+void CPulseDemodulator::Tune(double aBias, double aPhase)
+{
+	CDemodulator::Tune(aBias, aPhase + PULSE_PHASE);
+}
+
+inline int CPulseDemodulator::Step(double aSample)
+{
+	double x = iBpB0 * (aSample - iBpX2) - iBpA1 * iBpY1 - iBpA2 * iBpY2;
+	iBpX2 = iBpX1;
+	iBpX1 = aSample;
+	iBpY2 = iBpY1;
+	iBpY1 = x;
+
+	double a = fabs(x);
+	iPeak = (a > iPeak) ? a : iPeak * iDecay;
+	double h = iPeak * PULSE_HYSTERESIS;
+	double last = iLast;
+	uint32_t n = iNSamples;
+	iLast = x;
+	++iNSamples;
+	if ((last > 0) != (x > 0))
+	{
+		// where the line between this sample and the previous one meets zero
+		iZero = (double)n - x / (x - last);
+	}
+	if (iHigh ? (x < -h) : (x > h))
+	{
+		// crossed to the other side of the hysteresis band, so the half
+		// cycle ended at the last zero crossing
+		iHigh = !iHigh;
+		iY = iThreshold - (iZero - iCrossing);
+		iCrossing = iZero;
+	}
+
+	// sum iY over the window, using iHistory as a ring
+	iSum += iY - iHistory[iPos];
+	iHistory[iPos] = iY;
+	if (++iPos == iWindow)
+		iPos = 0;
+	return Decide(iSum);
+}
+
+void CPulseDemodulator::Checkpoint(CCheckpoint& aCp)
+{
+	CDemodulator::Checkpoint(aCp);
+	aCp.State(iBpX1);
+	aCp.State(iBpX2);
+	aCp.State(iBpY1);
+	aCp.State(iBpY2);
+	aCp.State(iPeak);
+	aCp.State(iLast);
+	aCp.State(iZero);
+	aCp.State(iCrossing);
+	aCp.State(iY);
+	aCp.State(iSum);
+	aCp.State(iPos);
+	aCp.State(iHigh);
+}
+
+void CPulseDemodulator::Reset()
+{
+	CDemodulator::Reset();
+	iBpX1 = 0;
+	iBpX2 = 0;
+	iBpY1 = 0;
+	iBpY2 = 0;
+	iPeak = 0;
+	iLast = 0;
+	iZero = 0;
+	iCrossing = 0;
+	iY = 0;
+	iSum = 0;
+	iPos = 0;
+	iHigh = false;
+}
+
+int CPulseDemodulator::Sample(int aSample)
+{
+	return Step((double)aSample);
+}
+
+void CPulseDemodulator::Process(const float* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Measure(aIn, aN);
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		int bit = Step((double)aIn[i]);
+		if (bit != NO_BIT)
+			aSink.Bit((uint32_t)bit, iConfidence);
+	}
+}
+
+void CPulseDemodulator::Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Measure(aIn, aN);
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		int bit = Step((double)aIn[i]);
+		if (bit != NO_BIT)
+			aSink.Bit((uint32_t)bit, iConfidence);
+	}
+}
@@ -0,0 +1,179 @@
+/*
+* Binary FSK demodulator specialised for standard sample rates
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "demod.h"
+#include "checkpoint.h"
+
+#ifndef PI
+#define PI		(3.14159265358979323846)
+#endif
+
+// reduce an angle to [-pi,pi]
+constexpr double ConstReduce(double aX)
+{
+	double x = aX - (double)(long long)(aX / (2 * PI)) * 2 * PI;
+	if (x > PI)
+		x -= 2 * PI;
+	if (x < -PI)
+		x += 2 * PI;
+	return x;
+}
+
+// sine and cosine by Taylor series, usable in constant expressions
+constexpr double ConstSin(double aX)
+{
+	double x = ConstReduce(aX);
+	double term = x;
+	double sum = x;
+	int i = 1;
+	for (; i<30; ++i)
+	{
+		term *= -x * x / ((2*i) * (2*i + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+constexpr double ConstCos(double aX)
+{
+	double x = ConstReduce(aX);
+	double term = 1;
+	double sum = 1;
+	int i = 1;
+	for (; i<30; ++i)
+	{
+		term *= -x * x / ((2*i - 1) * (2*i));
+		sum += term;
+	}
+	return sum;
+}
+
+// ceil(aFs/FREQ0), as CDemodulator computes iSymL
+constexpr int ConstSymL(uint32_t aFs)
+{
+	return ((double)(int)(aFs / FREQ0) < aFs / FREQ0) ? (int)(aFs / FREQ0) + 1 : (int)(aFs / FREQ0);
+}
+
+// reference tables for one sample rate, indexed by sample age
+template<uint32_t FS> struct SRateTables
+{
+	enum { L = ConstSymL(FS) };
+	double i0[L];
+	double q0[L];
+	double i1[L];
+	double q1[L];
+
+	constexpr SRateTables()
+	:	i0(),
+		q0(),
+		i1(),
+		q1()
+	{
+		int i = 0;
+		for (; i<L; ++i)
+		{
+			double a = (double)i * (2 * PI * FREQ1 / FS);
+			i0[i] = ConstCos(a / 2);
+			q0[i] = ConstSin(a / 2);
+			i1[i] = ConstCos(a);
+			q1[i] = ConstSin(a);
+		}
+	}
+};
+
+template<uint32_t FS> constexpr SRateTables<FS> KRateTables = SRateTables<FS>();
+
+template<uint32_t FS> CRateDemodulator<FS>::CRateDemodulator()
+:	CDemodulator((double)FS),
+	iPos(0),
+	iRing(0)
+{
+	iRing = new double[2 * SRateTables<FS>::L];
+	memset(iRing, 0, 2 * SRateTables<FS>::L * sizeof(double));
+}
+
+template<uint32_t FS> CRateDemodulator<FS>::~CRateDemodulator()
+{
+	delete[] iRing;
+}
+
+template<uint32_t FS> void CRateDemodulator<FS>::Checkpoint(CCheckpoint& aCp)
+{
+	CDemodulator::Checkpoint(aCp);
+	aCp.State(iPos);
+	aCp.State(iRing, 2 * SRateTables<FS>::L * sizeof(double));
+}
+
+template<uint32_t FS> void CRateDemodulator<FS>::Reset()
+{
+	CDemodulator::Reset();
+	iPos = 0;
+	memset(iRing, 0, 2 * SRateTables<FS>::L * sizeof(double));
+}
+
+template<uint32_t FS> inline double CRateDemodulator<FS>::Correlate(double aSample)
+{
+	const int L = SRateTables<FS>::L;
+	const SRateTables<FS>& t = KRateTables<FS>;
+	iPos = iPos ? iPos - 1 : L - 1;
+	iRing[iPos] = aSample;
+	iRing[iPos + L] = aSample;
+	++iNSamples;
+
+	const double* w = iRing + iPos;		// newest sample first
+	double i0 = 0;
+	double q0 = 0;
+	double i1 = 0;
+	double q1 = 0;
+	int i;
+	for (i=0; i<L; ++i)
+	{
+		i0 += w[i] * t.i0[i];
+		q0 += w[i] * t.q0[i];
+		i1 += w[i] * t.i1[i];
+		q1 += w[i] * t.q1[i];
+	}
+	return i1*i1 + q1*q1 - i0*i0 - q0*q0;
+}
+
+template<uint32_t FS> int CRateDemodulator<FS>::Sample(int aSample)
+{
+	return Decide(Correlate((double)aSample));
+}
+
+template<uint32_t FS> void CRateDemodulator<FS>::Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Measure(aIn, aN);
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		int bit = Decide(Correlate((double)aIn[i]));
+		if (bit != NO_BIT)
+			aSink.Bit((uint32_t)bit, iConfidence);
+	}
+}
+
+template class CRateDemodulator<44100>;
+template class CRateDemodulator<48000>;
+template class CRateDemodulator<88200>;
+template class CRateDemodulator<96000>;
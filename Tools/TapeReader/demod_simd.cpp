@@ -0,0 +1,227 @@
+/*
+* SIMD block correlator for binary FSK demodulator
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "cpu.h"
+#include "demod.h"
+#include "checkpoint.h"
+
+static void CorrelateScalar(const float* aX, const float* aRef, uint32_t aTaps, uint32_t aN, float* aY)
+{
+	const float* r0i = aRef;
+	const float* r0q = aRef + aTaps;
+	const float* r1i = aRef + 2*aTaps;
+	const float* r1q = aRef + 3*aTaps;
+	uint32_t n, j;
+	for (n=0; n<aN; ++n, ++aX)
+	{
+		float i0 = 0;
+		float q0 = 0;
+		float i1 = 0;
+		float q1 = 0;
+		for (j=0; j<aTaps; ++j)
+		{
+			i0 += aX[j] * r0i[j];
+			q0 += aX[j] * r0q[j];
+			i1 += aX[j] * r1i[j];
+			q1 += aX[j] * r1q[j];
+		}
+		aY[n] = i1*i1 + q1*q1 - i0*i0 - q0*q0;
+	}
+}
+
+#ifdef HAVE_SSE2
+// sum each of four vectors and return the results as one vector
+inline __m128 Sum4(__m128 aA, __m128 aB, __m128 aC, __m128 aD)
+{
+	_MM_TRANSPOSE4_PS(aA, aB, aC, aD);
+	return _mm_add_ps(_mm_add_ps(aA, aB), _mm_add_ps(aC, aD));
+}
+
+// from the four sums (i0, q0, i1, q1) compute i1^2 + q1^2 - i0^2 - q0^2
+inline float Discriminant(__m128 aS)
+{
+	float s[4];
+	_mm_storeu_ps(s, _mm_mul_ps(aS, aS));
+	return s[2] + s[3] - s[0] - s[1];
+}
+
+static void CorrelateSse(const float* aX, const float* aRef, uint32_t aTaps, uint32_t aN, float* aY)
+{
+	const float* r0i = aRef;
+	const float* r0q = aRef + aTaps;
+	const float* r1i = aRef + 2*aTaps;
+	const float* r1q = aRef + 3*aTaps;
+	uint32_t n, j;
+	for (n=0; n<aN; ++n, ++aX)
+	{
+		__m128 i0 = _mm_setzero_ps();
+		__m128 q0 = _mm_setzero_ps();
+		__m128 i1 = _mm_setzero_ps();
+		__m128 q1 = _mm_setzero_ps();
+		for (j=0; j<aTaps; j+=4)
+		{
+			__m128 x = _mm_loadu_ps(aX + j);
+			i0 = _mm_add_ps(i0, _mm_mul_ps(x, _mm_loadu_ps(r0i + j)));
+			q0 = _mm_add_ps(q0, _mm_mul_ps(x, _mm_loadu_ps(r0q + j)));
+			i1 = _mm_add_ps(i1, _mm_mul_ps(x, _mm_loadu_ps(r1i + j)));
+			q1 = _mm_add_ps(q1, _mm_mul_ps(x, _mm_loadu_ps(r1q + j)));
+		}
+		aY[n] = Discriminant(Sum4(i0, q0, i1, q1));
+	}
+}
+
+TARGET_AVX2_FMA static void CorrelateAvx2(const float* aX, const float* aRef, uint32_t aTaps, uint32_t aN, float* aY)
+{
+	const float* r0i = aRef;
+	const float* r0q = aRef + aTaps;
+	const float* r1i = aRef + 2*aTaps;
+	const float* r1q = aRef + 3*aTaps;
+	uint32_t n, j;
+	for (n=0; n<aN; ++n, ++aX)
+	{
+		__m256 i0 = _mm256_setzero_ps();
+		__m256 q0 = _mm256_setzero_ps();
+		__m256 i1 = _mm256_setzero_ps();
+		__m256 q1 = _mm256_setzero_ps();
+		for (j=0; j<aTaps; j+=8)
+		{
+			__m256 x = _mm256_loadu_ps(aX + j);
+			i0 = _mm256_fmadd_ps(x, _mm256_loadu_ps(r0i + j), i0);
+			q0 = _mm256_fmadd_ps(x, _mm256_loadu_ps(r0q + j), q0);
+			i1 = _mm256_fmadd_ps(x, _mm256_loadu_ps(r1i + j), i1);
+			q1 = _mm256_fmadd_ps(x, _mm256_loadu_ps(r1q + j), q1);
+		}
+		__m128 a = _mm_add_ps(_mm256_castps256_ps128(i0), _mm256_extractf128_ps(i0, 1));
+		__m128 b = _mm_add_ps(_mm256_castps256_ps128(q0), _mm256_extractf128_ps(q0, 1));
+		__m128 c = _mm_add_ps(_mm256_castps256_ps128(i1), _mm256_extractf128_ps(i1, 1));
+		__m128 d = _mm_add_ps(_mm256_castps256_ps128(q1), _mm256_extractf128_ps(q1, 1));
+		aY[n] = Discriminant(Sum4(a, b, c, d));
+	}
+}
+#endif
+
+CSimdDemodulator::CSimdDemodulator(double aFs)
+:	CDemodulator(aFs),
+	iTaps(0),
+	iRef(0),
+	iWork(0),
+	iY(0),
+	iCorrelate(&CorrelateScalar)
+{
+	iTaps = (iSymL + 7) & ~7U;
+	iRef = new float[4 * iTaps];
+	iWork = new float[iTaps - 1 + SIMD_BLOCK_SIZE];
+	iY = new float[SIMD_BLOCK_SIZE];
+	memset(iWork, 0, (iTaps - 1) * sizeof(float));
+
+	// window for each output is oldest sample first, so reverse the tables
+	uint32_t j;
+	for (j=0; j<iTaps; ++j)
+	{
+		uint32_t k = iTaps - 1 - j;		// age of sample this tap applies to
+		bool used = k < (uint32_t)iSymL;
+		iRef[j] = used ? (float)iSym0I[k] : 0.0f;
+		iRef[j + iTaps] = used ? (float)iSym0Q[k] : 0.0f;
+		iRef[j + 2*iTaps] = used ? (float)iSym1I[k] : 0.0f;
+		iRef[j + 3*iTaps] = used ? (float)iSym1Q[k] : 0.0f;
+	}
+#ifdef HAVE_SSE2
+	iCorrelate = &CorrelateSse;
+	if (CpuHasAvx2() && CpuHasFma())
+		iCorrelate = &CorrelateAvx2;
+#endif
+}
+
+CSimdDemodulator::~CSimdDemodulator()
+{
+	delete[] iY;
+	delete[] iWork;
+	delete[] iRef;
+}
+
+// the history at the start of the work buffer is the only state between blocks
+void CSimdDemodulator::Checkpoint(CCheckpoint& aCp)
+{
+	CDemodulator::Checkpoint(aCp);
+	aCp.State(iWork, (iTaps - 1) * sizeof(float));
+}
+
+void CSimdDemodulator::Reset()
+{
+	CDemodulator::Reset();
+	memset(iWork, 0, (iTaps - 1) * sizeof(float));
+}
+
+class CSingleBitSink : public CBitSink
+{
+public:
+	CSingleBitSink() : iBit(NO_BIT) {}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence) { iBit = (int)aBit; }
+public:
+	int iBit;
+};
+
+int CSimdDemodulator::Sample(int aSample)
+{
+	float x = (float)aSample;
+	CSingleBitSink sink;
+	Process(&x, 1, sink);
+	return sink.iBit;
+}
+
+void CSimdDemodulator::Process(const float* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Measure(aIn, aN);
+	while (aN)
+	{
+		uint32_t n = (aN < SIMD_BLOCK_SIZE) ? aN : SIMD_BLOCK_SIZE;
+		memcpy(iWork + iTaps - 1, aIn, n * sizeof(float));
+		iCorrelate(iWork, iRef, iTaps, n, iY);
+		uint32_t i;
+		for (i=0; i<n; ++i)
+		{
+			++iNSamples;
+			int bit = Decide(iY[i]);
+			if (bit != NO_BIT)
+				aSink.Bit((uint32_t)bit, iConfidence);
+		}
+		memmove(iWork, iWork + n, (iTaps - 1) * sizeof(float));
+		aIn += n;
+		aN -= n;
+	}
+}
+
+void CSimdDemodulator::Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink)
+{
+	float buf[SIMD_BLOCK_SIZE];
+	while (aN)
+	{
+		uint32_t n = (aN < SIMD_BLOCK_SIZE) ? aN : SIMD_BLOCK_SIZE;
+		uint32_t i;
+		for (i=0; i<n; ++i)
+			buf[i] = (float)aIn[i];
+		Process(buf, n, aSink);
+		aIn += n;
+		aN -= n;
+	}
+}
@@ -0,0 +1,400 @@
+/*
+* Structured event log
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "decoder.h"
+#include "eventlog.h"
+
+static const char* const TheTypeNames[] =
+{
+	"framing", "header_repaired", "block_repaired", "header_recovered", "block_recovered",
+	"file", "block", "eof", "error",
+};
+
+static const char* const TheSeverityNames[] =
+{
+	"debug", "info", "warning", "none",
+};
+
+static const char* const TheFormatNames[] =
+{
+	"text", "json", "binary",
+};
+
+static void PutUInt16LE(char* aPtr, uint32_t aValue)
+{
+	aPtr[0] = (char)aValue;
+	aPtr[1] = (char)(aValue >> 8);
+}
+
+static void PutUInt32LE(char* aPtr, uint32_t aValue)
+{
+	PutUInt16LE(aPtr, aValue);
+	PutUInt16LE(aPtr + 2, aValue >> 16);
+}
+
+static void PutUInt64LE(char* aPtr, uint64_t aValue)
+{
+	PutUInt32LE(aPtr, (uint32_t)aValue);
+	PutUInt32LE(aPtr + 4, (uint32_t)(aValue >> 32));
+}
+
+CEventLog::CEventLog(FILE* aFile, TEventFormat aFormat, TEventSeverity aLevel, bool aAsync)
+:	iFile(aFile),
+	iFormat(aFormat),
+	iLevel(aLevel),
+	iFrame(EVENTLOG_NO_FRAME),
+	iBatch(new SEvent[EVENTLOG_BATCH]),
+	iCount(0),
+	iText(new char[EVENTLOG_TEXT_SIZE]),
+	iThread(0),
+	iPending(0),
+	iPendingCount(0),
+	iStop(false)
+{
+	if (iFormat == EEventBinary)
+	{
+		char hdr[EVENTLOG_HEADER_SIZE];
+		memset(hdr, 0, sizeof(hdr));
+		PutUInt32LE(hdr, EVENTLOG_MAGIC);
+		PutUInt32LE(hdr + 4, EVENTLOG_VERSION);
+		PutUInt32LE(hdr + 8, EVENTLOG_RECORD_SIZE);
+		fwrite(hdr, 1, sizeof(hdr), iFile);
+	}
+	if (aAsync && iLevel != ESeverityNone)
+	{
+		iPending = new SEvent[EVENTLOG_BATCH];
+		iThread = new std::thread(&CEventLog::Writer, this);
+	}
+}
+
+// A log which keeps its events in memory
+CEventLog::CEventLog(TEventSeverity aLevel)
+:	iFile(0),
+	iFormat(EEventText),
+	iLevel(aLevel),
+	iFrame(EVENTLOG_NO_FRAME),
+	iBatch(new SEvent[EVENTLOG_BATCH]),
+	iCount(0),
+	iText(0),
+	iThread(0),
+	iPending(0),
+	iPendingCount(0),
+	iStop(false)
+{
+}
+
+CEventLog::~CEventLog()
+{
+	Flush();
+	if (iThread)
+	{
+		{
+			std::unique_lock<std::mutex> lock(iLock);
+			iStop = true;
+		}
+		iWake.notify_all();
+		iThread->join();
+		delete iThread;
+	}
+	delete[] iPending;
+	delete[] iText;
+	delete[] iBatch;
+}
+
+bool CEventLog::FormatFromName(const char* aName, TEventFormat& aFormat)
+{
+	uint32_t i;
+	for (i=0; i<sizeof(TheFormatNames)/sizeof(TheFormatNames[0]); ++i)
+	{
+		if (strcmp(aName, TheFormatNames[i]) == 0)
+		{
+			aFormat = (TEventFormat)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CEventLog::SeverityFromName(const char* aName, TEventSeverity& aSeverity)
+{
+	uint32_t i;
+	for (i=0; i<sizeof(TheSeverityNames)/sizeof(TheSeverityNames[0]); ++i)
+	{
+		if (strcmp(aName, TheSeverityNames[i]) == 0)
+		{
+			aSeverity = (TEventSeverity)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Record an event. aName, if not 0, and aBlockNum identify the block.
+void CEventLog::Add(TEventType aType, TEventSeverity aSeverity, uint32_t aBit, const char* aName, uint32_t aBlockNum,
+	uint32_t aErr, uint32_t aArg0, uint32_t aArg1, double aSpeed)
+{
+	if (!Enabled(aSeverity))
+		return;
+	SEvent& e = iBatch[iCount];
+	e.iFrame = iFrame;
+	e.iSpeed = aSpeed;
+	e.iBit = aBit;
+	e.iErr = aErr;
+	e.iArg[0] = aArg0;
+	e.iArg[1] = aArg1;
+	e.iType = (uint16_t)aType;
+	e.iBlockNum = (uint16_t)aBlockNum;
+	e.iSeverity = (uint8_t)aSeverity;
+	memset(e.iName, 0, sizeof(e.iName));
+	if (aName)
+		strncpy(e.iName, aName, MAX_NAME_LENGTH);
+	if (++iCount == EVENTLOG_BATCH)
+		Submit();
+}
+
+// Pass the batch on to be written: directly, or by swapping it with the
+// writer thread's once that is idle
+void CEventLog::Submit()
+{
+	if (iCount == 0)
+		return;
+	if (!iFile)
+	{
+		iKept.insert(iKept.end(), iBatch, iBatch + iCount);
+		iCount = 0;
+		return;
+	}
+	if (!iThread)
+	{
+		Write(iBatch, iCount);
+		iCount = 0;
+		return;
+	}
+	std::unique_lock<std::mutex> lock(iLock);
+	while (iPendingCount)
+		iWake.wait(lock);
+	SEvent* t = iPending;
+	iPending = iBatch;
+	iBatch = t;
+	iPendingCount = iCount;
+	iCount = 0;
+	lock.unlock();
+	iWake.notify_all();
+}
+
+// Write everything logged so far
+void CEventLog::Flush()
+{
+	Submit();
+	if (iThread)
+	{
+		std::unique_lock<std::mutex> lock(iLock);
+		while (iPendingCount)
+			iWake.wait(lock);
+	}
+	if (iFile)
+		fflush(iFile);
+}
+
+// Add the oldest aCount events kept to aLog, in order and with their own
+// sample offsets, and forget them
+void CEventLog::PassOn(CEventLog& aLog, uint32_t aCount)
+{
+	Submit();
+	uint32_t i;
+	for (i=0; i<aCount; ++i)
+	{
+		if (!aLog.Enabled((TEventSeverity)iKept[i].iSeverity))
+			continue;
+		aLog.iBatch[aLog.iCount] = iKept[i];
+		if (++aLog.iCount == EVENTLOG_BATCH)
+			aLog.Submit();
+	}
+	iKept.erase(iKept.begin(), iKept.begin() + aCount);
+}
+
+void CEventLog::Writer()
+{
+	std::unique_lock<std::mutex> lock(iLock);
+	for (;;)
+	{
+		while (!iPendingCount && !iStop)
+			iWake.wait(lock);
+		if (!iPendingCount)
+			return;
+		// iPending isn't touched by the other side until iPendingCount is 0
+		lock.unlock();
+		Write(iPending, iPendingCount);
+		lock.lock();
+		iPendingCount = 0;
+		iWake.notify_all();
+	}
+}
+
+void CEventLog::Write(const SEvent* aEvents, uint32_t aCount)
+{
+	uint32_t n = 0;
+	uint32_t i;
+	for (i=0; i<aCount; ++i)
+	{
+		if (n > EVENTLOG_TEXT_SIZE - EVENTLOG_LINE_MAX)
+		{
+			fwrite(iText, 1, n, iFile);
+			n = 0;
+		}
+		n += Format(iText + n, aEvents[i]);
+	}
+	fwrite(iText, 1, n, iFile);
+}
+
+uint32_t CEventLog::Format(char* aOut, const SEvent& aEvent)
+{
+	switch (iFormat)
+	{
+	case EEventJson: return FormatJson(aOut, aEvent);
+	case EEventBinary: return FormatBinary(aOut, aEvent);
+	default: return FormatText(aOut, aEvent);
+	}
+}
+
+// the lines tape_reader has always printed
+uint32_t CEventLog::FormatText(char* aOut, const SEvent& aEvent)
+{
+	const SEvent& e = aEvent;
+	int n = 0;
+	switch (e.iType)
+	{
+	case EEventFraming:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "%1x %02x %1x (%u)\n", e.iArg[0]>>9, (e.iArg[0]>>1)&0xff, e.iArg[0]&1, e.iBit);
+		break;
+	case EEventHeaderRepaired:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "Header repaired (%u bits)\n", e.iArg[0]);
+		break;
+	case EEventBlockRepaired:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "Block %02x repaired (%u bits)\n", e.iBlockNum, e.iArg[0]);
+		break;
+	case EEventHeaderRecovered:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "Header recovered\n");
+		break;
+	case EEventBlockRecovered:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "Block %02x recovered\n", e.iBlockNum);
+		break;
+	case EEventFile:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "File %-10s  LA %08x  XA %08x\n", e.iName, e.iArg[0], e.iArg[1]);
+		break;
+	case EEventBlock:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "%-10s %02x %04x (%02x) speed %.3f\n", e.iName, e.iBlockNum, e.iArg[0], e.iArg[1], e.iSpeed);
+		break;
+	case EEventEof:
+		n = snprintf(aOut, EVENTLOG_LINE_MAX, "End of file\n");
+		break;
+	case EEventError:
+		if (e.iErr == CDecoder::ETruncatedBlock)
+			n = snprintf(aOut, EVENTLOG_LINE_MAX, "BlockNum %d truncated\n", e.iBlockNum);
+		else if (e.iErr == CDecoder::ETruncatedHeader)
+			n = snprintf(aOut, EVENTLOG_LINE_MAX, "BlockNum %d header truncated\n", e.iBlockNum);
+		else
+			n = snprintf(aOut, EVENTLOG_LINE_MAX, "BlockNum %d err %08x\n", e.iBlockNum, e.iErr);
+		break;
+	}
+	return (uint32_t)n;
+}
+
+// Write the name as a JSON string; bytes outside printable ASCII are escaped
+static int JsonName(char* aOut, const char* aName)
+{
+	int n = 0;
+	aOut[n++] = '"';
+	const uint8_t* p;
+	for (p=(const uint8_t*)aName; *p; ++p)
+	{
+		if (*p == '"' || *p == '\\')
+		{
+			aOut[n++] = '\\';
+			aOut[n++] = (char)*p;
+		}
+		else if (*p < 0x20 || *p >= 0x7F)
+			n += snprintf(aOut + n, 8, "\\u%04x", *p);
+		else
+			aOut[n++] = (char)*p;
+	}
+	aOut[n++] = '"';
+	return n;
+}
+
+uint32_t CEventLog::FormatJson(char* aOut, const SEvent& aEvent)
+{
+	const SEvent& e = aEvent;
+	int n = snprintf(aOut, EVENTLOG_LINE_MAX, "{\"type\":\"%s\",\"severity\":\"%s\"",
+		TheTypeNames[e.iType], TheSeverityNames[e.iSeverity]);
+	if (e.iFrame != EVENTLOG_NO_FRAME)
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"frame\":%llu", (unsigned long long)e.iFrame);
+	if (e.iBit != EVENTLOG_NO_BIT)
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"bit\":%u", e.iBit);
+	n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"name\":");
+	if (e.iName[0])
+		n += JsonName(aOut + n, e.iName);
+	else
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, "null");
+	n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"block\":%u", e.iBlockNum);
+	switch (e.iType)
+	{
+	case EEventFraming:
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"byte\":%u,\"start\":%u,\"stop\":%u", (e.iArg[0]>>1)&0xff, e.iArg[0]>>9, e.iArg[0]&1);
+		break;
+	case EEventHeaderRepaired:
+	case EEventBlockRepaired:
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"flips\":%u", e.iArg[0]);
+		break;
+	case EEventFile:
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"load\":%u,\"exec\":%u", e.iArg[0], e.iArg[1]);
+		break;
+	case EEventBlock:
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"length\":%u,\"flag\":%u,\"speed\":%.4f", e.iArg[0], e.iArg[1], e.iSpeed);
+		break;
+	case EEventError:
+		n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, ",\"errors\":%u", e.iErr);
+		break;
+	}
+	n += snprintf(aOut + n, EVENTLOG_LINE_MAX - n, "}\n");
+	return (uint32_t)n;
+}
+
+uint32_t CEventLog::FormatBinary(char* aOut, const SEvent& aEvent)
+{
+	const SEvent& e = aEvent;
+	uint64_t speed;
+	memcpy(&speed, &e.iSpeed, sizeof(speed));
+	PutUInt64LE(aOut, e.iFrame);
+	PutUInt64LE(aOut + 8, speed);
+	PutUInt32LE(aOut + 16, e.iBit);
+	PutUInt32LE(aOut + 20, e.iErr);
+	PutUInt32LE(aOut + 24, e.iArg[0]);
+	PutUInt32LE(aOut + 28, e.iArg[1]);
+	PutUInt16LE(aOut + 32, e.iType);
+	PutUInt16LE(aOut + 34, e.iBlockNum);
+	aOut[36] = (char)e.iSeverity;
+	memcpy(aOut + 37, e.iName, MAX_NAME_LENGTH+1);
+	return EVENTLOG_RECORD_SIZE;
+}
@@ -0,0 +1,134 @@
+/*
+* Header file for the structured event log
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define	EVENTLOG_BATCH			(1024)		// events buffered before they are formatted and written
+#define	EVENTLOG_TEXT_SIZE		(65536)		// bytes of formatted output buffered before writing
+#define	EVENTLOG_LINE_MAX		(256)		// longest formatted event
+#define	EVENTLOG_MAGIC			(0x4C564554U)	// "TEVL" little endian, starts a binary log
+#define	EVENTLOG_VERSION		(1)
+#define	EVENTLOG_HEADER_SIZE	(16)		// bytes of binary log before the first record
+#define	EVENTLOG_RECORD_SIZE	(48)		// bytes per event in a binary log
+#define	EVENTLOG_NO_FRAME		(~0ULL)		// frame of an event whose sample offset isn't known
+#define	EVENTLOG_NO_BIT			(~0U)		// bit count of an event not tied to the bit stream
+
+enum TEventSeverity
+{
+	ESeverityDebug = 0,				// every byte with a bad start or stop bit
+	ESeverityInfo = 1,				// files, blocks, repairs and recoveries
+	ESeverityWarning = 2,			// blocks lost or damaged
+	ESeverityNone = 3,				// as a filter level, log nothing
+};
+
+enum TEventType
+{
+	EEventFraming = 0,				// iArg[0] is the byte with its start and stop bits
+	EEventHeaderRepaired = 1,		// iArg[0] is the number of bits changed
+	EEventBlockRepaired = 2,		// iArg[0] is the number of bits changed
+	EEventHeaderRecovered = 3,
+	EEventBlockRecovered = 4,
+	EEventFile = 5,					// iArg[0] is the load address, iArg[1] the execution address
+	EEventBlock = 6,				// iArg[0] is the length, iArg[1] the flag, iSpeed the tape speed
+	EEventEof = 7,
+	EEventError = 8,				// iErr is the CDecoder::TError bits
+};
+
+enum TEventFormat
+{
+	EEventText = 0,					// one line per event, for people
+	EEventJson = 1,					// JSON Lines, one object per event
+	EEventBinary = 2,				// fixed size little endian records after a header
+};
+
+struct SEvent
+{
+	uint64_t		iFrame;			// sample offset, to the end of the read it fell in
+	double			iSpeed;
+	uint32_t		iBit;			// bits received by the decoder
+	uint32_t		iErr;
+	uint32_t		iArg[2];		// depends on iType
+	uint16_t		iType;			// TEventType
+	uint16_t		iBlockNum;		// with iName, the block the event belongs to
+	uint8_t			iSeverity;		// TEventSeverity
+	char			iName[MAX_NAME_LENGTH+1];	// empty if not in a file
+};
+
+/*
+* Log of decoding events, each with its type, severity, sample offset, bit
+* count, block and error bits. Events below the log's severity are dropped
+* by Enabled(), which callers check before building an event, so a quiet
+* log costs one comparison. Events are kept as records in a batch and only
+* formatted, as text, JSON Lines or binary, when the batch is full or the
+* log is flushed; with aAsync set that happens on a thread of its own,
+* while the next batch fills. Events must be added from one thread at a
+* time. Clock() sets the sample offset given to the events which follow.
+* A log made without a file keeps its events until PassOn() adds them to
+* another log, so a decoder on another thread can log into it and have its
+* events written in order with the rest.
+*/
+class CEventLog
+{
+public:
+	CEventLog(FILE* aFile, TEventFormat aFormat, TEventSeverity aLevel, bool aAsync);
+	CEventLog(TEventSeverity aLevel);
+	~CEventLog();
+	inline bool Enabled(TEventSeverity aSeverity) const { return aSeverity >= iLevel; }
+	inline TEventSeverity Level() const { return iLevel; }
+	inline void Clock(uint64_t aFrame) { iFrame = aFrame; }
+	void Add(TEventType aType, TEventSeverity aSeverity, uint32_t aBit, const char* aName, uint32_t aBlockNum,
+		uint32_t aErr = 0, uint32_t aArg0 = 0, uint32_t aArg1 = 0, double aSpeed = 0.0);
+	void Flush();
+	inline uint32_t Kept() const { return (uint32_t)iKept.size() + iCount; }
+	void PassOn(CEventLog& aLog, uint32_t aCount);
+	static bool FormatFromName(const char* aName, TEventFormat& aFormat);
+	static bool SeverityFromName(const char* aName, TEventSeverity& aSeverity);
+private:
+	void Submit();
+	void Writer();
+	void Write(const SEvent* aEvents, uint32_t aCount);
+	uint32_t Format(char* aOut, const SEvent& aEvent);
+	uint32_t FormatText(char* aOut, const SEvent& aEvent);
+	uint32_t FormatJson(char* aOut, const SEvent& aEvent);
+	uint32_t FormatBinary(char* aOut, const SEvent& aEvent);
+private:
+	FILE*			iFile;			// 0 if events are kept
+	TEventFormat	iFormat;
+	TEventSeverity	iLevel;			// least severe event logged
+	uint64_t		iFrame;			// from Clock()
+	SEvent*			iBatch;			// being filled
+	uint32_t		iCount;			// events in iBatch
+	char*			iText;			// formatted output, EVENTLOG_TEXT_SIZE bytes
+	std::vector<SEvent>	iKept;		// submitted events not yet passed on, if iFile is 0
+	// for asynchronous writing
+	std::thread*	iThread;		// 0 if writing synchronously
+	std::mutex		iLock;
+	std::condition_variable	iWake;	// signalled when iPending is filled or emptied
+	SEvent*			iPending;		// batch handed to the writer
+	uint32_t		iPendingCount;	// events in iPending, 0 when the writer is idle
+	bool			iStop;			// writer should finish
+};
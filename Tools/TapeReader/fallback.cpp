@@ -0,0 +1,396 @@
+/*
+* Demodulator with correlator fallback
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "demod.h"
+#include "decoder.h"
+#include "fallback.h"
+#include "checkpoint.h"
+
+#define	FALLBACK_PRE_ROLL	(80)		// bit periods before a replay's start to warm the engine up with
+#define	FALLBACK_LEADER_RUN	(32)		// consecutive 1 bits taken as a leader, longer than any byte gives
+#define	FALLBACK_HOLD_RUN	(16)		// bits at the end of a leader held back, fewer than FALLBACK_LEADER_RUN
+#define	FALLBACK_SYNC_WAIT	(30)		// bits after a leader within which the leader pattern should be complete
+#define	FALLBACK_DATA_ZEROS	(0.25)		// fraction of 0 bits after a leader taken as data rather than a bad leader
+#define	FALLBACK_CARRIER	(0.5)		// input power, relative to its decaying peak, taken as carrier
+#define	FALLBACK_PEAK_DECAY	(10)		// seconds for the peak input power to fall by a factor of e
+
+class CCaptureSink : public CBitSink
+{
+public:
+	CCaptureSink(CLeaderCapture& aCapture) : iCapture(aCapture) {}
+	virtual void Bit(uint32_t aBit, uint32_t) { iCapture.Bit(aBit); }
+private:
+	CLeaderCapture& iCapture;
+};
+
+CFallbackDemodulator::CFallbackDemodulator(double aFs, CDemodulator* aPrimary)
+:	CDemodulator(aFs),
+	iPrimary(aPrimary),
+	iBackup(0),
+	iRecovery(0),
+	iSink(0),
+	iRingSize(1),
+	iRing(0),
+	iChunk(0),
+	iWritten(0),
+	iChunkStart(0),
+	iChunkCount(0),
+	iMark(0),
+	iPreRoll(0),
+	iSince(0),
+	iFrom(0),
+	iLdr(0),
+	iRun(0),
+	iHeldFirst(0),
+	iHeldCount(0),
+	iAfter(0),
+	iMissed(false),
+	iEnergy(0),
+	iCount(0),
+	iPeakPower(0),
+	iCarrier(false),
+	iTakenOver(false)
+{
+	while (iRingSize < FALLBACK_HISTORY * aFs)
+		iRingSize <<= 1;
+	iRing = new float[iRingSize];
+	iChunk = new float[FALLBACK_CHUNK];
+	iPreRoll = (uint32_t)(FALLBACK_PRE_ROLL * aFs / FREQ0);
+	iBackup = CDemodulator::New(aFs, ECorrelator);
+	iRecovery = CDemodulator::New(aFs, ECorrelator);
+}
+
+CFallbackDemodulator::~CFallbackDemodulator()
+{
+	delete iRecovery;
+	delete iBackup;
+	delete[] iChunk;
+	delete[] iRing;
+	delete iPrimary;
+}
+
+void CFallbackDemodulator::Tune(double aBias, double aPhase)
+{
+	iPrimary->Tune(aBias, aPhase);
+	iBackup->Tune(aBias, aPhase);
+}
+
+// Either engine may have run since quality was last taken, so merge both.
+const SSignalQuality& CFallbackDemodulator::TakeQuality()
+{
+	CDecoder::AddQuality(*iQuality, iPrimary->TakeQuality());
+	CDecoder::AddQuality(*iQuality, iBackup->TakeQuality());
+	return CDemodulator::TakeQuality();
+}
+
+// iRecovery is reset before each use and iMissed is only set within
+// Process(), so neither is saved
+void CFallbackDemodulator::Checkpoint(CCheckpoint& aCp)
+{
+	CDemodulator::Checkpoint(aCp);
+	iPrimary->Checkpoint(aCp);
+	iBackup->Checkpoint(aCp);
+	aCp.State(iRing, iRingSize * sizeof(float));
+	aCp.State(iWritten);
+	aCp.State(iChunkStart);
+	aCp.State(iChunkCount);
+	aCp.State(iMark);
+	aCp.State(iSince);
+	aCp.State(iFrom);
+	aCp.State(iLdr);
+	aCp.State(iRun);
+	aCp.State(iHeldBit);
+	aCp.State(iHeldConf);
+	aCp.State(iHeldPos);
+	aCp.State(iHeldFirst);
+	aCp.State(iHeldCount);
+	aCp.State(iAfter);
+	aCp.State(iEnergy);
+	aCp.State(iCount);
+	aCp.State(iPeakPower);
+	aCp.State(iCarrier);
+	aCp.State(iTakenOver);
+}
+
+void CFallbackDemodulator::Reset()
+{
+	CDemodulator::Reset();
+	iPrimary->Reset();
+	iBackup->Reset();
+	iWritten = 0;
+	iChunkStart = 0;
+	iChunkCount = 0;
+	iMark = 0;
+	iSince = 0;
+	iFrom = 0;
+	iLdr = 0;
+	iRun = 0;
+	iHeldFirst = 0;
+	iHeldCount = 0;
+	iAfter = 0;
+	iMissed = false;
+	iEnergy = 0;
+	iCount = 0;
+	iPeakPower = 0;
+	iCarrier = false;
+	iTakenOver = false;
+}
+
+void CFallbackDemodulator::Record(const float* aIn, uint32_t aN)
+{
+	uint32_t pos = (uint32_t)iWritten & (iRingSize - 1);
+	uint32_t n = iRingSize - pos;
+	if (n > aN)
+		n = aN;
+	memcpy(iRing + pos, aIn, n * sizeof(float));
+	memcpy(iRing, aIn + n, (aN - n) * sizeof(float));
+	iChunkStart = iWritten;
+	iChunkCount = Active()->SampleCount();
+	iWritten += aN;
+}
+
+// Check for carrier once every FALLBACK_CHUNK samples, handing back to the
+// primary engine when it drops, and have the correlator take over before
+// these samples are recorded if there has been carrier for too long
+// without a leader. The time is counted from the end of any leader, or of
+// the bits held back after it, as a leader may last several seconds.
+void CFallbackDemodulator::Watch(const float* aIn, uint32_t aN)
+{
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+		iEnergy += (double)aIn[i] * aIn[i];
+	iCount += aN;
+	if (iCount >= FALLBACK_CHUNK)
+	{
+		double power = iEnergy / iCount;
+		iPeakPower = (power > iPeakPower) ? power : iPeakPower * exp(-(double)iCount / (FALLBACK_PEAK_DECAY * iFs));
+		iCarrier = (power > FALLBACK_CARRIER * iPeakPower);
+		iEnergy = 0;
+		iCount = 0;
+	}
+	if (!iCarrier)
+	{
+		iTakenOver = false;
+		iSince = iWritten;
+		return;
+	}
+	if (iTakenOver)
+		return;
+	if (iRun >= FALLBACK_LEADER_RUN || iHeldCount > 0)
+		iSince = iWritten;
+	else if (iWritten > iSince + (uint64_t)(FALLBACK_NO_LEADER * iFs))
+		TakeOver(iWritten);
+}
+
+// Bits from the active engine. The primary engine's are passed on, except
+// that the last FALLBACK_HOLD_RUN bits of a run of 1s and those following
+// it are held until the leader pattern is complete. If it isn't within
+// FALLBACK_SYNC_WAIT bits, and enough of those are 0 for them to be data,
+// the rest of the chunk's bits are dropped and the correlator takes over
+// from the first held bit. Fewer 0s are bad bits in a leader which carries
+// on, as the primary engine may give while it settles. Runs only count
+// while there is carrier, as an engine may give a steady stream of 1s in
+// silence.
+void CFallbackDemodulator::Bit(uint32_t aBit, uint32_t aConfidence)
+{
+	uint64_t pos = Position();
+	if (pos < iFrom)
+		return;
+	if (iTakenOver)
+	{
+		iSink->Bit(aBit, aConfidence);
+		return;
+	}
+	iRun = (aBit && iCarrier) ? iRun + 1 : 0;
+	iLdr = (iLdr << 1) | aBit;
+	if (iMissed)
+		return;
+	if (iRun >= FALLBACK_LEADER_RUN)
+	{
+		Release(FALLBACK_HOLD_RUN - 1);
+		Hold(aBit, aConfidence, pos);
+		iAfter = 0;
+	}
+	else if (iHeldCount == 0)
+		iSink->Bit(aBit, aConfidence);
+	else
+	{
+		Hold(aBit, aConfidence, pos);
+		if (iLdr == LEADER_PATTERN)
+			Release(0);
+		else if (++iAfter > FALLBACK_SYNC_WAIT)
+		{
+			if (!iCarrier)
+				Release(0);
+			else if (Zeros(iAfter) > FALLBACK_DATA_ZEROS * iAfter)
+				iMissed = true;
+			else
+			{
+				Release(FALLBACK_HOLD_RUN);
+				iAfter = 0;
+			}
+		}
+	}
+}
+
+void CFallbackDemodulator::Hold(uint32_t aBit, uint32_t aConfidence, uint64_t aPos)
+{
+	uint32_t i = (iHeldFirst + iHeldCount) % FALLBACK_HOLD;
+	iHeldBit[i] = (uint8_t)aBit;
+	iHeldConf[i] = (uint8_t)aConfidence;
+	iHeldPos[i] = aPos;
+	++iHeldCount;
+}
+
+// number of 0s in the newest aCount held bits
+uint32_t CFallbackDemodulator::Zeros(uint32_t aCount) const
+{
+	uint32_t zeros = 0;
+	uint32_t i;
+	for (i=iHeldCount-aCount; i<iHeldCount; ++i)
+		zeros += !iHeldBit[(iHeldFirst + i) % FALLBACK_HOLD];
+	return zeros;
+}
+
+// pass on the oldest held bits until aKeep are left
+void CFallbackDemodulator::Release(uint32_t aKeep)
+{
+	while (iHeldCount > aKeep)
+	{
+		iSink->Bit(iHeldBit[iHeldFirst], iHeldConf[iHeldFirst]);
+		iHeldFirst = (iHeldFirst + 1) % FALLBACK_HOLD;
+		--iHeldCount;
+	}
+}
+
+// Have the correlator replace the primary engine's bits from aFrom on. The
+// correlator's measurements of samples the primary engine has already
+// measured are dropped.
+void CFallbackDemodulator::TakeOver(uint64_t aFrom)
+{
+	iHeldCount = 0;
+	iAfter = 0;
+	iMissed = false;
+	iTakenOver = true;
+	iFrom = aFrom;
+	CDecoder::AddQuality(*iQuality, iBackup->TakeQuality());
+	Replay(iBackup, aFrom, *this, 0);
+	iBackup->TakeQuality();
+}
+
+// position of the sample the active engine is working on
+uint64_t CFallbackDemodulator::Position() const
+{
+	return iChunkStart + (uint32_t)(Active()->SampleCount() - iChunkCount);
+}
+
+int CFallbackDemodulator::Sample(int aSample)
+{
+	float x = (float)aSample;
+	Record(&x, 1);
+	return Active()->Sample(aSample);
+}
+
+void CFallbackDemodulator::Process(const float* aIn, uint32_t aN, CBitSink& aSink)
+{
+	iSink = &aSink;
+	while (aN > 0)
+	{
+		uint32_t n = (aN < FALLBACK_CHUNK) ? aN : FALLBACK_CHUNK;
+		Watch(aIn, n);
+		Record(aIn, n);
+		Active()->Process(aIn, n, *this);
+		if (iMissed)
+			TakeOver(iHeldPos[iHeldFirst]);
+		aIn += n;
+		aN -= n;
+	}
+}
+
+void CFallbackDemodulator::Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink)
+{
+	iSink = &aSink;
+	while (aN > 0)
+	{
+		uint32_t n = (aN < FALLBACK_CHUNK) ? aN : FALLBACK_CHUNK;
+		uint32_t i;
+		for (i=0; i<n; ++i)
+			iChunk[i] = (float)aIn[i];
+		Watch(iChunk, n);
+		Record(iChunk, n);
+		Active()->Process(aIn, n, *this);
+		if (iMissed)
+			TakeOver(iHeldPos[iHeldFirst]);
+		aIn += n;
+		aN -= n;
+	}
+}
+
+void CFallbackDemodulator::BlockStart()
+{
+	iMark = Position();
+	iSince = iMark;
+}
+
+void CFallbackDemodulator::BlockEnd()
+{
+	iSince = Position();
+}
+
+// Run recorded samples from iPreRoll before aStart, or the oldest still
+// held, to the newest through aDemod, stopping early once aCapture (if
+// given) is complete. If aDemod is the active engine its position is kept
+// up to date, as the bits it gives are checked against iFrom and the
+// decoder may find a leader in them.
+void CFallbackDemodulator::Replay(CDemodulator* aDemod, uint64_t aStart, CBitSink& aSink, const CLeaderCapture* aCapture)
+{
+	uint64_t start = (aStart > iPreRoll) ? aStart - iPreRoll : 0;
+	if (iWritten > iRingSize && start < iWritten - iRingSize)
+		start = iWritten - iRingSize;
+	while (start < iWritten && !(aCapture && aCapture->Complete()))
+	{
+		uint32_t pos = (uint32_t)start & (iRingSize - 1);
+		uint64_t n = iRingSize - pos;
+		if (n > iWritten - start)
+			n = iWritten - start;
+		if (n > FALLBACK_CHUNK)
+			n = FALLBACK_CHUNK;
+		if (aDemod == Active())
+		{
+			iChunkStart = start;
+			iChunkCount = aDemod->SampleCount();
+		}
+		aDemod->Process(iRing + pos, (uint32_t)n, aSink);
+		start += n;
+	}
+}
+
+uint32_t CFallbackDemodulator::Recover(uint8_t* aBuffer, uint32_t aLen)
+{
+	CLeaderCapture capture(aBuffer, aLen);
+	CCaptureSink sink(capture);
+	iRecovery->Reset();
+	Replay(iRecovery, iMark, sink, &capture);
+	return capture.Count();
+}
@@ -0,0 +1,111 @@
+/*
+* Header file for demodulator with correlator fallback
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+class CLeaderCapture;
+
+#define	FALLBACK_HISTORY	(4)			// seconds of input kept for re-demodulating failed blocks
+#define	FALLBACK_CHUNK		(1024)		// samples recorded then passed to the primary engine at a time
+#define	FALLBACK_NO_LEADER	(3)			// seconds of carrier without a leader before the correlator takes over
+#define	FALLBACK_HOLD		(64)		// most bits held back from the decoder after a leader
+
+/*
+* Runs a cheap primary demodulator over the whole input while keeping the
+* last FALLBACK_HISTORY seconds of samples. When the decoder finds a CRC
+* error it asks, through CBlockRecovery, for the block to be demodulated
+* again; the recorded samples from just before the block's leader are then
+* run through a correlator kept for the purpose. A primary engine which
+* can't follow the signal may not give the decoder a leader at all, so it
+* never asks. So Process() also watches the input for carrier and the
+* engine's bits for runs of 1s. The last few bits of a run, and those after
+* it, are held back until they complete the leader pattern the decoder looks
+* for. If they don't within a few bit periods, and look like data rather
+* than a bad bit in the leader, they are dropped and a second correlator is
+* run over the recorded samples from before the first of them. After
+* FALLBACK_NO_LEADER seconds of carrier with no block or run, the second
+* correlator is warmed up on the latest samples and takes over from there.
+* Either way the decoder is only given the correlator's bits from where the
+* primary engine's stopped, and the correlator carries on in place of the
+* primary engine until the carrier next drops. Input is recorded and passed
+* on in chunks of FALLBACK_CHUNK samples so that the history always covers
+* the sample the engine has reached. Needs the decoder to run in the same
+* thread as the demodulator.
+*/
+class CFallbackDemodulator : public CDemodulator, public CBlockRecovery, private CBitSink
+{
+public:
+	CFallbackDemodulator(double aFs, CDemodulator* aPrimary);
+	virtual ~CFallbackDemodulator();
+	virtual int Sample(int aSample);
+	virtual void Process(const float* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink);
+	virtual CBlockRecovery* Recovery() { return this; }
+	virtual void Tune(double aBias, double aPhase);
+	virtual double Speed() const { return Active()->Speed(); }
+	virtual const SSignalQuality& TakeQuality();
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+	virtual void BlockStart();
+	virtual void BlockEnd();
+	virtual uint32_t Recover(uint8_t* aBuffer, uint32_t aLen);
+private:
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence);
+	CDemodulator* Active() const { return iTakenOver ? iBackup : iPrimary; }
+	void Record(const float* aIn, uint32_t aN);
+	void Watch(const float* aIn, uint32_t aN);
+	void Hold(uint32_t aBit, uint32_t aConfidence, uint64_t aPos);
+	uint32_t Zeros(uint32_t aCount) const;
+	void Release(uint32_t aKeep);
+	void TakeOver(uint64_t aFrom);
+	void Replay(CDemodulator* aDemod, uint64_t aStart, CBitSink& aSink, const CLeaderCapture* aCapture);
+	uint64_t Position() const;
+private:
+	CDemodulator*	iPrimary;		// engine used unless it misses a leader
+	CDemodulator*	iBackup;		// correlator used while the primary engine finds no leaders
+	CDemodulator*	iRecovery;		// correlator used to re-demodulate failed blocks
+	CBitSink*		iSink;			// where bits go during Process()
+	uint32_t		iRingSize;		// samples of history, a power of 2
+	float*			iRing;			// history of input samples
+	float*			iChunk;			// integer input converted to float
+	uint64_t		iWritten;		// total samples recorded
+	uint64_t		iChunkStart;	// position of first sample of chunk being processed
+	uint32_t		iChunkCount;	// active engine's sample count at start of chunk
+	uint64_t		iMark;			// position at which last leader was detected
+	uint32_t		iPreRoll;		// samples before a replay's start to warm the engine up with
+	uint64_t		iSince;			// position of the last block start or end, leader, or gap
+	uint64_t		iFrom;			// bits from before this position have already been given out
+	uint64_t		iLdr;			// last 64 bits from the primary engine
+	uint32_t		iRun;			// consecutive 1 bits from the primary engine while there is carrier
+	uint8_t			iHeldBit[FALLBACK_HOLD];	// ring of bits held back from the decoder
+	uint8_t			iHeldConf[FALLBACK_HOLD];	// their confidences
+	uint64_t		iHeldPos[FALLBACK_HOLD];	// and the positions they were decided at
+	uint32_t		iHeldFirst;		// ring index of the oldest held bit
+	uint32_t		iHeldCount;		// bits held
+	uint32_t		iAfter;			// bits held since the last run of 1s ended
+	bool			iMissed;		// the held bits didn't give a leader, so the correlator takes over
+	double			iEnergy;		// sum of squared samples since the carrier was last checked
+	uint32_t		iCount;			// samples since the carrier was last checked
+	double			iPeakPower;		// decaying peak of the mean squared input
+	bool			iCarrier;		// input power was near its peak when last checked
+	bool			iTakenOver;		// iBackup is running in place of iPrimary
+};
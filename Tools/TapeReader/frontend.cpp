@@ -0,0 +1,132 @@
+/*
+* Decimating band-pass front end
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "demod.h"
+#include "frontend.h"
+#include "checkpoint.h"
+
+#ifndef PI
+#define PI		(3.14159265358979323846)
+#endif
+
+CFrontEnd::CFrontEnd(double aFs, double aTargetFs)
+:	iFs(aFs),
+	iOutFs(aFs),
+	iM(1),
+	iK(0),
+	iBranch(0),
+	iPos(0),
+	iTaps(0),
+	iHistory(0),
+	iDcR(0),
+	iDcX(0),
+	iDcY(0)
+{
+	iM = (uint32_t)(aFs / aTargetFs);
+	if (iM < 1)
+		iM = 1;
+	iOutFs = aFs / iM;
+
+	// Hamming window needs about 3.3/transition taps; round up to whole branches
+	uint32_t n = (uint32_t)ceil(3.3 * aFs / FRONTEND_TRANSITION) | 1;
+	iK = (n + iM - 1) / iM;
+	n = iK * iM;
+	iTaps = new float[n];
+	iHistory = new float[2 * n];
+	memset(iHistory, 0, 2 * n * sizeof(float));
+
+	// band-pass = difference of two low-pass sinc filters
+	double f1 = FRONTEND_LOW_CUT / aFs;
+	double f2 = FRONTEND_HIGH_CUT / aFs;
+	double c = 0.5 * (n - 1);
+	uint32_t i;
+	for (i=0; i<n; ++i)
+	{
+		double t = i - c;
+		double h = (t == 0) ? 2 * (f2 - f1) : (sin(2 * PI * f2 * t) - sin(2 * PI * f1 * t)) / (PI * t);
+		double w = 0.54 - 0.46 * cos(2 * PI * i / (n - 1));
+		// tap i belongs to branch i%M, position i/M; store reversed within branch
+		uint32_t p = i % iM;
+		uint32_t k = i / iM;
+		iTaps[p * iK + (iK - 1 - k)] = (float)(h * w);
+	}
+	iPos = iK - 1;
+	iDcR = 1.0 - 2 * PI * FRONTEND_DC_CORNER / aFs;
+}
+
+CFrontEnd::~CFrontEnd()
+{
+	delete[] iHistory;
+	delete[] iTaps;
+}
+
+void CFrontEnd::Checkpoint(CCheckpoint& aCp)
+{
+	aCp.State(iBranch);
+	aCp.State(iPos);
+	aCp.State(iHistory, 2 * iK * iM * sizeof(float));
+	aCp.State(iDcX);
+	aCp.State(iDcY);
+}
+
+// Filter and decimate aN input samples, writing at most MaxOutput(aN) samples
+// to aOut. Returns number of output samples.
+uint32_t CFrontEnd::Process(const float* aIn, uint32_t aN, float* aOut)
+{
+	uint32_t nOut = 0;
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		double x = aIn[i];
+		iDcY = x - iDcX + iDcR * iDcY;
+		iDcX = x;
+		float v = (float)iDcY;
+
+		// branch p takes samples x[jM-p]; branch 0 starts a new output index
+		uint32_t p = iBranch;
+		uint32_t slot = iPos + 1;
+		if (slot == iK)
+			slot = 0;
+		if (p == 0)
+			iPos = slot;
+		float* h = iHistory + 2 * iK * p;
+		h[slot] = v;
+		h[slot + iK] = v;
+		iBranch = (p == 0) ? iM - 1 : p - 1;
+		if (p != 0)
+			continue;
+
+		float acc = 0;
+		uint32_t b, k;
+		for (b=0; b<iM; ++b)
+		{
+			const float* t = iTaps + b * iK;
+			const float* w = iHistory + 2 * iK * b + iPos + 1;
+			for (k=0; k<iK; ++k)
+				acc += t[k] * w[k];
+		}
+		aOut[nOut++] = acc;
+	}
+	return nOut;
+}
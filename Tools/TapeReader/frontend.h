@@ -0,0 +1,64 @@
+/*
+* Header file for decimating band-pass front end
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+#define	FRONTEND_TARGET_RATE	(12000)		// default minimum internal sample rate
+#define	FRONTEND_LOW_CUT		(FREQ0 - 700.0)	// band-pass edges (-6dB)
+#define	FRONTEND_HIGH_CUT		(FREQ1 + 1300.0)
+#define	FRONTEND_TRANSITION		(800.0)		// width of each transition band in Hz
+#define	FRONTEND_DC_CORNER		(20.0)		// DC blocker corner frequency in Hz
+
+class CCheckpoint;
+
+/*
+* Front end which brings any input rate down to a small internal rate
+* before demodulation. Samples pass through a one pole DC blocker, then a
+* windowed-sinc band-pass FIR around FREQ0/FREQ1 which is also the
+* anti-alias filter for decimation by an integer factor M. The FIR is
+* implemented as a polyphase decimator: input samples are distributed
+* round M branches, each with N/M taps running at the output rate, so
+* only the retained outputs are computed.
+*/
+class CFrontEnd
+{
+public:
+	CFrontEnd(double aFs, double aTargetFs);
+	~CFrontEnd();
+	uint32_t Process(const float* aIn, uint32_t aN, float* aOut);
+	inline double OutputRate() const { return iOutFs; }
+	inline uint32_t Decimation() const { return iM; }
+	inline uint32_t MaxOutput(uint32_t aN) const { return aN / iM + 1; }
+	void Checkpoint(CCheckpoint& aCp);
+private:
+	double		iFs;				// input sample rate
+	double		iOutFs;				// output sample rate
+	uint32_t	iM;					// decimation factor
+	uint32_t	iK;					// taps per branch
+	uint32_t	iBranch;			// branch which receives next input sample
+	uint32_t	iPos;				// ring position of most recent output-rate index
+	float*		iTaps;				// M branches of K taps, oldest sample first
+	float*		iHistory;			// M branches of 2K samples (each written twice)
+	double		iDcR;				// DC blocker pole
+	double		iDcX;				// DC blocker previous input
+	double		iDcY;				// DC blocker previous output
+};
@@ -0,0 +1,222 @@
+/*
+* Carrier detection gate
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "demod.h"
+#include "gate.h"
+#include "checkpoint.h"
+
+#ifndef PI
+#define PI		(3.14159265358979323846)
+#endif
+
+class CGateBitSink : public CBitSink
+{
+public:
+	CGateBitSink() : iBit(NO_BIT) {}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence) { iBit = (int)aBit; }
+public:
+	int iBit;
+};
+
+// aPreRoll is in seconds
+CGatedDemodulator::CGatedDemodulator(double aFs, CDemodulator* aInner, double aPreRoll)
+:	CDemodulator(aFs),
+	iInner(aInner),
+	iWindow(0),
+	iCount(0),
+	iCoeff0(2 * cos(2 * PI * FREQ0 / aFs)),
+	iCoeff1(2 * cos(2 * PI * FREQ1 / aFs)),
+	iEnergy(0),
+	iOpen(false),
+	iQuiet(0),
+	iHang(0),
+	iPreRoll(0),
+	iRingSize(1),
+	iWritten(0),
+	iFed(0),
+	iHistory(0),
+	iFHistory(0),
+	iPre(0),
+	iFPre(0)
+{
+	iWindow = (uint32_t)ceil(aFs / FREQ0);
+	iHang = (uint32_t)(GATE_HANG * FREQ0);
+	iPreRoll = (uint32_t)(aPreRoll * aFs);
+	while (iRingSize < iPreRoll)
+		iRingSize <<= 1;
+	iHistory = new int32_t[iRingSize];
+	iFHistory = new float[iRingSize];
+	iPre = new int32_t[iRingSize];
+	iFPre = new float[iRingSize];
+	iS0[0] = iS0[1] = 0;
+	iS1[0] = iS1[1] = 0;
+}
+
+CGatedDemodulator::~CGatedDemodulator()
+{
+	delete[] iFPre;
+	delete[] iPre;
+	delete[] iFHistory;
+	delete[] iHistory;
+	delete iInner;
+}
+
+CBlockRecovery* CGatedDemodulator::Recovery()
+{
+	return iInner->Recovery();
+}
+
+// iPre and iFPre are only used within a call, so aren't saved
+void CGatedDemodulator::Checkpoint(CCheckpoint& aCp)
+{
+	CDemodulator::Checkpoint(aCp);
+	iInner->Checkpoint(aCp);
+	aCp.State(iCount);
+	aCp.State(iS0);
+	aCp.State(iS1);
+	aCp.State(iEnergy);
+	aCp.State(iOpen);
+	aCp.State(iQuiet);
+	aCp.State(iWritten);
+	aCp.State(iFed);
+	aCp.State(iHistory, iRingSize * sizeof(int32_t));
+	aCp.State(iFHistory, iRingSize * sizeof(float));
+}
+
+void CGatedDemodulator::Reset()
+{
+	CDemodulator::Reset();
+	iInner->Reset();
+	iCount = 0;
+	iS0[0] = iS0[1] = 0;
+	iS1[0] = iS1[1] = 0;
+	iEnergy = 0;
+	iOpen = false;
+	iQuiet = 0;
+	iWritten = 0;
+	iFed = 0;
+}
+
+// End of a measurement window: update the gate and reset the filters.
+// Returns true if the gate changed state.
+bool CGatedDemodulator::Measure()
+{
+	double p0 = iS0[0]*iS0[0] + iS0[1]*iS0[1] - iCoeff0*iS0[0]*iS0[1];
+	double p1 = iS1[0]*iS1[0] + iS1[1]*iS1[1] - iCoeff1*iS1[0]*iS1[1];
+	double full = iEnergy * iWindow / 2;	// tone power if all energy were at one tone
+	bool change = false;
+	if (!iOpen)
+	{
+		if (full > 0 && p1 >= GATE_OPEN_RATIO * full)
+		{
+			iOpen = true;
+			iQuiet = 0;
+			change = true;
+		}
+	}
+	else if (p0 + p1 < GATE_CLOSE_RATIO * full || full == 0)
+	{
+		if (++iQuiet >= iHang)
+		{
+			iOpen = false;
+			change = true;
+		}
+	}
+	else
+	{
+		iQuiet = 0;
+	}
+	iCount = 0;
+	iEnergy = 0;
+	iS0[0] = iS0[1] = 0;
+	iS1[0] = iS1[1] = 0;
+	return change;
+}
+
+template<class T> void CGatedDemodulator::Run(const T* aIn, uint32_t aN, CBitSink& aSink, T* aHistory, T* aPre)
+{
+	uint32_t start = 0;		// first sample of current open run
+	uint32_t i;
+	for (i=0; i<aN; ++i)
+	{
+		double x = (double)aIn[i];
+		double s0 = x + iCoeff0 * iS0[0] - iS0[1];
+		double s1 = x + iCoeff1 * iS1[0] - iS1[1];
+		iS0[1] = iS0[0];
+		iS0[0] = s0;
+		iS1[1] = iS1[0];
+		iS1[0] = s1;
+		iEnergy += x * x;
+		if (++iCount < iWindow || !Measure())
+			continue;
+		if (iOpen)
+		{
+			// replay the pre-roll ending with this sample, taking what
+			// precedes this call from the history ring
+			uint64_t pos = iWritten + i + 1;
+			uint32_t n = (pos - iFed < iPreRoll) ? (uint32_t)(pos - iFed) : iPreRoll;
+			uint32_t j;
+			for (j=0; j<n; ++j)
+			{
+				uint64_t k = pos - n + j;
+				aPre[j] = (k >= iWritten) ? aIn[k - iWritten] : aHistory[k & (iRingSize - 1)];
+			}
+			iInner->Process(aPre, n, aSink);
+			start = i + 1;
+		}
+		else
+		{
+			iInner->Process(aIn + start, i + 1 - start, aSink);
+			iFed = iWritten + i + 1;
+		}
+	}
+	if (iOpen && aN > start)
+	{
+		iInner->Process(aIn + start, aN - start, aSink);
+	}
+
+	// keep the most recent samples for pre-roll
+	uint32_t first = (aN > iRingSize) ? aN - iRingSize : 0;
+	for (i=first; i<aN; ++i)
+		aHistory[(iWritten + i) & (iRingSize - 1)] = aIn[i];
+	iWritten += aN;
+}
+
+int CGatedDemodulator::Sample(int aSample)
+{
+	int32_t x = aSample;
+	CGateBitSink sink;
+	Process(&x, 1, sink);
+	return sink.iBit;
+}
+
+void CGatedDemodulator::Process(const float* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Run(aIn, aN, aSink, iFHistory, iFPre);
+}
+
+void CGatedDemodulator::Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink)
+{
+	Run(aIn, aN, aSink, iHistory, iPre);
+}
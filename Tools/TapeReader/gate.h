@@ -0,0 +1,81 @@
+/*
+* Header file for carrier detection gate
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+#define	GATE_PRE_ROLL		(50)		// default milliseconds of input replayed when the gate opens
+#define	GATE_OPEN_RATIO		(0.5)		// fraction of window energy at FREQ1 needed to open
+#define	GATE_CLOSE_RATIO	(0.25)		// fraction at FREQ0 plus FREQ1 needed to stay open
+#define	GATE_HANG			(0.25)		// seconds below GATE_CLOSE_RATIO before closing
+
+/*
+* Carrier detection gate in front of another demodulator. Each window of
+* one bit period is measured with a pair of Goertzel filters at FREQ0 and
+* FREQ1 and a sum of squares, which costs a few operations per sample. The
+* gate opens when most of a window's energy is at the leader tone, and
+* closes once less than GATE_CLOSE_RATIO of it has been at either tone for
+* GATE_HANG seconds. Only samples while the gate is open reach the wrapped
+* demodulator, so silence, speech and gaps between files cost next to
+* nothing and produce no noise bits. When the gate opens, up to pre-roll
+* samples which weren't passed on before are replayed first, so that the
+* start of the leader isn't lost and the wrapped demodulator's history is
+* refilled. Ratios are independent of level, so no threshold depends on
+* recording gain.
+*/
+class CGatedDemodulator : public CDemodulator
+{
+public:
+	CGatedDemodulator(double aFs, CDemodulator* aInner, double aPreRoll);
+	virtual ~CGatedDemodulator();
+	virtual int Sample(int aSample);
+	virtual void Process(const float* aIn, uint32_t aN, CBitSink& aSink);
+	virtual void Process(const int32_t* aIn, uint32_t aN, CBitSink& aSink);
+	virtual CBlockRecovery* Recovery();
+	virtual void Tune(double aBias, double aPhase) { iInner->Tune(aBias, aPhase); }
+	virtual double Speed() const { return iInner->Speed(); }
+	virtual const SSignalQuality& TakeQuality() { return iInner->TakeQuality(); }
+	virtual void Checkpoint(CCheckpoint& aCp);
+	virtual void Reset();
+private:
+	template<class T> void Run(const T* aIn, uint32_t aN, CBitSink& aSink, T* aHistory, T* aPre);
+	bool Measure();
+private:
+	CDemodulator*	iInner;			// demodulator fed while the gate is open
+	uint32_t		iWindow;		// samples per measurement window
+	uint32_t		iCount;			// samples so far in current window
+	double			iCoeff0;		// Goertzel coefficients 2cos(w) for FREQ0 and FREQ1
+	double			iCoeff1;
+	double			iS0[2];			// Goertzel state for FREQ0, last two outputs
+	double			iS1[2];			// Goertzel state for FREQ1
+	double			iEnergy;		// sum of squares over current window
+	bool			iOpen;			// gate currently open
+	uint32_t		iQuiet;			// consecutive windows below close ratio
+	uint32_t		iHang;			// windows below close ratio before closing
+	uint32_t		iPreRoll;		// samples replayed on opening
+	uint32_t		iRingSize;		// history size, a power of 2 at least iPreRoll
+	uint64_t		iWritten;		// total samples seen
+	uint64_t		iFed;			// samples before this have been passed on, or skipped for good
+	int32_t*		iHistory;		// last iRingSize samples, for integer input
+	float*			iFHistory;		// last iRingSize samples, for float input
+	int32_t*		iPre;			// pre-roll assembled from history, integer input
+	float*			iFPre;			// pre-roll assembled from history, float input
+};
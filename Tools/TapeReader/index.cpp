@@ -0,0 +1,290 @@
+/*
+* Index of where each block lies in a capture
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "wav.h"
+#include "decoder.h"
+#include "index.h"
+#include "checkpoint.h"
+
+static void PutUInt16LE(uint8_t* aPtr, uint32_t aValue)
+{
+	aPtr[0] = (uint8_t)aValue;
+	aPtr[1] = (uint8_t)(aValue >> 8);
+}
+
+static void PutUInt32LE(uint8_t* aPtr, uint32_t aValue)
+{
+	PutUInt16LE(aPtr, aValue);
+	PutUInt16LE(aPtr + 2, aValue >> 16);
+}
+
+static void PutUInt64LE(uint8_t* aPtr, uint64_t aValue)
+{
+	PutUInt32LE(aPtr, (uint32_t)aValue);
+	PutUInt32LE(aPtr + 4, (uint32_t)(aValue >> 32));
+}
+
+static bool less_bits(const SIndexClock& aA, const SIndexClock& aB)
+{
+	return aA.iBits < aB.iBits;
+}
+
+// Name of the index kept alongside capture aCapture
+void CTapeIndex::FileName(char* aPath, uint32_t aSize, const char* aCapture)
+{
+	snprintf(aPath, aSize, "%s%s", aCapture, INDEX_SUFFIX);
+}
+
+CTapeIndex::CTapeIndex()
+{
+}
+
+/*
+* Index file layout, all little endian:
+*	0	magic, version						2 x 32 bits
+*	8	capture length in frames			64 bits
+*	16	capture data size in bytes			64 bits
+*	24	sample rate, number of entries		2 x 32 bits
+* then for each entry:
+*	0	header, data and end frames			3 x 64 bits
+*	24	errors								32 bits
+*	28	name, zero padded					12 bytes
+*	40	load, exec and next file addresses	3 x 32 bits
+*	52	block number, block length			2 x 16 bits
+*	56	block flag, 3 bytes zero			8 bits
+*	60	speed in millionths of nominal		32 bits
+*/
+bool CTapeIndex::Write(const char* aPath, const CWavFile* aSrc) const
+{
+	FILE* f = fopen(aPath, "wb");
+	if (!f)
+		return false;
+	uint8_t buf[INDEX_ENTRY_SIZE];
+	PutUInt32LE(buf, INDEX_MAGIC);
+	PutUInt32LE(buf + 4, INDEX_VERSION);
+	PutUInt64LE(buf + 8, aSrc->Length());
+	PutUInt64LE(buf + 16, aSrc->DataSize());
+	PutUInt32LE(buf + 24, aSrc->SampleRate());
+	PutUInt32LE(buf + 28, Count());
+	bool ok = fwrite(buf, 1, INDEX_HEADER_SIZE, f) == INDEX_HEADER_SIZE;
+	uint32_t i;
+	for (i=0; ok && i<Count(); ++i)
+	{
+		const SIndexEntry& e = iEntries[i];
+		memset(buf, 0, sizeof(buf));
+		PutUInt64LE(buf, e.iHeader);
+		PutUInt64LE(buf + 8, e.iData);
+		PutUInt64LE(buf + 16, e.iEnd);
+		PutUInt32LE(buf + 24, e.iErr);
+		memcpy(buf + 28, e.iHdr.iName, MAX_NAME_LENGTH);
+		PutUInt32LE(buf + 40, e.iHdr.iLoadAddr);
+		PutUInt32LE(buf + 44, e.iHdr.iExecAddr);
+		PutUInt32LE(buf + 48, e.iHdr.iNextFile);
+		PutUInt16LE(buf + 52, e.iHdr.iBlockNum);
+		PutUInt16LE(buf + 54, e.iHdr.iBlockLen);
+		buf[56] = e.iHdr.iBlockFlag;
+		PutUInt32LE(buf + 60, (uint32_t)(e.iHdr.iSpeed * 1e6 + 0.5));
+		ok = fwrite(buf, 1, INDEX_ENTRY_SIZE, f) == INDEX_ENTRY_SIZE;
+	}
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		remove(aPath);
+	return ok;
+}
+
+// Load the index at aPath, if there is one and it was made from aSrc
+bool CTapeIndex::Read(const char* aPath, const CWavFile* aSrc)
+{
+	FILE* f = fopen(aPath, "rb");
+	if (!f)
+		return false;
+	uint8_t buf[INDEX_ENTRY_SIZE];
+	bool ok = fread(buf, 1, INDEX_HEADER_SIZE, f) == INDEX_HEADER_SIZE
+		&& GetUInt32LE(buf) == INDEX_MAGIC
+		&& GetUInt32LE(buf + 4) == INDEX_VERSION
+		&& GetUInt64LE(buf + 8) == aSrc->Length()
+		&& GetUInt64LE(buf + 16) == aSrc->DataSize()
+		&& GetUInt32LE(buf + 24) == aSrc->SampleRate();
+	uint32_t n = ok ? GetUInt32LE(buf + 28) : 0;
+	iEntries.clear();
+	while (ok && iEntries.size() < n)
+	{
+		ok = fread(buf, 1, INDEX_ENTRY_SIZE, f) == INDEX_ENTRY_SIZE;
+		SIndexEntry e;
+		e.iHeader = GetUInt64LE(buf);
+		e.iData = GetUInt64LE(buf + 8);
+		e.iEnd = GetUInt64LE(buf + 16);
+		e.iErr = GetUInt32LE(buf + 24);
+		memcpy(e.iHdr.iName, buf + 28, MAX_NAME_LENGTH);
+		e.iHdr.iName[MAX_NAME_LENGTH] = 0;
+		e.iHdr.iLoadAddr = GetUInt32LE(buf + 40);
+		e.iHdr.iExecAddr = GetUInt32LE(buf + 44);
+		e.iHdr.iNextFile = GetUInt32LE(buf + 48);
+		e.iHdr.iBlockNum = GetUInt16LE(buf + 52);
+		e.iHdr.iBlockLen = GetUInt16LE(buf + 54);
+		e.iHdr.iBlockFlag = buf[56];
+		e.iHdr.iSpeed = GetUInt32LE(buf + 60) / 1e6;
+		memset(&e.iHdr.iQuality, 0, sizeof(e.iHdr.iQuality));
+		iEntries.push_back(e);
+	}
+	fclose(f);
+	if (!ok)
+		iEntries.clear();
+	return ok;
+}
+
+// Index of the last entry of the file whose first entry found is aFirst.
+// The file runs until its final block, a good block of another file, or
+// another copy of its first block.
+uint32_t CTapeIndex::FileEnd(uint32_t aFirst) const
+{
+	uint32_t i = aFirst;
+	while (!(iEntries[i].iHdr.iBlockFlag & BLOCK_FLAG_FINAL) && i + 1 < Count())
+	{
+		const SIndexEntry& next = iEntries[i + 1];
+		if (next.iErr == 0 && (next.iHdr.iBlockNum == 0 || strcmp(next.iHdr.iName, iEntries[aFirst].iHdr.iName) != 0))
+			break;
+		++i;
+	}
+	return i;
+}
+
+CIndexDecoder::CIndexDecoder(CDecoder* aOutput, CTapeIndex* aIndex)
+:	iOutput(aOutput),
+	iIndex(aIndex),
+	iErr(0)
+{
+}
+
+void CIndexDecoder::Block(const SBlockHeader* aHdr, const uint8_t* aData)
+{
+	Add(0, aHdr, BitCount());
+	if (iOutput)
+		iOutput->Block(aHdr, aData);
+}
+
+void CIndexDecoder::File(const SBlockHeader* aHdr)
+{
+	if (iOutput)
+		iOutput->File(aHdr);
+}
+
+void CIndexDecoder::Eof()
+{
+	if (iOutput)
+		iOutput->Eof();
+}
+
+void CIndexDecoder::BadBlock(const SBlockHeader* aHdr, const uint8_t* aData, const uint8_t* aConf)
+{
+	Add(iErr, aHdr, BitCount());
+	iErr = 0;
+	if (iOutput)
+		iOutput->BadBlock(aHdr, aData, aConf);
+}
+
+// Failed data is indexed when BadBlock() follows; anything else ends the
+// attempt at the block here
+void CIndexDecoder::Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr)
+{
+	if (aErr & (EInvalidDataCrc | ETruncatedBlock))
+		iErr = aErr;
+	else
+		Add(aErr, aHdr, BitCount());
+	if (iOutput)
+		iOutput->Error(aBlockNum, aErr, aHdr);
+}
+
+// the output decoder is saved separately
+void CIndexDecoder::Checkpoint(CCheckpoint& aCp)
+{
+	CDecoder::Checkpoint(aCp);
+	aCp.State(iErr);
+	aCp.State(iPending);
+	aCp.State(iClock);
+}
+
+// aFrame frames have been read, and all the bits demodulated from them
+// have been decoded
+void CIndexDecoder::Clock(uint64_t aFrame)
+{
+	SIndexClock c;
+	c.iBits = BitCount();
+	c.iFrame = aFrame;
+	if (iClock.empty() || c.iBits > iClock.back().iBits)
+		iClock.push_back(c);
+	else
+		iClock.back().iFrame = aFrame;
+}
+
+// Convert the pending entries to frame positions and add them to the index
+void CIndexDecoder::Finish()
+{
+	uint32_t i;
+	for (i=0; i<iPending.size(); ++i)
+	{
+		SIndexEntry e = iPending[i];
+		e.iHeader = Frame((uint32_t)e.iHeader);
+		e.iData = Frame((uint32_t)e.iData);
+		e.iEnd = Frame((uint32_t)e.iEnd);
+		iIndex->Add(e);
+	}
+	iPending.clear();
+}
+
+void CIndexDecoder::Add(uint32_t aErr, const SBlockHeader* aHdr, uint32_t aEnd)
+{
+	SIndexEntry e;
+	e.iHeader = LeaderBit();
+	e.iData = aHdr ? DataBit() : aEnd;
+	e.iEnd = aEnd;
+	e.iErr = aErr;
+	if (aHdr)
+		e.iHdr = *aHdr;
+	else
+		memset(&e.iHdr, 0, sizeof(e.iHdr));
+	iPending.push_back(e);
+}
+
+// frame from which bit aBit was demodulated, by interpolating between clock
+// readings
+uint64_t CIndexDecoder::Frame(uint32_t aBit) const
+{
+	SIndexClock c;
+	c.iBits = aBit;
+	c.iFrame = 0;
+	std::vector<SIndexClock>::const_iterator it = std::lower_bound(iClock.begin(), iClock.end(), c, less_bits);
+	if (it == iClock.end())
+		return iClock.empty() ? 0 : iClock.back().iFrame;
+	uint32_t bits0 = 0;
+	uint64_t frame0 = 0;
+	if (it != iClock.begin())
+	{
+		bits0 = (it - 1)->iBits;
+		frame0 = (it - 1)->iFrame;
+	}
+	return frame0 + (uint64_t)((double)(aBit - bits0) * (double)(it->iFrame - frame0) / (double)(it->iBits - bits0));
+}
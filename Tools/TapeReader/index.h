@@ -0,0 +1,104 @@
+/*
+* Header file for the index of where each block lies in a capture
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <vector>
+
+#define	INDEX_SUFFIX		".idx"		// appended to the capture's file name to name its index
+#define	INDEX_MAGIC			(0x58444954U)	// "TIDX" little endian
+#define	INDEX_VERSION		(1)
+#define	INDEX_HEADER_SIZE	(32)		// bytes of index file before the first entry
+#define	INDEX_ENTRY_SIZE	(64)		// bytes per entry in the index file
+#define	INDEX_PRE_ROLL		(0.5)		// seconds decoded before a block's header when extracting
+#define	INDEX_POST_ROLL		(0.1)		// seconds decoded after the end of a block's data
+
+class CWavFile;
+
+// where one block, or one failed attempt at a block, lies in the capture
+struct SIndexEntry
+{
+	uint64_t		iHeader;		// frame at which the leader ended and the header began
+	uint64_t		iData;			// frame at which the header ended and the data began
+	uint64_t		iEnd;			// frame at which the data ended
+	uint32_t		iErr;			// 0 if the block was decoded, otherwise CDecoder::TError bits
+	SBlockHeader	iHdr;			// as read, all zero if the header was cut short
+};
+
+// number of bits decoded once a number of frames had been read
+struct SIndexClock
+{
+	uint32_t		iBits;
+	uint64_t		iFrame;
+};
+
+/*
+* Index of the blocks found in a capture, kept in a sidecar file next to it
+* so that one file or block can later be decoded from just its own stretch
+* of the capture. The index records the size, length and sample rate of the
+* capture it was made from, and Read() rejects it if they don't match.
+*/
+class CTapeIndex
+{
+public:
+	static void FileName(char* aPath, uint32_t aSize, const char* aCapture);
+public:
+	CTapeIndex();
+	bool Read(const char* aPath, const CWavFile* aSrc);
+	bool Write(const char* aPath, const CWavFile* aSrc) const;
+	void Add(const SIndexEntry& aEntry) { iEntries.push_back(aEntry); }
+	uint32_t Count() const { return (uint32_t)iEntries.size(); }
+	const SIndexEntry& Entry(uint32_t aIndex) const { return iEntries[aIndex]; }
+	uint32_t FileEnd(uint32_t aFirst) const;
+private:
+	std::vector<SIndexEntry>	iEntries;	// in order through the capture
+};
+
+/*
+* Decoder which passes everything on to aOutput, if given, and adds each
+* block it reports to an index. The decoder only counts bits, so whoever
+* feeds it calls Clock() after each read with the number of frames read so
+* far; Finish() then places each block by interpolating between the two
+* clock readings either side of it, which is accurate to well within the
+* pre-roll used when extracting.
+*/
+class CIndexDecoder : public CDecoder
+{
+public:
+	CIndexDecoder(CDecoder* aOutput, CTapeIndex* aIndex);
+	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData);
+	virtual void File(const SBlockHeader* aHdr);
+	virtual void Eof();
+	virtual void BadBlock(const SBlockHeader* aHdr, const uint8_t* aData, const uint8_t* aConf);
+	virtual void Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr);
+	virtual void Checkpoint(CCheckpoint& aCp);
+	void Clock(uint64_t aFrame);
+	void Finish();
+private:
+	void Add(uint32_t aErr, const SBlockHeader* aHdr, uint32_t aEnd);
+	uint64_t Frame(uint32_t aBit) const;
+private:
+	CDecoder*		iOutput;		// may be 0
+	CTapeIndex*		iIndex;
+	uint32_t		iErr;			// errors reported for the block whose data is ending
+	std::vector<SIndexEntry>	iPending;	// entries positioned in bits, until Finish()
+	std::vector<SIndexClock>	iClock;		// readings so far
+};
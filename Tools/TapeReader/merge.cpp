@@ -0,0 +1,403 @@
+/*
+* Merging of several captures of the same tape
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include "wav.h"
+#include "demod.h"
+#include "decoder.h"
+#include "frontend.h"
+#include "merge.h"
+
+#define	MERGE_FRAMES_PER_READ	(4096)	// frames each capture reads at a time
+
+// Decoder for one capture; keeps every block it finds, good or bad
+class CCaptureDecoder : public CDecoder
+{
+public:
+	CCaptureDecoder(uint32_t aInput) : iInput(aInput), iGood(0) {}
+	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData);
+	virtual void BadBlock(const SBlockHeader* aHdr, const uint8_t* aData, const uint8_t* aConf);
+	virtual void File(const SBlockHeader* aHdr) {}
+	virtual void Eof() {}
+public:
+	uint32_t		iInput;
+	uint32_t		iGood;			// number of copies which passed their CRC check
+	std::vector<SMergeCopy>	iCopies;	// in the order found
+};
+
+void CCaptureDecoder::Block(const SBlockHeader* aHdr, const uint8_t* aData)
+{
+	iCopies.emplace_back();
+	SMergeCopy& c = iCopies.back();
+	c.iHdr = *aHdr;
+	c.iInput = iInput;
+	c.iValid = true;
+	memcpy(c.iData, aData, aHdr->iBlockLen);
+	++iGood;
+}
+
+void CCaptureDecoder::BadBlock(const SBlockHeader* aHdr, const uint8_t* aData, const uint8_t* aConf)
+{
+	iCopies.emplace_back();
+	SMergeCopy& c = iCopies.back();
+	c.iHdr = *aHdr;
+	c.iInput = iInput;
+	c.iValid = false;
+	memcpy(c.iData, aData, aHdr->iBlockLen + 2);
+	memcpy(c.iConf, aConf, (aHdr->iBlockLen + 2) * 8);
+}
+
+class CMergeSink : public CBitSink
+{
+public:
+	CMergeSink(CDecoder* aDecoder) : iDecoder(aDecoder) {}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence) { iDecoder->Bit(aBit, aConfidence); }
+private:
+	CDecoder* iDecoder;
+};
+
+CCaptureMerger::CCaptureMerger(CSampleSource** aSrcs, CFrontEnd** aFrontEnds, CDemodulator** aDemods, const char* const* aNames, uint32_t aCount, CDecoder* aOutput)
+:	iCount(aCount),
+	iSrcs(aSrcs),
+	iFrontEnds(aFrontEnds),
+	iDemods(aDemods),
+	iNames(aNames),
+	iDecoders(0),
+	iOutput(aOutput),
+	iFileOpen(false),
+	iNextBlock(0),
+	iUsed(0)
+{
+	uint32_t i;
+	iDecoders = new CCaptureDecoder*[aCount];
+	iUsed = new uint32_t[aCount];
+	for (i=0; i<aCount; ++i)
+	{
+		iDecoders[i] = new CCaptureDecoder(i);
+		iDecoders[i]->SetRecovery(aDemods[i]->Recovery());
+		iUsed[i] = 0;
+	}
+}
+
+CCaptureMerger::~CCaptureMerger()
+{
+	uint32_t i;
+	for (i=0; i<iCount; ++i)
+	{
+		delete iDecoders[i];
+		delete iDemods[i];
+		delete iFrontEnds[i];
+		delete iSrcs[i];
+	}
+	delete[] iUsed;
+	delete[] iDecoders;
+	delete[] iDemods;
+	delete[] iFrontEnds;
+	delete[] iSrcs;
+}
+
+// decode one capture from start to end
+void CCaptureMerger::Worker(uint32_t aIndex)
+{
+	CSampleSource* pSrc = iSrcs[aIndex];
+	CFrontEnd* pFrontEnd = iFrontEnds[aIndex];
+	CDemodulator* pDemod = iDemods[aIndex];
+	CCaptureDecoder* pDecoder = iDecoders[aIndex];
+	CMergeSink sink(pDecoder);
+	int32_t* sampleBuf = new int32_t[MERGE_FRAMES_PER_READ];
+	float* floatBuf = pFrontEnd ? new float[MERGE_FRAMES_PER_READ] : 0;
+	float* filtBuf = pFrontEnd ? new float[pFrontEnd->MaxOutput(MERGE_FRAMES_PER_READ)] : 0;
+	for (;;)
+	{
+		const uint8_t* frames;
+		uint32_t nFrames = pSrc->ReadFrames(frames, MERGE_FRAMES_PER_READ);
+		if (nFrames == 0)
+			break;
+		pSrc->GetSamples(sampleBuf, frames, nFrames, 0);
+		if (pFrontEnd)
+		{
+			uint32_t i;
+			for (i=0; i<nFrames; ++i)
+				floatBuf[i] = (float)sampleBuf[i];
+			uint32_t nOut = pFrontEnd->Process(floatBuf, nFrames, filtBuf);
+			pDemod->Process(filtBuf, nOut, sink);
+		}
+		else
+		{
+			pDemod->Process(sampleBuf, nFrames, sink);
+		}
+		pDecoder->Speed(pDemod->Speed());
+		pDecoder->Quality(pDemod->TakeQuality());
+	}
+	delete[] filtBuf;
+	delete[] floatBuf;
+	delete[] sampleBuf;
+}
+
+void CCaptureMerger::Run()
+{
+	uint32_t i;
+	std::thread** threads = new std::thread*[iCount];
+	for (i=0; i<iCount; ++i)
+		threads[i] = new std::thread(&CCaptureMerger::Worker, this, i);
+	for (i=0; i<iCount; ++i)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	delete[] threads;
+
+	Align();
+	uint8_t voted[MAX_BLOCK_LENGTH+2];
+	for (i=0; i<iBlocks.size(); ++i)
+	{
+		SMergeBlock& b = iBlocks[i];
+		const SMergeCopy* good = 0;
+		uint32_t j;
+		for (j=0; j<b.iCopies.size() && !good; ++j)
+		{
+			if (b.iCopies[j]->iValid)
+				good = b.iCopies[j];
+		}
+		if (good)
+		{
+			b.iHdr = good->iHdr;
+			b.iSource = good->iInput;
+			b.iVoters = 0;
+			b.iValid = true;
+			b.iWritten = Emit(b, good->iData);
+			if (b.iWritten)
+				++iUsed[good->iInput];
+		}
+		else
+		{
+			Vote(b, voted);
+			b.iWritten = Emit(b, voted);
+		}
+	}
+	if (iFileOpen)
+	{
+		// last file has been truncated
+		iOutput->Eof();
+		iFileOpen = false;
+	}
+	Report();
+}
+
+// blocks belong to the same file
+static bool SameFile(const SBlockHeader& aA, const SBlockHeader& aB)
+{
+	return aA.iLoadAddr == aB.iLoadAddr && strcmp(aA.iName, aB.iName) == 0;
+}
+
+// Gather the copies from every capture into iBlocks. Captures are taken in
+// order, so the copies of each block are too. The blocks of a file are
+// kept together in block number order; a file not seen before goes after
+// the file which preceded it in the capture which found it.
+void CCaptureMerger::Align()
+{
+	uint32_t i;
+	uint32_t j;
+	for (i=0; i<iCount; ++i)
+	{
+		const std::vector<SMergeCopy>& copies = iDecoders[i]->iCopies;
+		uint32_t next = 0;			// where a file not seen before goes
+		for (j=0; j<copies.size(); ++j)
+		{
+			const SMergeCopy& c = copies[j];
+			uint32_t k = Find(c.iHdr);
+			if (k == iBlocks.size())
+			{
+				SMergeBlock b;
+				b.iHdr = c.iHdr;
+				b.iSource = -1;
+				b.iVoters = 0;
+				b.iValid = false;
+				b.iWritten = false;
+				k = Place(c.iHdr, next);
+				iBlocks.insert(iBlocks.begin() + k, b);
+			}
+			iBlocks[k].iCopies.push_back(&c);
+			next = k + 1;
+		}
+	}
+}
+
+// index of the block in iBlocks which aHdr is a copy of, or iBlocks.size()
+uint32_t CCaptureMerger::Find(const SBlockHeader& aHdr) const
+{
+	uint32_t i;
+	for (i=0; i<iBlocks.size(); ++i)
+	{
+		if (iBlocks[i].iHdr.iBlockNum == aHdr.iBlockNum && SameFile(iBlocks[i].iHdr, aHdr))
+			break;
+	}
+	return i;
+}
+
+// where in iBlocks a new block belongs, aNext being just after the block
+// which preceded it in its capture
+uint32_t CCaptureMerger::Place(const SBlockHeader& aHdr, uint32_t aNext) const
+{
+	uint32_t i;
+	for (i=0; i<iBlocks.size() && !SameFile(iBlocks[i].iHdr, aHdr); ++i)
+	{
+	}
+	if (i < iBlocks.size())
+	{
+		// file already seen
+		while (i < iBlocks.size() && SameFile(iBlocks[i].iHdr, aHdr) && iBlocks[i].iHdr.iBlockNum < aHdr.iBlockNum)
+			++i;
+		return i;
+	}
+	// new file, so don't split the file before it
+	for (i=aNext; i>0 && i<iBlocks.size() && SameFile(iBlocks[i].iHdr, iBlocks[i-1].iHdr); ++i)
+	{
+	}
+	return i;
+}
+
+// Build the data for a block no capture read correctly. Each byte, CRC
+// included, is the value with the greatest total confidence among the
+// copies whose length matches the first.
+void CCaptureMerger::Vote(SMergeBlock& aBlock, uint8_t* aData) const
+{
+	uint32_t len = aBlock.iHdr.iBlockLen + 2;
+	uint32_t i;
+	uint32_t j;
+	uint32_t k;
+	aBlock.iVoters = 0;
+	for (j=0; j<aBlock.iCopies.size(); ++j)
+	{
+		if (aBlock.iCopies[j]->iHdr.iBlockLen + 2u == len)
+			++aBlock.iVoters;
+	}
+	for (i=0; i<len; ++i)
+	{
+		uint8_t value[MERGE_MAX_INPUTS];
+		uint32_t weight[MERGE_MAX_INPUTS];
+		uint32_t n = 0;
+		for (j=0; j<aBlock.iCopies.size(); ++j)
+		{
+			const SMergeCopy& c = *aBlock.iCopies[j];
+			if (c.iHdr.iBlockLen + 2u != len)
+				continue;
+			uint32_t w = 0;
+			for (k=0; k<8; ++k)
+				w += c.iConf[i*8 + k];
+			for (k=0; k<n && value[k] != c.iData[i]; ++k)
+			{
+			}
+			if (k == n)
+			{
+				if (n == MERGE_MAX_INPUTS)
+					continue;
+				value[n] = c.iData[i];
+				weight[n++] = 0;
+			}
+			weight[k] += w;
+		}
+		uint32_t best = 0;
+		for (k=1; k<n; ++k)
+		{
+			if (weight[k] > weight[best])
+				best = k;
+		}
+		aData[i] = value[best];
+	}
+	aBlock.iSource = -1;
+	aBlock.iValid = CDecoder::CrcValid(aData, len);
+}
+
+// Hand a block to the output decoder, opening and closing files as
+// CDecoder would for a single stream, except that voted data is written
+// even if its CRC fails, to keep the rest of the file in place. Returns
+// false if it doesn't belong in the current file.
+bool CCaptureMerger::Emit(const SMergeBlock& aBlock, const uint8_t* aData)
+{
+	const SBlockHeader& hdr = aBlock.iHdr;
+	if (iFileOpen && hdr.iBlockNum != 0)
+	{
+		if (strcmp(hdr.iName, iFileHdr.iName) != 0)
+			return false;
+		if (hdr.iBlockNum != iNextBlock)
+		{
+			iOutput->Error(iNextBlock, CDecoder::ESkippedBlock, 0);
+			return false;
+		}
+	}
+	if (iFileOpen && hdr.iBlockNum == 0)
+	{
+		// old file has been truncated
+		iOutput->Eof();
+		iFileOpen = false;
+	}
+	if (!iFileOpen)
+	{
+		if (hdr.iBlockNum != 0)
+			return false;
+		iFileHdr = hdr;
+		iOutput->File(&iFileHdr);
+		iFileOpen = true;
+		iNextBlock = 0;
+	}
+	iOutput->Block(&hdr, aData);
+	++iNextBlock;
+	if (hdr.iBlockFlag & BLOCK_FLAG_FINAL)
+	{
+		iOutput->Eof();
+		iFileOpen = false;
+	}
+	return true;
+}
+
+// where each block came from, and which blocks no capture found
+void CCaptureMerger::Report() const
+{
+	uint32_t i;
+	printf("Block sources:\n");
+	const SBlockHeader* prev = 0;
+	for (i=0; i<=iBlocks.size(); ++i)
+	{
+		bool same = (prev && i < iBlocks.size() && SameFile(*prev, iBlocks[i].iHdr));
+		if (prev && !same && !(prev->iBlockFlag & BLOCK_FLAG_FINAL))
+			printf("%-10s %02x onwards missing\n", prev->iName, prev->iBlockNum + 1);
+		if (i == iBlocks.size())
+			break;
+		const SMergeBlock& b = iBlocks[i];
+		uint32_t n = same ? prev->iBlockNum + 1 : 0;
+		for (; n<b.iHdr.iBlockNum; ++n)
+			printf("%-10s %02x missing\n", b.iHdr.iName, n);
+		if (b.iSource >= 0)
+			printf("%-10s %02x capture %d (%s)", b.iHdr.iName, b.iHdr.iBlockNum, b.iSource, iNames[b.iSource]);
+		else
+			printf("%-10s %02x vote of %u, CRC %s", b.iHdr.iName, b.iHdr.iBlockNum, b.iVoters, b.iValid ? "ok" : "failed");
+		printf("%s\n", b.iWritten ? "" : ", not written");
+		prev = &b.iHdr;
+	}
+	for (i=0; i<iCount; ++i)
+	{
+		printf("Capture %u (%s): %u blocks, %u good, %u used\n", i, iNames[i], (uint32_t)iDecoders[i]->iCopies.size(), iDecoders[i]->iGood, iUsed[i]);
+	}
+}
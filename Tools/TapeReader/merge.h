@@ -0,0 +1,92 @@
+/*
+* Header file for merging several captures of the same tape
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <vector>
+
+#define	MERGE_MAX_INPUTS	(16)		// most captures merged in one run
+
+class CSampleSource;
+class CFrontEnd;
+class CDemodulator;
+class CDecoder;
+class CCaptureDecoder;
+
+// copy of a block from one capture
+struct SMergeCopy
+{
+	SBlockHeader	iHdr;
+	uint32_t		iInput;			// which capture it came from
+	bool			iValid;			// data passed its CRC check
+	uint8_t			iData[MAX_BLOCK_LENGTH+2];			// data including CRC
+	uint8_t			iConf[(MAX_BLOCK_LENGTH+2)*8];	// confidence of each bit of iData
+};
+
+// all copies of one block
+struct SMergeBlock
+{
+	SBlockHeader	iHdr;			// header of the first copy found
+	std::vector<const SMergeCopy*>	iCopies;	// in order of capture
+	int32_t			iSource;		// capture whose copy was written, -1 if voted
+	uint32_t		iVoters;		// copies taking part in the vote
+	bool			iValid;			// data written passed its CRC check
+	bool			iWritten;		// block belonged in an output file
+};
+
+/*
+* Decodes several captures of the same tape, each on its own thread with
+* its own source, front end and demodulator, then writes one set of files
+* through the output decoder. Blocks are matched by name, load address and
+* block number. The first capture with a CRC-valid copy of a block
+* supplies it; if no copy is valid, each byte is taken by a vote among the
+* copies of the same length, every copy's byte weighted by the confidence
+* of its bits. Files appear in the order they were found, and a report of
+* where each block came from follows.
+*/
+class CCaptureMerger
+{
+public:
+	CCaptureMerger(CSampleSource** aSrcs, CFrontEnd** aFrontEnds, CDemodulator** aDemods, const char* const* aNames, uint32_t aCount, CDecoder* aOutput);
+	~CCaptureMerger();
+	void Run();
+private:
+	void Worker(uint32_t aIndex);
+	void Align();
+	uint32_t Find(const SBlockHeader& aHdr) const;
+	uint32_t Place(const SBlockHeader& aHdr, uint32_t aNext) const;
+	void Vote(SMergeBlock& aBlock, uint8_t* aData) const;
+	bool Emit(const SMergeBlock& aBlock, const uint8_t* aData);
+	void Report() const;
+private:
+	uint32_t		iCount;			// number of captures
+	CSampleSource**	iSrcs;			// one per capture, owned
+	CFrontEnd**		iFrontEnds;		// one per capture, entries may be 0, owned
+	CDemodulator**	iDemods;		// one per capture, owned
+	const char* const*	iNames;		// file name of each capture, for the report
+	CCaptureDecoder**	iDecoders;	// one per capture
+	CDecoder*		iOutput;		// receives the merged blocks
+	std::vector<SMergeBlock>	iBlocks;	// merged blocks in output order
+	bool			iFileOpen;		// output decoder has a file open
+	uint32_t		iNextBlock;		// block number expected next in open file
+	SBlockHeader	iFileHdr;		// header of first block of open file
+	uint32_t*		iUsed;			// valid blocks taken from each capture
+};
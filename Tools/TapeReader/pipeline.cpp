@@ -0,0 +1,222 @@
+/*
+* Multi-threaded decode pipeline
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "wav.h"
+#include "demod.h"
+#include "decoder.h"
+#include "frontend.h"
+#include "pipeline.h"
+#include "stats.h"
+
+CPipeline::CPipeline(CSampleSource* aSrc, CFrontEnd* aFrontEnd, CDemodulator* aDemod, CDecoder* aDecoder, uint32_t aBlockFrames, uint32_t aQueueDepth)
+:	iSrc(aSrc),
+	iFrontEnd(aFrontEnd),
+	iDemod(aDemod),
+	iDecoder(aDecoder),
+	iBlockFrames(aBlockFrames),
+	iStats(0),
+	iSampleQ(aQueueDepth),
+	iBitQ(aQueueDepth)
+{
+	uint32_t i;
+	for (i=0; i<iSampleQ.Slots(); ++i)
+	{
+		iSampleQ.Slot(i).iData = iFrontEnd ? 0 : new int32_t[iBlockFrames];
+		iSampleQ.Slot(i).iFData = iFrontEnd ? new float[iBlockFrames] : 0;
+		iSampleQ.Slot(i).iCount = 0;
+		iSampleQ.Slot(i).iLast = false;
+	}
+	// each sample normally produces at most one bit; CBitBlockSink starts
+	// another slot if an engine gives more
+	for (i=0; i<iBitQ.Slots(); ++i)
+	{
+		iBitQ.Slot(i).iData = new uint8_t[iBlockFrames / 8 + 1];
+		iBitQ.Slot(i).iConf = new uint8_t[iBlockFrames];
+		iBitQ.Slot(i).iCount = 0;
+		iBitQ.Slot(i).iLast = false;
+	}
+}
+
+CPipeline::~CPipeline()
+{
+	uint32_t i;
+	for (i=0; i<iBitQ.Slots(); ++i)
+	{
+		delete[] iBitQ.Slot(i).iConf;
+		delete[] iBitQ.Slot(i).iData;
+	}
+	for (i=0; i<iSampleQ.Slots(); ++i)
+	{
+		delete[] iSampleQ.Slot(i).iFData;
+		delete[] iSampleQ.Slot(i).iData;
+	}
+}
+
+void CPipeline::Run()
+{
+	std::thread reader(&CPipeline::ReadStage, this);
+	std::thread demod(&CPipeline::DemodStage, this);
+	FrameStage();
+	demod.join();
+	reader.join();
+}
+
+void CPipeline::ReadStage()
+{
+	int32_t* sampleBuf = iFrontEnd ? new int32_t[iBlockFrames] : 0;
+	float* floatBuf = iFrontEnd ? new float[iBlockFrames] : 0;
+	CStageTimer timer(iStats, "reader");
+	bool last = false;
+	while (!last)
+	{
+		SSampleBlock* b = iSampleQ.BeginWrite();
+		b->iCount = 0;
+		while (b->iCount < iBlockFrames)
+		{
+			const uint8_t* frames;
+			uint32_t space = iBlockFrames - b->iCount;
+			if (iFrontEnd)
+			{
+				// front end output for n input frames never exceeds n/M + 1,
+				// and a single input frame gives at most one output
+				space = (space - 1) * iFrontEnd->Decimation();
+				if (space == 0)
+					space = 1;
+				if (space > iBlockFrames)
+					space = iBlockFrames;
+			}
+			timer.Start();
+			uint32_t n = iSrc->ReadFrames(frames, space);
+			timer.Lap(EStageRead, n);
+			if (n == 0)
+			{
+				last = true;
+				break;
+			}
+			if (iFrontEnd)
+			{
+				iSrc->GetSamples(sampleBuf, frames, n, 0);
+				uint32_t i;
+				for (i=0; i<n; ++i)
+					floatBuf[i] = (float)sampleBuf[i];
+				timer.Lap(EStageConvert, n);
+				uint32_t nIn = n;
+				n = iFrontEnd->Process(floatBuf, n, b->iFData + b->iCount);
+				timer.Lap(EStageFrontEnd, nIn);
+			}
+			else
+			{
+				iSrc->GetSamples(b->iData + b->iCount, frames, n, 0);
+				timer.Lap(EStageConvert, n);
+			}
+			b->iCount += n;
+		}
+		b->iLast = last;
+		iSampleQ.EndWrite();
+	}
+	delete[] floatBuf;
+	delete[] sampleBuf;
+}
+
+// Collects bits from the demodulator into bit blocks of up to aCapacity
+// bits. An engine may give more bits than it is given samples, when it
+// replays history, so a full block is passed on part way through a sample
+// block with no quality measurements, which go with the last one.
+class CBitBlockSink : public CBitSink
+{
+public:
+	CBitBlockSink(CSpscRing<SBitBlock>& aQueue, uint32_t aCapacity, const CDemodulator* aDemod)
+	:	iQueue(aQueue), iCapacity(aCapacity), iDemod(aDemod), iBlock(aQueue.BeginWrite())
+	{
+		iBlock->iCount = 0;
+	}
+	SBitBlock* Block() { return iBlock; }
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence)
+	{
+		if (iBlock->iCount == iCapacity)
+			Flush();
+		uint32_t n = iBlock->iCount++;
+		if ((n & 7) == 0)
+			iBlock->iData[n >> 3] = 0;
+		iBlock->iData[n >> 3] |= (uint8_t)(aBit << (n & 7));
+		iBlock->iConf[n] = (uint8_t)aConfidence;
+	}
+private:
+	void Flush()
+	{
+		iBlock->iSpeed = iDemod->Speed();
+		memset(&iBlock->iQuality, 0, sizeof(iBlock->iQuality));
+		iBlock->iLast = false;
+		iQueue.EndWrite();
+		iBlock = iQueue.BeginWrite();
+		iBlock->iCount = 0;
+	}
+private:
+	CSpscRing<SBitBlock>&	iQueue;
+	uint32_t				iCapacity;
+	const CDemodulator*		iDemod;
+	SBitBlock*				iBlock;
+};
+
+void CPipeline::DemodStage()
+{
+	CStageTimer timer(iStats, "demod");
+	bool last = false;
+	while (!last)
+	{
+		SSampleBlock* s = iSampleQ.BeginRead();
+		CBitBlockSink sink(iBitQ, iBlockFrames, iDemod);
+		timer.Start();
+		if (iFrontEnd)
+			iDemod->Process(s->iFData, s->iCount, sink);
+		else
+			iDemod->Process(s->iData, s->iCount, sink);
+		timer.Lap(EStageDemod, s->iCount);
+		SBitBlock* b = sink.Block();
+		b->iSpeed = iDemod->Speed();
+		b->iQuality = iDemod->TakeQuality();
+		last = s->iLast;
+		iSampleQ.EndRead();
+		b->iLast = last;
+		iBitQ.EndWrite();
+	}
+}
+
+void CPipeline::FrameStage()
+{
+	CStageTimer timer(iStats, "decoder");
+	bool last = false;
+	while (!last)
+	{
+		SBitBlock* b = iBitQ.BeginRead();
+		timer.Start();
+		iDecoder->Bits(b->iData, b->iCount, b->iConf);
+		timer.Lap(EStageDecode, b->iCount);
+		if (iStats)
+			iStats->AddBits(b->iCount);
+		iDecoder->Speed(b->iSpeed);
+		iDecoder->Quality(b->iQuality);
+		last = b->iLast;
+		iBitQ.EndRead();
+	}
+}
@@ -0,0 +1,151 @@
+/*
+* Header file for multi-threaded decode pipeline
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#define	PIPELINE_BLOCK_FRAMES	(4096)		// default frames per sample block
+#define	PIPELINE_QUEUE_DEPTH	(8)			// default blocks in each queue
+
+class CSampleSource;
+class CDemodulator;
+class CDecoder;
+class CFrontEnd;
+class CStats;
+
+/*
+* Single producer, single consumer ring of preallocated slots. The producer
+* fills the slot returned by BeginWrite() and publishes it with EndWrite();
+* the consumer gets it from BeginRead() and frees it with EndRead(). Both
+* ends spin briefly then yield while the ring is full or empty. The slot
+* count is rounded up to a power of two.
+*/
+template<class T> class CSpscRing
+{
+public:
+	CSpscRing(uint32_t aSlots)
+	:	iSlots(0),
+		iMask(0),
+		iData(0),
+		iHead(0),
+		iTail(0)
+	{
+		uint32_t n = 1;
+		while (n < aSlots)
+			n <<= 1;
+		iSlots = n;
+		iMask = n - 1;
+		iData = new T[n];
+	}
+	~CSpscRing()
+	{
+		delete[] iData;
+	}
+	inline uint32_t Slots() const { return iSlots; }
+	inline T& Slot(uint32_t aIndex) { return iData[aIndex]; }
+	T* BeginWrite()
+	{
+		uint32_t head = iHead.load(std::memory_order_relaxed);
+		uint32_t spin = 0;
+		while (head - iTail.load(std::memory_order_acquire) == iSlots)
+			Wait(spin);
+		return &iData[head & iMask];
+	}
+	void EndWrite()
+	{
+		iHead.store(iHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	T* BeginRead()
+	{
+		uint32_t tail = iTail.load(std::memory_order_relaxed);
+		uint32_t spin = 0;
+		while (iHead.load(std::memory_order_acquire) == tail)
+			Wait(spin);
+		return &iData[tail & iMask];
+	}
+	void EndRead()
+	{
+		iTail.store(iTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+private:
+	static inline void Wait(uint32_t& aSpin)
+	{
+		if (++aSpin > 64)
+			std::this_thread::yield();
+	}
+private:
+	uint32_t	iSlots;
+	uint32_t	iMask;
+	T*			iData;
+	alignas(64) std::atomic<uint32_t>	iHead;		// next slot to be written
+	alignas(64) std::atomic<uint32_t>	iTail;		// next slot to be read
+};
+
+// block of converted samples passed from reader to demodulator; integer
+// samples straight from the source, or float if the front end is in use
+struct SSampleBlock
+{
+	int32_t*	iData;
+	float*		iFData;
+	uint32_t	iCount;
+	bool		iLast;					// no more blocks follow
+};
+
+// block of demodulated bits (packed LSB first) passed from demodulator to decoder
+struct SBitBlock
+{
+	uint8_t*	iData;
+	uint8_t*	iConf;					// confidence of each bit
+	uint32_t	iCount;
+	double		iSpeed;					// demodulator's tape speed estimate at the end of the block
+	SSignalQuality	iQuality;			// demodulator's measurements over the block
+	bool		iLast;					// no more blocks follow
+};
+
+/*
+* Runs the reader/convert (and front end), demodulator and framing stages on
+* separate threads connected by SPSC rings. The framing stage runs on the
+* calling thread, so CDecoder callbacks happen there. Output is identical to
+* feeding the same objects sample by sample on one thread.
+*/
+class CPipeline
+{
+public:
+	CPipeline(CSampleSource* aSrc, CFrontEnd* aFrontEnd, CDemodulator* aDemod, CDecoder* aDecoder, uint32_t aBlockFrames, uint32_t aQueueDepth);
+	~CPipeline();
+	void Run();
+	void SetStats(CStats* aStats) { iStats = aStats; }
+private:
+	void ReadStage();
+	void DemodStage();
+	void FrameStage();
+private:
+	CSampleSource*	iSrc;
+	CFrontEnd*		iFrontEnd;			// optional, runs in the reader stage
+	CDemodulator*	iDemod;
+	CDecoder*		iDecoder;
+	uint32_t		iBlockFrames;
+	CStats*			iStats;				// stage timings, may be 0
+	CSpscRing<SSampleBlock>	iSampleQ;
+	CSpscRing<SBitBlock>	iBitQ;
+};
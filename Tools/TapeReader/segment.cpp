@@ -0,0 +1,408 @@
+/*
+* Decoding one capture in parallel segments
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include "wav.h"
+#include "demod.h"
+#include "decoder.h"
+#include "eventlog.h"
+#include "frontend.h"
+#include "segment.h"
+
+#ifndef PI
+#define PI		(3.14159265358979323846)
+#endif
+
+#define	SEGMENT_FRAMES_PER_READ	(4096)	// frames each segment reads at a time
+
+// A stretch of a memory mapped WAV file
+class CSampleSlice : public CSampleSource
+{
+public:
+	CSampleSlice(const CWavFile* aSrc, uint64_t aStart, uint64_t aEnd);
+	virtual uint32_t ReadFrames(const uint8_t*& aPtr, uint32_t aMaxFrames);
+private:
+	const uint8_t*	iData;			// first frame of the stretch
+	uint64_t		iLength;		// number of frames
+	uint64_t		iIndex;			// index of next frame to be read
+};
+
+CSampleSlice::CSampleSlice(const CWavFile* aSrc, uint64_t aStart, uint64_t aEnd)
+:	iData(aSrc->Data() + (size_t)aStart * aSrc->BytesPerFrame()),
+	iLength(aEnd - aStart),
+	iIndex(0)
+{
+	SetFormat(aSrc->SampleRate(), aSrc->NumChannels(), aSrc->SampleFormat());
+	iBitsPerSample = (uint16_t)aSrc->BitsPerSample();
+}
+
+uint32_t CSampleSlice::ReadFrames(const uint8_t*& aPtr, uint32_t aMaxFrames)
+{
+	uint64_t remain = iLength - iIndex;
+	uint32_t n = (remain > aMaxFrames) ? aMaxFrames : (uint32_t)remain;
+	aPtr = iData + (size_t)iIndex * iBytesPerFrame;
+	iIndex += n;
+	return n;
+}
+
+enum TSegmentEvent
+{
+	ESegmentFile = 0,
+	ESegmentBlock = 1,
+	ESegmentEof = 2,
+	ESegmentError = 3,
+};
+
+struct SSegmentEvent
+{
+	TSegmentEvent	iType;
+	SBlockHeader	iHdr;			// for ESegmentFile, ESegmentBlock and ESegmentError
+	uint8_t			iData[MAX_BLOCK_LENGTH];	// for ESegmentBlock
+	uint32_t		iBlockNum;		// for ESegmentError
+	uint32_t		iErr;			// for ESegmentError
+	bool			iHasHdr;		// for ESegmentError, iHdr is valid
+	uint32_t		iLogged;		// events the decoder had logged before this
+	uint64_t		iFrame;			// sample offset of the read it fell in
+};
+
+// Decoder for one segment; keeps what it decodes, and the events it logs
+// if the output decoder has an event log, until they can be passed on
+class CSegmentDecoder : public CDecoder
+{
+public:
+	CSegmentDecoder(CEventLog* aOutputLog);
+	~CSegmentDecoder();
+	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData);
+	virtual void File(const SBlockHeader* aHdr);
+	virtual void Eof();
+	virtual void Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr);
+	void Clock(uint64_t aFrame);
+private:
+	SSegmentEvent& Record(TSegmentEvent aType);
+public:
+	std::vector<SSegmentEvent>	iEvents;	// in the order they happened
+	CEventLog*		iLog;			// 0 if the output decoder has no event log, owned
+	uint64_t		iFrame;			// from Clock()
+};
+
+CSegmentDecoder::CSegmentDecoder(CEventLog* aOutputLog)
+:	iLog(aOutputLog ? new CEventLog(aOutputLog->Level()) : 0),
+	iFrame(EVENTLOG_NO_FRAME)
+{
+	SetEventLog(iLog);
+}
+
+CSegmentDecoder::~CSegmentDecoder()
+{
+	delete iLog;
+}
+
+// Set the sample offset of what is decoded next
+void CSegmentDecoder::Clock(uint64_t aFrame)
+{
+	iFrame = aFrame;
+	if (iLog)
+		iLog->Clock(aFrame);
+}
+
+SSegmentEvent& CSegmentDecoder::Record(TSegmentEvent aType)
+{
+	iEvents.emplace_back();
+	SSegmentEvent& e = iEvents.back();
+	e.iType = aType;
+	e.iLogged = iLog ? iLog->Kept() : 0;
+	e.iFrame = iFrame;
+	return e;
+}
+
+void CSegmentDecoder::Block(const SBlockHeader* aHdr, const uint8_t* aData)
+{
+	SSegmentEvent& e = Record(ESegmentBlock);
+	e.iHdr = *aHdr;
+	memcpy(e.iData, aData, aHdr->iBlockLen);
+}
+
+void CSegmentDecoder::File(const SBlockHeader* aHdr)
+{
+	SSegmentEvent& e = Record(ESegmentFile);
+	e.iHdr = *aHdr;
+}
+
+void CSegmentDecoder::Eof()
+{
+	Record(ESegmentEof);
+}
+
+void CSegmentDecoder::Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr)
+{
+	SSegmentEvent& e = Record(ESegmentError);
+	e.iBlockNum = aBlockNum;
+	e.iErr = aErr;
+	e.iHasHdr = (aHdr != 0);
+	if (aHdr)
+		e.iHdr = *aHdr;
+}
+
+class CSegmentSink : public CBitSink
+{
+public:
+	CSegmentSink(CDecoder* aDecoder) : iDecoder(aDecoder) {}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence) { iDecoder->Bit(aBit, aConfidence); }
+private:
+	CDecoder* iDecoder;
+};
+
+CSegmenter::CSegmenter(CWavFile* aSrc, CDecoder* aOutput, uint32_t aThreads, uint32_t aAlign)
+:	iSrc(aSrc),
+	iOutput(aOutput),
+	iThreads(aThreads),
+	iAlign(aAlign),
+	iNext(0)
+{
+}
+
+CSegmenter::~CSegmenter()
+{
+	uint32_t i;
+	for (i=0; i<iSegments.size(); ++i)
+	{
+		delete iSegments[i].iDecoder;
+		delete iSegments[i].iDemod;
+		delete iSegments[i].iFrontEnd;
+	}
+}
+
+// Find the leaders at which the capture can be split into segments at
+// least aMinTime seconds long, and return the number of segments
+uint32_t CSegmenter::Split(double aMinTime)
+{
+	double fs = (double)iSrc->SampleRate();
+	uint32_t window = (uint32_t)ceil(fs / FREQ0);
+	double coeff = 2.0 * cos(2.0 * PI * FREQ1 / fs);
+	uint32_t minRun = (uint32_t)(SEGMENT_MIN_LEADER * fs / window);
+	uint64_t minLen = (uint64_t)(aMinTime * fs);
+	uint64_t length = iSrc->Length();
+	int32_t* buf = new int32_t[window];
+	uint64_t start = 0;				// start of segment being measured
+	uint64_t runStart = 0;			// start of current stretch of leader
+	uint32_t run = 0;				// windows in current stretch of leader
+	uint64_t pos;
+	SSegment seg;
+	memset(&seg, 0, sizeof(seg));
+	for (pos=0; iSrc->IsMapped() && pos + window <= length; pos += window)
+	{
+		iSrc->GetSamples(buf, iSrc->Data() + (size_t)pos * iSrc->BytesPerFrame(), window, 0);
+		double s0 = 0;
+		double s1 = 0;
+		double energy = 0;
+		uint32_t i;
+		for (i=0; i<window; ++i)
+		{
+			double x = (double)buf[i];
+			double s = x + coeff * s0 - s1;
+			s1 = s0;
+			s0 = s;
+			energy += x * x;
+		}
+		double p1 = s0*s0 + s1*s1 - coeff*s0*s1;
+		double full = energy * window / 2;	// tone power if all energy were at one tone
+		if (full > 0 && p1 >= SEGMENT_LEADER_RATIO * full)
+		{
+			if (run++ == 0)
+				runStart = pos;
+			continue;
+		}
+		uint64_t split = (runStart + pos) / 2;
+		split -= split % iAlign;
+		if (run >= minRun && split >= start + minLen)
+		{
+			seg.iStart = start;
+			seg.iEnd = split;
+			iSegments.push_back(seg);
+			start = runStart - runStart % iAlign;
+		}
+		run = 0;
+	}
+	delete[] buf;
+	seg.iStart = start;
+	seg.iEnd = length;
+	iSegments.push_back(seg);
+	return (uint32_t)iSegments.size();
+}
+
+// The number of threads Run() decodes the segments on
+uint32_t CSegmenter::Threads() const
+{
+	uint32_t n = (uint32_t)iSegments.size();
+	return (iThreads < n) ? iThreads : n;
+}
+
+// Decode the segments with a front end and demodulator each, on the
+// thread pool, then pass the results on in order
+void CSegmenter::Run(CFrontEnd** aFrontEnds, CDemodulator** aDemods)
+{
+	uint32_t nThreads = Threads();
+	uint32_t i;
+	std::thread** threads = new std::thread*[nThreads];
+	for (i=0; i<nThreads; ++i)
+		threads[i] = new std::thread(&CSegmenter::Worker, this, aFrontEnds, aDemods);
+	for (i=0; i<nThreads; ++i)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	delete[] threads;
+	Finish();
+}
+
+void CSegmenter::Worker(CFrontEnd** aFrontEnds, CDemodulator** aDemods)
+{
+	for (;;)
+	{
+		uint32_t i;
+		{
+			std::unique_lock<std::mutex> lock(iLock);
+			i = iNext++;
+		}
+		if (i >= iSegments.size())
+			return;
+		Decode(i, aFrontEnds[i], aDemods[i]);
+	}
+}
+
+// Decode segment aIndex, taking ownership of the front end and demodulator
+void CSegmenter::Decode(uint32_t aIndex, CFrontEnd* aFrontEnd, CDemodulator* aDemod)
+{
+	SSegment& s = iSegments[aIndex];
+	s.iFrontEnd = aFrontEnd;
+	s.iDemod = aDemod;
+	s.iDecoder = new CSegmentDecoder(iOutput->EventLog());
+	s.iDecoder->SetRecovery(aDemod->Recovery());
+	Decode(s, s.iStart, s.iEnd);
+}
+
+// pass on what the segments decoded, in order
+void CSegmenter::Finish()
+{
+	uint32_t owner = 0;				// segment whose objects decoded up to here
+	uint32_t i;
+	Replay(iSegments[0]);
+	for (i=1; i<iSegments.size(); ++i)
+	{
+		SSegment& prev = iSegments[owner];
+		if (prev.iDecoder->Idle())
+		{
+			owner = i;
+		}
+		else
+		{
+			// part way through a file, so carry on from where the previous
+			// segment stopped
+			Decode(prev, prev.iEnd, iSegments[i].iEnd);
+			prev.iEnd = iSegments[i].iEnd;
+		}
+		Replay(iSegments[owner]);
+	}
+}
+
+// Pass frames aStart to aEnd through the segment's front end, demodulator
+// and decoder. Reads are aligned as a sequential decode's would be, so the
+// decoder is told the speed at the same places.
+void CSegmenter::Decode(const SSegment& aSegment, uint64_t aStart, uint64_t aEnd)
+{
+	CSampleSlice* pSlice = iSrc->IsMapped() ? new CSampleSlice(iSrc, aStart, aEnd) : 0;
+	CSampleSource& src = pSlice ? (CSampleSource&)*pSlice : (CSampleSource&)*iSrc;
+	CSegmentSink sink(aSegment.iDecoder);
+	int32_t* sampleBuf = new int32_t[SEGMENT_FRAMES_PER_READ];
+	float* floatBuf = aSegment.iFrontEnd ? new float[SEGMENT_FRAMES_PER_READ] : 0;
+	float* filtBuf = aSegment.iFrontEnd ? new float[aSegment.iFrontEnd->MaxOutput(SEGMENT_FRAMES_PER_READ)] : 0;
+	for (;;)
+	{
+		const uint8_t* frames;
+		uint32_t nFrames = src.ReadFrames(frames, SEGMENT_FRAMES_PER_READ - (uint32_t)(aStart % SEGMENT_FRAMES_PER_READ));
+		if (nFrames == 0)
+			break;
+		aSegment.iDecoder->Clock(aStart + nFrames);
+		src.GetSamples(sampleBuf, frames, nFrames, 0);
+		if (aSegment.iFrontEnd)
+		{
+			uint32_t i;
+			for (i=0; i<nFrames; ++i)
+				floatBuf[i] = (float)sampleBuf[i];
+			uint32_t nOut = aSegment.iFrontEnd->Process(floatBuf, nFrames, filtBuf);
+			aSegment.iDemod->Process(filtBuf, nOut, sink);
+		}
+		else
+		{
+			aSegment.iDemod->Process(sampleBuf, nFrames, sink);
+		}
+		aSegment.iDecoder->Speed(aSegment.iDemod->Speed());
+		aSegment.iDecoder->Quality(aSegment.iDemod->TakeQuality());
+		aStart += nFrames;
+	}
+	delete[] filtBuf;
+	delete[] floatBuf;
+	delete[] sampleBuf;
+	delete pSlice;
+}
+
+// pass on what a segment's decoder has recorded since last time, with
+// the events it logged in between
+void CSegmenter::Replay(const SSegment& aSegment)
+{
+	std::vector<SSegmentEvent>& events = aSegment.iDecoder->iEvents;
+	CEventLog* segLog = aSegment.iDecoder->iLog;
+	CEventLog* log = iOutput->EventLog();
+	uint32_t passed = 0;			// events passed on from segLog
+	uint32_t i;
+	for (i=0; i<events.size(); ++i)
+	{
+		const SSegmentEvent& e = events[i];
+		if (segLog)
+		{
+			segLog->PassOn(*log, e.iLogged - passed);
+			passed = e.iLogged;
+			log->Clock(e.iFrame);
+		}
+		switch (e.iType)
+		{
+		case ESegmentFile:
+			iOutput->File(&e.iHdr);
+			break;
+		case ESegmentBlock:
+			iOutput->Block(&e.iHdr, e.iData);
+			break;
+		case ESegmentEof:
+			iOutput->Eof();
+			break;
+		case ESegmentError:
+			iOutput->Error(e.iBlockNum, e.iErr, e.iHasHdr ? &e.iHdr : 0);
+			break;
+		}
+	}
+	events.clear();
+	if (segLog)
+		segLog->PassOn(*log, segLog->Kept());
+}
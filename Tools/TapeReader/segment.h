@@ -0,0 +1,91 @@
+/*
+* Header file for decoding one capture in parallel segments
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+#define	SEGMENT_MIN_LEADER		(1.5)		// seconds of unbroken leader tone at which a capture may be split
+#define	SEGMENT_MIN_TIME		(5.0)		// shortest segment in seconds
+#define	SEGMENT_LEADER_RATIO	(0.5)		// fraction of a window's energy at FREQ1 for it to count as leader
+
+class CWavFile;
+class CFrontEnd;
+class CDemodulator;
+class CDecoder;
+class CSegmentDecoder;
+
+// one stretch of the capture, with the objects which decode it
+struct SSegment
+{
+	uint64_t			iStart;			// first frame demodulated
+	uint64_t			iEnd;			// frame after the last
+	CFrontEnd*			iFrontEnd;		// may be 0, owned
+	CDemodulator*		iDemod;			// owned
+	CSegmentDecoder*	iDecoder;		// records what the segment decoded
+};
+
+/*
+* Decodes a memory mapped WAV file in segments on a pool of threads. A
+* pre-pass measures each bit period with a Goertzel filter at FREQ1 and
+* finds stretches of at least SEGMENT_MIN_LEADER seconds of unbroken
+* leader tone, which on tape come before the first block of a file. The
+* capture is split half way through such a leader, and the following
+* segment starts demodulating at the beginning of the leader, so its
+* demodulator has settled before the decoder finds the end of the leader.
+* Each segment has its own front end, demodulator and decoder, and the
+* files, blocks and ends of file each decoder reports are passed to the
+* output decoder in order once all segments are done. If a decoder is part
+* way through a file at the end of its segment, the split was not between
+* files after all, and the following segment is decoded again by the same
+* objects carrying straight on, as a sequential decode would. If the
+* output decoder has an event log, each segment decoder logs into a log of
+* its own, whose events are passed on in order with the files and blocks.
+*
+* Run() decodes the segments on a pool of iThreads threads. Alternatively
+* the caller can pass each segment to Decode() from whatever threads it
+* likes, then call Finish() once they are all done. A file which can't be
+* memory mapped is one segment, read sequentially.
+*/
+class CSegmenter
+{
+public:
+	CSegmenter(CWavFile* aSrc, CDecoder* aOutput, uint32_t aThreads, uint32_t aAlign);
+	~CSegmenter();
+	uint32_t Split(double aMinTime = SEGMENT_MIN_TIME);
+	uint32_t Threads() const;
+	void Run(CFrontEnd** aFrontEnds, CDemodulator** aDemods);
+	void Decode(uint32_t aIndex, CFrontEnd* aFrontEnd, CDemodulator* aDemod);
+	void Finish();
+private:
+	void Worker(CFrontEnd** aFrontEnds, CDemodulator** aDemods);
+	void Decode(const SSegment& aSegment, uint64_t aStart, uint64_t aEnd);
+	void Replay(const SSegment& aSegment);
+private:
+	CWavFile*		iSrc;
+	CDecoder*		iOutput;		// receives the decoded files in order
+	uint32_t		iThreads;		// size of thread pool
+	uint32_t		iAlign;			// segments start on a multiple of this many frames
+	std::vector<SSegment>	iSegments;	// in order through the capture
+	std::mutex		iLock;
+	uint32_t		iNext;			// next segment to be taken by a worker
+};
@@ -0,0 +1,143 @@
+/*
+* Feeding samples through the decoding chain
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "wav.h"
+#include "demod.h"
+#include "decoder.h"
+#include "frontend.h"
+#include "serial.h"
+#include "stats.h"
+
+class CDecoderSink : public CBitSink
+{
+public:
+	CDecoderSink(CDecoder* aDecoder) : iDecoder(aDecoder) {}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence) { iDecoder->Bit(aBit, aConfidence); }
+private:
+	CDecoder* iDecoder;
+};
+
+// collects bits packed LSB first and passes them to the decoder in bulk
+class CPackedBitSink : public CBitSink
+{
+public:
+	CPackedBitSink(CDecoder* aDecoder)
+	:	iDecoder(aDecoder),
+		iCount(0)
+	{
+	}
+	virtual void Bit(uint32_t aBit, uint32_t aConfidence)
+	{
+		if ((iCount & 7) == 0)
+			iData[iCount >> 3] = 0;
+		iData[iCount >> 3] |= (uint8_t)(aBit << (iCount & 7));
+		iConf[iCount] = (uint8_t)aConfidence;
+		if (++iCount == SERIAL_FRAMES_PER_CALL)
+			Flush();
+	}
+	uint32_t Flush()
+	{
+		uint32_t n = iCount;
+		iDecoder->Bits(iData, iCount, iConf);
+		iCount = 0;
+		return n;
+	}
+private:
+	CDecoder* iDecoder;
+	uint32_t iCount;
+	uint8_t iData[SERIAL_FRAMES_PER_CALL / 8];
+	uint8_t iConf[SERIAL_FRAMES_PER_CALL];
+};
+
+CSerialDecoder::CSerialDecoder(CFrontEnd* aFrontEnd, CDemodulator* aDemod, CDecoder* aDecoder)
+:	iFrontEnd(aFrontEnd),
+	iDemod(aDemod),
+	iDecoder(aDecoder),
+	iBitSink(new CDecoderSink(aDecoder)),
+	iPackedSink(aDemod->Recovery() ? 0 : new CPackedBitSink(aDecoder)),
+	iSampleBuf(new int32_t[SERIAL_FRAMES_PER_CALL]),
+	iFloatBuf(aFrontEnd ? new float[SERIAL_FRAMES_PER_CALL] : 0),
+	iFiltBuf(aFrontEnd ? new float[aFrontEnd->MaxOutput(SERIAL_FRAMES_PER_CALL)] : 0),
+	iStats(0),
+	iTimer(new CStageTimer(0, 0))
+{
+}
+
+CSerialDecoder::~CSerialDecoder()
+{
+	delete iTimer;
+	delete[] iFiltBuf;
+	delete[] iFloatBuf;
+	delete[] iSampleBuf;
+	delete iPackedSink;
+	delete iBitSink;
+}
+
+// Decode aNFrames frames of format aFormat starting at aFrames, aStride
+// bytes apart. Blocks longer than SERIAL_FRAMES_PER_CALL are taken in parts.
+void CSerialDecoder::Process(const void* aFrames, uint32_t aNFrames, uint32_t aStride, TSampleFormat aFormat)
+{
+	CBitSink& sink = iPackedSink ? (CBitSink&)*iPackedSink : (CBitSink&)*iBitSink;
+	const uint8_t* p = (const uint8_t*)aFrames;
+	while (aNFrames)
+	{
+		uint32_t n = aNFrames < SERIAL_FRAMES_PER_CALL ? aNFrames : SERIAL_FRAMES_PER_CALL;
+		uint32_t bits = iDecoder->BitCount();
+		iTimer->Start();
+		ConvertSamples(iSampleBuf, p, n, aStride, aFormat);
+		iTimer->Lap(EStageConvert, n);
+		if (iFrontEnd)
+		{
+			uint32_t i;
+			for (i=0; i<n; ++i)
+				iFloatBuf[i] = (float)iSampleBuf[i];
+			uint32_t nOut = iFrontEnd->Process(iFloatBuf, n, iFiltBuf);
+			iTimer->Lap(EStageFrontEnd, n);
+			iDemod->Process(iFiltBuf, nOut, sink);
+			iTimer->Lap(EStageDemod, nOut);
+		}
+		else
+		{
+			iDemod->Process(iSampleBuf, n, sink);
+			iTimer->Lap(EStageDemod, n);
+		}
+		if (iPackedSink)
+		{
+			uint32_t nBits = iPackedSink->Flush();
+			iTimer->Lap(EStageDecode, nBits);
+		}
+		if (iStats)
+			iStats->AddBits(iDecoder->BitCount() - bits);
+		iDecoder->Speed(iDemod->Speed());
+		iDecoder->Quality(iDemod->TakeQuality());
+		p += (size_t)n * aStride;
+		aNFrames -= n;
+	}
+}
+
+// Record stage timings in aStats, or stop recording them if 0
+void CSerialDecoder::SetStats(CStats* aStats)
+{
+	delete iTimer;
+	iStats = aStats;
+	iTimer = new CStageTimer(aStats, "main");
+}
@@ -0,0 +1,64 @@
+/*
+* Header file for feeding samples through the decoding chain
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+#define	SERIAL_FRAMES_PER_CALL	(4096)	// most frames passed to the demodulator at a time
+
+class CFrontEnd;
+class CDemodulator;
+class CDecoder;
+class CBitSink;
+class CDecoderSink;
+class CPackedBitSink;
+class CStats;
+class CStageTimer;
+
+/*
+* Passes blocks of PCM frames in order through an optional front end, a
+* demodulator and a decoder, telling the decoder the tape speed and signal
+* quality after each block. Only the first channel is decoded. Bits
+* normally reach the decoder packed, a block at a time, but one at a time
+* if the demodulator has a recovery source, since that needs to know where
+* the demodulator is when a leader is found. With a CStats set, the time
+* taken by each stage is recorded; when bits are passed one at a time,
+* decoding is counted as part of demodulation.
+*/
+class CSerialDecoder
+{
+public:
+	CSerialDecoder(CFrontEnd* aFrontEnd, CDemodulator* aDemod, CDecoder* aDecoder);
+	~CSerialDecoder();
+	void Process(const void* aFrames, uint32_t aNFrames, uint32_t aStride, TSampleFormat aFormat);
+	void SetStats(CStats* aStats);
+private:
+	CFrontEnd*		iFrontEnd;		// may be 0
+	CDemodulator*	iDemod;
+	CDecoder*		iDecoder;
+	CDecoderSink*	iBitSink;		// one bit at a time
+	CPackedBitSink*	iPackedSink;	// bits in bulk, 0 if not used
+	int32_t*		iSampleBuf;		// SERIAL_FRAMES_PER_CALL samples
+	float*			iFloatBuf;		// same converted to float for the front end
+	float*			iFiltBuf;		// front end output
+	CStats*			iStats;			// may be 0
+	CStageTimer*	iTimer;			// times stages into iStats
+};
@@ -0,0 +1,183 @@
+/*
+* Per-stage performance counters and timeline trace
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "decoder.h"
+#include "stats.h"
+
+static const char* const TheStageNames[EStageCount] =
+{
+	"read", "convert", "front_end", "demod", "decode",
+};
+
+CStats::CStats(bool aTrace)
+:	iStart(WallNs()),
+	iBits(0),
+	iTrace(aTrace),
+	iDropped(0),
+	iThreads(0)
+{
+	memset(iStages, 0, sizeof(iStages));
+}
+
+uint64_t CStats::WallNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time used by the calling thread
+uint64_t CStats::CpuNs()
+{
+#ifdef _WIN32
+	FILETIME create, exit, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user))
+		return 0;
+	uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) * 100;
+#else
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Index of a thread which will time stages, named aName in the trace.
+// Threads with the same name share an index.
+uint32_t CStats::Thread(const char* aName)
+{
+	std::lock_guard<std::mutex> lock(iLock);
+	uint32_t i;
+	for (i=0; i<iThreads; ++i)
+	{
+		if (strcmp(iThreadNames[i], aName) == 0)
+			return i;
+	}
+	if (iThreads == STATS_MAX_THREADS)
+		return STATS_MAX_THREADS - 1;
+	iThreadNames[iThreads] = aName;
+	return iThreads++;
+}
+
+void CStats::Add(uint32_t aThread, TStage aStage, uint64_t aItems, uint64_t aStart, uint64_t aWallNs, uint64_t aCpuNs)
+{
+	SStageStats& s = iStages[aStage];
+	++s.iCalls;
+	s.iItems += aItems;
+	s.iWallNs += aWallNs;
+	s.iCpuNs += aCpuNs;
+	if (!iTrace)
+		return;
+	std::lock_guard<std::mutex> lock(iLock);
+	if (iSpans.size() == STATS_MAX_SPANS)
+	{
+		++iDropped;
+		return;
+	}
+	SStageSpan span;
+	span.iStart = aStart - iStart;
+	span.iWallNs = aWallNs;
+	span.iItems = aItems;
+	span.iThread = (uint16_t)aThread;
+	span.iStage = (uint16_t)aStage;
+	iSpans.push_back(span);
+}
+
+// Summary of time spent in each stage, and what the decoder found
+void CStats::Report(FILE* aFile, const CDecoder* aDecoder) const
+{
+	double elapsed = (WallNs() - iStart) / 1e9;
+	uint32_t i;
+	fprintf(aFile, "Stage         Calls        Items    Wall/ms     CPU/ms   Mitems/s\n");
+	for (i=0; i<EStageCount; ++i)
+	{
+		const SStageStats& s = iStages[i];
+		if (s.iCalls == 0)
+			continue;
+		double rate = s.iWallNs ? s.iItems * 1e3 / s.iWallNs : 0;
+		fprintf(aFile, "%-10s %8llu %12llu %10.1f %10.1f %10.2f\n", TheStageNames[i],
+			(unsigned long long)s.iCalls, (unsigned long long)s.iItems, s.iWallNs / 1e6, s.iCpuNs / 1e6, rate);
+	}
+	fprintf(aFile, "Items are frames, or bits for decode\n");
+	const SStageStats& read = iStages[EStageRead];
+	fprintf(aFile, "Elapsed      %.3f s, %.0f frames/s\n", elapsed, elapsed > 0 ? read.iItems / elapsed : 0.0);
+	fprintf(aFile, "Bits         %llu\n", (unsigned long long)iBits);
+	if (aDecoder)
+	{
+		const SDecoderCounts& c = aDecoder->Counts();
+		fprintf(aFile, "Bytes        %llu\n", (unsigned long long)c.iBytes);
+		fprintf(aFile, "Leaders      %llu\n", (unsigned long long)c.iLeaders);
+		fprintf(aFile, "Blocks       %llu good, %llu bad\n", (unsigned long long)c.iBlocks, (unsigned long long)c.iBadBlocks);
+		for (i=0; i<DECODER_ERROR_BITS; ++i)
+		{
+			if (c.iErrors[i])
+				fprintf(aFile, "  %-18s %llu\n", CDecoder::ErrorName(i), (unsigned long long)c.iErrors[i]);
+		}
+	}
+	if (iDropped)
+		fprintf(aFile, "Trace full, %u stage runs not recorded\n", iDropped);
+}
+
+// Write the recorded stage runs as complete ("X") events in the Chrome trace
+// event format, with times in microseconds
+bool CStats::WriteTrace(const char* aPath) const
+{
+	FILE* f = fopen(aPath, "w");
+	if (!f)
+		return false;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	uint32_t i;
+	for (i=0; i<iThreads; ++i)
+	{
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}},\n", i, iThreadNames[i]);
+	}
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"tape_reader\"}}");
+	size_t j;
+	for (j=0; j<iSpans.size(); ++j)
+	{
+		const SStageSpan& s = iSpans[j];
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"items\":%llu}}",
+			TheStageNames[s.iStage], s.iThread, s.iStart / 1e3, s.iWallNs / 1e3, (unsigned long long)s.iItems);
+	}
+	fprintf(f, "\n]}\n");
+	bool ok = !ferror(f);
+	if (fclose(f) != 0)
+		ok = false;
+	return ok;
+}
+
+void CStageTimer::DoLap(TStage aStage, uint64_t aItems)
+{
+	uint64_t wall = CStats::WallNs();
+	uint64_t cpu = CStats::CpuNs();
+	iStats->Add(iThread, aStage, aItems, iWall, wall - iWall, cpu - iCpu);
+	iWall = wall;
+	iCpu = cpu;
+}
@@ -0,0 +1,129 @@
+/*
+* Header file for per-stage performance counters and timeline trace
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+#define	STATS_MAX_SPANS		(1000000)	// most stage timings kept for the trace
+#define	STATS_MAX_THREADS	(16)		// most threads named in the trace
+
+class CDecoder;
+
+// processing stages timed separately
+enum TStage
+{
+	EStageRead = 0,					// frames from the sample source
+	EStageConvert = 1,				// PCM to int32 or float
+	EStageFrontEnd = 2,				// band-pass filter and decimation
+	EStageDemod = 3,				// samples to bits
+	EStageDecode = 4,				// bits to blocks
+	EStageCount = 5,
+};
+
+struct SStageStats
+{
+	uint64_t		iCalls;			// times the stage ran
+	uint64_t		iItems;			// frames, or bits for EStageDecode
+	uint64_t		iWallNs;
+	uint64_t		iCpuNs;			// time the calling thread was running
+};
+
+// one run of a stage, for the trace
+struct SStageSpan
+{
+	uint64_t		iStart;			// ns since CStats was created
+	uint64_t		iWallNs;
+	uint64_t		iItems;
+	uint16_t		iThread;		// index returned by Thread()
+	uint16_t		iStage;			// TStage
+};
+
+/*
+* Totals of the wall and CPU time spent in each stage and the number of
+* items it handled, and optionally a record of every run of a stage which
+* can be written as a Chrome trace (JSON, opened by chrome://tracing or
+* Perfetto). Each stage must only be timed from one thread at a time; the
+* trace may be added to from several.
+*/
+class CStats
+{
+public:
+	CStats(bool aTrace);
+	uint32_t Thread(const char* aName);
+	void Add(uint32_t aThread, TStage aStage, uint64_t aItems, uint64_t aStart, uint64_t aWallNs, uint64_t aCpuNs);
+	void AddBits(uint64_t aBits) { iBits += aBits; }
+	void Report(FILE* aFile, const CDecoder* aDecoder) const;
+	bool WriteTrace(const char* aPath) const;
+	const SStageStats& Stage(TStage aStage) const { return iStages[aStage]; }
+	static uint64_t WallNs();
+	static uint64_t CpuNs();
+private:
+	uint64_t		iStart;			// WallNs() when created
+	uint64_t		iBits;			// bits out of the demodulator
+	SStageStats		iStages[EStageCount];
+	bool			iTrace;
+	uint32_t		iDropped;		// spans not kept because there were STATS_MAX_SPANS
+	uint32_t		iThreads;
+	const char*		iThreadNames[STATS_MAX_THREADS];
+	std::vector<SStageSpan>	iSpans;
+	std::mutex		iLock;			// guards iSpans and iThreads
+};
+
+/*
+* Times a run of stages on one thread. Start() begins timing; each Lap()
+* ends the stage just run and begins the next. Does nothing if the CStats
+* pointer is 0, so timing can be left in place at no cost when it isn't
+* wanted.
+*/
+class CStageTimer
+{
+public:
+	CStageTimer(CStats* aStats, const char* aThread)
+	:	iStats(aStats),
+		iThread(aStats ? aStats->Thread(aThread) : 0),
+		iWall(0),
+		iCpu(0)
+	{
+	}
+	inline void Start()
+	{
+		if (iStats)
+		{
+			iWall = CStats::WallNs();
+			iCpu = CStats::CpuNs();
+		}
+	}
+	inline void Lap(TStage aStage, uint64_t aItems)
+	{
+		if (iStats)
+			DoLap(aStage, aItems);
+	}
+private:
+	void DoLap(TStage aStage, uint64_t aItems);
+private:
+	CStats*		iStats;
+	uint32_t	iThread;
+	uint64_t	iWall;			// when the current stage began
+	uint64_t	iCpu;
+};
@@ -0,0 +1,215 @@
+/*
+* Streaming PCM input
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "wav.h"
+#include "stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+static void SleepMs(uint32_t aMs)
+{
+#ifdef _WIN32
+	Sleep(aMs);
+#else
+	usleep(aMs * 1000);
+#endif
+}
+
+// Stream with WAV header. The header's data size is only trusted when not
+// following a growing file, since a recorder won't have filled it in yet.
+CPcmStream::CPcmStream(const char* aFileName, bool aFollow, uint32_t aIdleTimeout)
+:	iFile(0),
+	iStdin(false),
+	iFollow(aFollow),
+	iEof(false),
+	iIdleTimeout(aIdleTimeout),
+	iIndex(0),
+	iLimit(~0ULL),
+	iRing(0),
+	iRingSize(0),
+	iHead(0),
+	iTail(0),
+	iCount(0)
+{
+	if (!Open(aFileName) || !ReadHeader())
+		return;
+	if (!iFollow && iDataSize != 0 && iDataSize != 0xFFFFFFFFU)
+		iLimit = iDataSize;
+	Init();
+}
+
+// Stream of raw PCM in the given format
+CPcmStream::CPcmStream(const char* aFileName, bool aFollow, uint32_t aFs, uint32_t aNCh, TSampleFormat aFormat)
+:	iFile(0),
+	iStdin(false),
+	iFollow(aFollow),
+	iEof(false),
+	iIdleTimeout(STREAM_IDLE_TIMEOUT),
+	iIndex(0),
+	iLimit(~0ULL),
+	iRing(0),
+	iRingSize(0),
+	iHead(0),
+	iTail(0),
+	iCount(0)
+{
+	if (!Open(aFileName))
+		return;
+	SetFormat(aFs, aNCh, aFormat);
+	Init();
+}
+
+CPcmStream::~CPcmStream()
+{
+	delete[] iRing;
+	if (iFile && !iStdin)
+		fclose(iFile);
+}
+
+bool CPcmStream::Open(const char* aFileName)
+{
+	if (strcmp(aFileName, "-") == 0)
+	{
+		iFile = stdin;
+		iStdin = true;
+		iFollow = false;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		return true;
+	}
+	iFile = fopen(aFileName, "rb");
+	if (!iFile)
+	{
+		iError = EWavOpen;
+		return false;
+	}
+	return true;
+}
+
+// Read the WAV header. When following a file, a header which ends early
+// may still be being written, so it is read again from the start until it
+// is complete or the idle timeout has passed.
+bool CPcmStream::ReadHeader()
+{
+	uint32_t idle = 0;
+	while (!ReadWavHeader(iFile))
+	{
+		bool cutShort = (iError == EWavRead || iError == EWavNoSection);
+		if (!iFollow || !cutShort || idle >= iIdleTimeout)
+			return false;
+		rewind(iFile);
+		SleepMs(STREAM_POLL_INTERVAL);
+		idle += STREAM_POLL_INTERVAL;
+	}
+	return true;
+}
+
+void CPcmStream::Init()
+{
+	iRingSize = (STREAM_RING_SIZE / iBytesPerFrame) * iBytesPerFrame;
+	iRing = new uint8_t[iRingSize];
+}
+
+// Read up to aLen bytes. Returns 0 only at the end of the stream.
+size_t CPcmStream::ReadInput(uint8_t* aPtr, size_t aLen)
+{
+	if (aLen > iLimit)
+		aLen = (size_t)iLimit;
+	uint32_t idle = 0;
+	for (;;)
+	{
+		if (aLen == 0)
+			return 0;
+		size_t r = fread(aPtr, 1, aLen, iFile);
+		if (r > 0)
+		{
+			iLimit -= r;
+			return r;
+		}
+		if (ferror(iFile))
+		{
+			iError = EWavRead;
+			return 0;
+		}
+		if (!iFollow || idle >= iIdleTimeout)
+			return 0;
+		clearerr(iFile);
+		SleepMs(STREAM_POLL_INTERVAL);
+		idle += STREAM_POLL_INTERVAL;
+	}
+}
+
+// Top up the ring buffer until it holds at least one whole frame, or the
+// input has ended.
+void CPcmStream::Fill()
+{
+	while (!iEof && iCount < iBytesPerFrame)
+	{
+		uint32_t space = iRingSize - iCount;
+		uint32_t run = iRingSize - iHead;
+		if (run > space)
+			run = space;
+		if (run > STREAM_READ_CHUNK)
+			run = STREAM_READ_CHUNK;
+		size_t r = ReadInput(iRing + iHead, run);
+		if (r == 0)
+		{
+			iEof = true;
+			break;
+		}
+		iHead += (uint32_t)r;
+		if (iHead == iRingSize)
+			iHead = 0;
+		iCount += (uint32_t)r;
+	}
+}
+
+// Return a view of up to aMaxFrames frames, valid until the next call.
+// Returns 0 at the end of the stream; a trailing partial frame is dropped.
+uint32_t CPcmStream::ReadFrames(const uint8_t*& aPtr, uint32_t aMaxFrames)
+{
+	if (!iRing)
+		return 0;			// not opened
+	Fill();
+	uint32_t avail = iCount;
+	if (avail > iRingSize - iTail)
+		avail = iRingSize - iTail;		// ring size is a whole number of frames so no frame wraps
+	uint32_t n = avail / iBytesPerFrame;
+	if (n > aMaxFrames)
+		n = aMaxFrames;
+	aPtr = iRing + iTail;
+	iTail += n * iBytesPerFrame;
+	if (iTail == iRingSize)
+		iTail = 0;
+	iCount -= n * iBytesPerFrame;
+	iIndex += n;
+	return n;
+}
@@ -0,0 +1,72 @@
+/*
+* Header file for streaming PCM input
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define	STREAM_RING_SIZE		(262144)	// approximate size of ring buffer in bytes
+#define	STREAM_READ_CHUNK		(16384)		// maximum bytes requested from input at a time
+#define	STREAM_POLL_INTERVAL	(50)		// ms between polls of a growing file
+#define	STREAM_IDLE_TIMEOUT		(10000)		// default ms without growth before a followed file is finished
+
+/*
+* Sample source which reads PCM sequentially from stdin or a file, without
+* needing to know its length in advance. The format comes either from a WAV
+* header at the start of the stream or from the caller (raw PCM). In follow
+* mode, reaching the end of the input waits for more data to be appended
+* until nothing has arrived for the idle timeout, and a WAV header which is
+* cut short is read again until it is complete or the idle timeout has
+* passed, since a recorder may not have written all of it yet. Frames pass
+* through a fixed size ring buffer so memory use doesn't depend on stream
+* length. If the input can't be opened or read, Error() says why.
+*/
+class CPcmStream : public CSampleSource
+{
+public:
+	CPcmStream(const char* aFileName, bool aFollow, uint32_t aIdleTimeout = STREAM_IDLE_TIMEOUT);
+	CPcmStream(const char* aFileName, bool aFollow, uint32_t aFs, uint32_t aNCh, TSampleFormat aFormat);
+	virtual ~CPcmStream();
+	virtual uint32_t ReadFrames(const uint8_t*& aPtr, uint32_t aMaxFrames);
+	inline uint64_t Index() const { return iIndex; }
+	inline bool Stdin() const { return iStdin; }
+	inline bool Following() const { return iFollow; }
+	inline void SetIdleTimeout(uint32_t aMs) { iIdleTimeout = aMs; }
+private:
+	bool Open(const char* aFileName);
+	bool ReadHeader();
+	void Init();
+	void Fill();
+	size_t ReadInput(uint8_t* aPtr, size_t aLen);
+private:
+	FILE*		iFile;
+	bool		iStdin;					// reading from stdin, so don't close
+	bool		iFollow;				// wait for more data at end of input
+	bool		iEof;					// no more data will arrive
+	uint32_t	iIdleTimeout;			// ms without growth before end of followed file
+	uint64_t	iIndex;					// number of frames delivered so far
+	uint64_t	iLimit;					// bytes of data remaining according to header
+	uint8_t*	iRing;					// ring buffer
+	uint32_t	iRingSize;				// size of ring buffer, a whole number of frames
+	uint32_t	iHead;					// ring write offset
+	uint32_t	iTail;					// ring read offset
+	uint32_t	iCount;					// bytes in ring
+};
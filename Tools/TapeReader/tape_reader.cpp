@@ -25,15 +25,36 @@
 #include <stdint.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <thread>
+#include <chrono>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include "wav.h"
+#include "stream.h"
 #include "demod.h"
 #include "decoder.h"
+#include "frontend.h"
+#include "pipeline.h"
+#include "gate.h"
+#include "bank.h"
+#include "merge.h"
+#include "segment.h"
+#include "batch.h"
+#include "index.h"
+#include "checkpoint.h"
+#include "serial.h"
+#include "eventlog.h"
+#include "stats.h"
 
-FILE* create_numbered_file(const char* name)
+#define	FRAMES_PER_READ		(4096)		// number of frames requested from WAV file at a time
+#define	NUMBERED_NAME_LENGTH	(MAX_NAME_LENGTH+5)	// tape file name with a .nnn suffix
+
+FILE* create_numbered_file(const char* name, char* xname)
 {
 	int i;
 	FILE* f;
-	char xname[MAX_NAME_LENGTH+5];
 	for (i=0; i<1000; ++i)
 	{
 		sprintf(xname, "%s.%03d", name, i);
@@ -49,74 +70,1191 @@ FILE* create_numbered_file(const char* name)
 class CDecoderX : public CDecoder
 {
 public:
-	CDecoderX();
+	CDecoderX(CEventLog* aEventLog);
 	~CDecoderX();
 
 	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData);
 	virtual void File(const SBlockHeader* aHdr);
 	virtual void Eof();
+	virtual void Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr);
+	virtual void Checkpoint(CCheckpoint& aCp);
+	void SetLog(FILE* aLog);
+	void SetBitSource(const CDecoder* aDecoder) { iBitSource = aDecoder; }
+	uint32_t Created() const { return iCreated; }
 
+private:
+	uint32_t Bit() const { return iBitSource ? iBitSource->BitCount() : EVENTLOG_NO_BIT; }
 private:
 	FILE* iFile;
+	char iFileName[NUMBERED_NAME_LENGTH];	// name of iFile
+	FILE* iLog;							// if set, the name of each file created is added; owned
+	uint32_t iCreated;					// number of files created
+	const CDecoder* iBitSource;			// decoder given the bits, if any, for the bit count of events
 };
 
-CDecoderX::CDecoderX()
-:	iFile(0)
+// Files, blocks and errors are added to aEventLog, which may be 0
+CDecoderX::CDecoderX(CEventLog* aEventLog)
+:	iFile(0),
+	iLog(0),
+	iCreated(0),
+	iBitSource(0)
 {
+	iFileName[0] = 0;
+	SetEventLog(aEventLog);
 }
 
 CDecoderX::~CDecoderX()
 {
 	if (iFile)
 		fclose(iFile);
+	if (iLog)
+		fclose(iLog);
+}
+
+void CDecoderX::SetLog(FILE* aLog)
+{
+	if (iLog)
+		fclose(iLog);
+	iLog = aLog;
+}
+
+// Save or restore the decoder and the file being written. A restored file
+// is reopened and written from where the checkpoint was taken; whatever
+// was written after that is written again the same.
+void CDecoderX::Checkpoint(CCheckpoint& aCp)
+{
+	CDecoder::Checkpoint(aCp);
+	bool open = (iFile != 0);
+	uint64_t length = 0;
+	if (iFile)
+	{
+		fflush(iFile);
+		length = (uint64_t)ftell(iFile);
+	}
+	aCp.State(open);
+	aCp.State(length);
+	aCp.State(iFileName);
+	aCp.State(iCreated);
+	if (aCp.Restoring() && open)
+	{
+		iFile = fopen(iFileName, "r+b");
+		if (!iFile || fseek(iFile, (long)length, SEEK_SET) != 0)
+		{
+			fprintf(stderr, "Can't reopen %s to resume\n", iFileName);
+			exit(1);
+		}
+	}
 }
 
 void CDecoderX::Block(const SBlockHeader* aHdr, const uint8_t* aData)
 {
-	printf("%-10s %02x %04x (%02x)\n", aHdr->iName, aHdr->iBlockNum, aHdr->iBlockLen, aHdr->iBlockFlag);
+	CEventLog* log = EventLog();
+	if (log && log->Enabled(ESeverityInfo))
+		log->Add(EEventBlock, ESeverityInfo, Bit(), aHdr->iName, aHdr->iBlockNum, 0, aHdr->iBlockLen, aHdr->iBlockFlag, aHdr->iSpeed);
 	fwrite(aData, 1, aHdr->iBlockLen, iFile);
 }
 
 void CDecoderX::File(const SBlockHeader* aHdr)
 {
-	printf("File %-10s  LA %08x  XA %08x\n", aHdr->iName, aHdr->iLoadAddr, aHdr->iExecAddr);
-	iFile = create_numbered_file(aHdr->iName);
+	CEventLog* log = EventLog();
+	if (log && log->Enabled(ESeverityInfo))
+		log->Add(EEventFile, ESeverityInfo, Bit(), aHdr->iName, aHdr->iBlockNum, 0, aHdr->iLoadAddr, aHdr->iExecAddr);
+	iFile = create_numbered_file(aHdr->iName, iFileName);
+	++iCreated;
+	if (iLog)
+	{
+		fprintf(iLog, "%s\n", iFileName);
+		fflush(iLog);
+	}
 }
 
 void CDecoderX::Eof()
 {
-	printf("End of file\n");
+	CEventLog* log = EventLog();
+	if (log && log->Enabled(ESeverityInfo))
+	{
+		log->Add(EEventEof, ESeverityInfo, Bit(), 0, 0);
+		log->Flush();
+	}
 	fclose(iFile);
 	iFile = 0;
 }
 
+void CDecoderX::Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr)
+{
+	CEventLog* log = EventLog();
+	if (log && log->Enabled(ESeverityWarning))
+		log->Add(EEventError, ESeverityWarning, Bit(), aHdr ? aHdr->iName : 0, aBlockNum, aErr);
+}
+
+
+struct TOptions;
+
+// Saves the state of a serial decode of a WAV file every so often, so that
+// it can be restored to carry on after the process was killed, with the
+// same output as if it hadn't been
+class CResumableDecode
+{
+public:
+	CResumableDecode(const TOptions& aOpt, CWavFile* aSrc, CFrontEnd* aFrontEnd, CDemodulator* aDemod, CDecoder* aDecoder, CDecoderX* aOutput);
+	bool Restore();
+	void Tick();
+	void Done();
+	uint64_t Frame() const { return iSrc->Index(); }
+private:
+	bool State(bool aRestore);
+	void TrimLog(uint32_t aKeep);
+	double Now() const;
+private:
+	const TOptions&	iOpt;
+	CWavFile*		iSrc;
+	CFrontEnd*		iFrontEnd;		// may be 0
+	CDemodulator*	iDemod;
+	CDecoder*		iDecoder;		// fed with the bits
+	CDecoderX*		iOutput;		// writes the files, may be iDecoder
+	char			iLog[CHECKPOINT_MAX_PATH];	// names of files created
+	double			iLast;			// time of last checkpoint
+};
+
+// aFrame is the index of the first frame aSrc will give, for the event log
+// and aIndexer. aIndexer, if given, is aDecoder and is clocked after each
+// read; aResume, if given, is ticked after each read; aStats, if given,
+// gets the time taken by each stage
+void decode_serial(CSampleSource* aSrc, CFrontEnd* aFrontEnd, CDemodulator* aDemod, CDecoder* aDecoder, uint64_t aFrame, CIndexDecoder* aIndexer = 0, CResumableDecode* aResume = 0, CStats* aStats = 0)
+{
+	uint64_t frame = aFrame;
+	CEventLog* log = aDecoder->EventLog();
+	CSerialDecoder serial(aFrontEnd, aDemod, aDecoder);
+	serial.SetStats(aStats);
+	CStageTimer timer(aStats, "main");
+	for (;;)
+	{
+		const uint8_t* frames;
+		timer.Start();
+		uint32_t nFrames = aSrc->ReadFrames(frames, FRAMES_PER_READ);
+		timer.Lap(EStageRead, nFrames);
+		if (nFrames == 0)
+			break;
+		if (log)
+			log->Clock(frame + nFrames);
+		serial.Process(frames, nFrames, aSrc->BytesPerFrame(), aSrc->SampleFormat());
+		frame += nFrames;
+		if (aIndexer)
+			aIndexer->Clock(frame);
+		if (aResume)
+			aResume->Tick();
+	}
+	if (aSrc->Error())
+		fprintf(stderr, "Stopped after frame %llu: %s\n", (unsigned long long)frame, CSampleSource::ErrorText(aSrc->Error()));
+}
+
+// exit if aSrc couldn't be opened
+void check_source(const CSampleSource* aSrc, const char* aFileName)
+{
+	if (aSrc->Error())
+	{
+		fprintf(stderr, "%s: %s\n", aFileName, CSampleSource::ErrorText(aSrc->Error()));
+		exit(1);
+	}
+}
+
+struct TOptions
+{
+	TOptions();
+
+	const char* iInputName;
+	const char* iInputNames[MERGE_MAX_INPUTS];
+	uint32_t iInputCount;
+	bool iStream;
+	bool iFollow;
+	bool iRaw;
+	uint32_t iRawFs;
+	uint32_t iRawNCh;
+	TSampleFormat iRawFormat;
+	uint32_t iIdleTimeout;
+	bool iThreads;
+	uint32_t iBlockFrames;
+	uint32_t iQueueDepth;
+	CDemodulator::TEngine iEngine;
+	bool iDecimate;
+	double iTargetRate;
+	bool iGate;
+	double iPreRoll;
+	uint32_t iBank;
+	uint32_t iSplit;
+	const char* iBatch;
+	const char* iOutDir;
+	bool iNoIndex;
+	const char* iExtract;
+	int32_t iExtractBlock;
+	const char* iCheckpoint;
+	double iInterval;
+	bool iResume;
+	const char* iLogName;
+	TEventFormat iLogFormat;
+	TEventSeverity iLogLevel;
+	bool iLogAsync;
+	bool iStats;
+	const char* iTrace;
+};
+
+TOptions::TOptions()
+{
+	iInputName = 0;
+	iInputCount = 0;
+	iStream = false;
+	iFollow = false;
+	iRaw = false;
+	iRawFs = 0;
+	iRawNCh = 1;
+	iRawFormat = ESampleS16;
+	iIdleTimeout = STREAM_IDLE_TIMEOUT;
+	iThreads = false;
+	iBlockFrames = PIPELINE_BLOCK_FRAMES;
+	iQueueDepth = PIPELINE_QUEUE_DEPTH;
+	iEngine = CDemodulator::ECorrelator;
+	iDecimate = false;
+	iTargetRate = FRONTEND_TARGET_RATE;
+	iGate = false;
+	iPreRoll = GATE_PRE_ROLL / 1000.0;
+	iBank = 0;
+	iSplit = 0;
+	iBatch = 0;
+	iOutDir = ".";
+	iNoIndex = false;
+	iExtract = 0;
+	iExtractBlock = -1;
+	iCheckpoint = 0;
+	iInterval = CHECKPOINT_INTERVAL;
+	iResume = false;
+	iLogName = "-";
+	iLogFormat = EEventText;
+	iLogLevel = ESeverityInfo;
+	iLogAsync = false;
+	iStats = false;
+	iTrace = 0;
+}
+
+void usage(const char* err_msg = 0, const char* err_msg2 = 0)
+{
+	if (err_msg)
+	{
+		fprintf(stderr, "%s%s\n\n", err_msg, err_msg2 ? err_msg2 : "");
+	}
+	fprintf(stderr, "tape_reader [options] <input file> [<input file> ...]\n");
+	fprintf(stderr, "tape_reader [options] -batch <directory or list file>\n");
+	fprintf(stderr, "Several WAV files are taken to be captures of the same tape, and are merged\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "    -stream             Read input sequentially as it arrives ('-' for stdin)\n");
+	fprintf(stderr, "    -follow             Input file is still growing; wait for more data at end\n");
+	fprintf(stderr, "    -timeout <sec>      With -follow, give up after this long without growth\n");
+	fprintf(stderr, "    -raw <fs>,<bits>[,<channels>]\n");
+	fprintf(stderr, "                        Input is raw PCM, bits 8/16/24/32 or 32f for float\n");
+	fprintf(stderr, "    -demod <engine>     Demodulator engine: correlator (default), generic, sdft,\n");
+	fprintf(stderr, "                        simd, fixed, pulse\n");
+	fprintf(stderr, "    -decimate           Band-pass filter and decimate before demodulating\n");
+	fprintf(stderr, "    -rate <hz>          With -decimate, minimum internal sample rate\n");
+	fprintf(stderr, "    -gate               Only demodulate where a carrier tone is present\n");
+	fprintf(stderr, "    -preroll <ms>       With -gate, input replayed when carrier is found\n");
+	fprintf(stderr, "    -bank <n>           Run n demodulator variants in parallel (max %u) and keep\n", BANK_MAX_VARIANTS);
+	fprintf(stderr, "                        the first good copy of each block\n");
+	fprintf(stderr, "    -split <threads>    Split the input at long leaders and decode the pieces on\n");
+	fprintf(stderr, "                        this many threads\n");
+	fprintf(stderr, "    -batch <path>       Decode each WAV file in a directory, or listed one per line\n");
+	fprintf(stderr, "                        in a file, on -split threads (default one per CPU)\n");
+	fprintf(stderr, "    -out <dir>          With -batch, where to put a directory for each input and\n");
+	fprintf(stderr, "                        %s\n", BATCH_MANIFEST);
+	fprintf(stderr, "    -noindex            Don't write an index (<input file>%s) of where blocks lie\n", INDEX_SUFFIX);
+	fprintf(stderr, "    -extract <name>     Decode just this file, using the index to find it\n");
+	fprintf(stderr, "    -blocknum <n>       With -extract, decode just this block of the file\n");
+	fprintf(stderr, "    -checkpoint <file>  Save the state of the decode to this file every so often\n");
+	fprintf(stderr, "    -interval <sec>     With -checkpoint, seconds between saves (default %g)\n", CHECKPOINT_INTERVAL);
+	fprintf(stderr, "    -resume             With -checkpoint, carry on from the saved state if any\n");
+	fprintf(stderr, "    -log <file>         Write decoding events to this file ('-' for stdout, the\n");
+	fprintf(stderr, "                        default)\n");
+	fprintf(stderr, "    -logformat <fmt>    Format of events: text (default), json (JSON Lines), binary\n");
+	fprintf(stderr, "    -loglevel <level>   Least severe event logged: debug (includes every framing\n");
+	fprintf(stderr, "                        error), info (default), warning, none\n");
+	fprintf(stderr, "    -logasync           Format and write events on a separate thread\n");
+	fprintf(stderr, "    -stats              Print the time taken by each stage and what was decoded\n");
+	fprintf(stderr, "    -trace <file>       Write a timeline of the stages as a Chrome trace (JSON)\n");
+	fprintf(stderr, "    -threads            Run reader, demodulator and decoder on separate threads\n");
+	fprintf(stderr, "    -block <frames>     With -threads, frames per block passed between stages\n");
+	fprintf(stderr, "    -queue <depth>      With -threads, number of blocks queued between stages\n");
+	exit(1);
+}
+
+CResumableDecode::CResumableDecode(const TOptions& aOpt, CWavFile* aSrc, CFrontEnd* aFrontEnd, CDemodulator* aDemod, CDecoder* aDecoder, CDecoderX* aOutput)
+:	iOpt(aOpt),
+	iSrc(aSrc),
+	iFrontEnd(aFrontEnd),
+	iDemod(aDemod),
+	iDecoder(aDecoder),
+	iOutput(aOutput),
+	iLast(0)
+{
+	int n = snprintf(iLog, CHECKPOINT_MAX_PATH, "%s%s", aOpt.iCheckpoint, CHECKPOINT_LOG_SUFFIX);
+	if (n < 0 || n >= CHECKPOINT_MAX_PATH)
+	{
+		fprintf(stderr, "Checkpoint path too long: %s\n", aOpt.iCheckpoint);
+		exit(1);
+	}
+	iLast = Now();
+}
+
+double CResumableDecode::Now() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Save or restore everything, after checking that the checkpoint is for
+// the same input and the same options
+bool CResumableDecode::State(bool aRestore)
+{
+	CCheckpoint cp(iOpt.iCheckpoint, aRestore);
+	if (!cp.Open())
+		return false;
+	cp.Check(iSrc->Length());
+	cp.Check(iSrc->DataSize());
+	cp.Check(iSrc->SampleRate());
+	cp.Check((uint32_t)iOpt.iEngine);
+	cp.Check(iOpt.iDecimate);
+	cp.Check(iOpt.iTargetRate);
+	cp.Check(iOpt.iGate);
+	cp.Check(iOpt.iPreRoll);
+	cp.Check(iOpt.iNoIndex);
+	uint64_t frame = iSrc->Index();
+	cp.State(frame);
+	if (iFrontEnd)
+		iFrontEnd->Checkpoint(cp);
+	iDemod->Checkpoint(cp);
+	iDecoder->Checkpoint(cp);
+	if (iOutput != iDecoder)
+		iOutput->Checkpoint(cp);
+	if (!cp.Close())
+		return false;
+	if (aRestore)
+		iSrc->SetRange(frame, iSrc->Length());
+	return true;
+}
+
+// Carry on from the checkpoint if there is one, otherwise start afresh.
+// Returns true if a checkpoint was restored.
+bool CResumableDecode::Restore()
+{
+	FILE* f = iOpt.iResume ? fopen(iOpt.iCheckpoint, "rb") : 0;
+	if (f)
+	{
+		fclose(f);
+		if (!State(true))
+		{
+			fprintf(stderr, "Checkpoint %s is damaged, or for a different input or options\n", iOpt.iCheckpoint);
+			exit(1);
+		}
+		TrimLog(iOutput->Created());
+	}
+	FILE* log = fopen(iLog, f ? "a" : "w");
+	if (!log)
+	{
+		fprintf(stderr, "Can't open %s for write\n", iLog);
+		exit(1);
+	}
+	iOutput->SetLog(log);
+	return f != 0;
+}
+
+// Files the killed run created after its last checkpoint will be created
+// again, so remove them and drop them from the log, keeping the first aKeep
+void CResumableDecode::TrimLog(uint32_t aKeep)
+{
+	char temp[CHECKPOINT_MAX_PATH];
+	char line[CHECKPOINT_MAX_PATH];
+	int len = snprintf(temp, CHECKPOINT_MAX_PATH, "%s%s", iLog, CHECKPOINT_TEMP_SUFFIX);
+	if (len < 0 || len >= CHECKPOINT_MAX_PATH)
+	{
+		fprintf(stderr, "Checkpoint path too long: %s\n", iLog);
+		exit(1);
+	}
+	FILE* in = fopen(iLog, "r");
+	FILE* out = fopen(temp, "w");
+	if (!out)
+	{
+		fprintf(stderr, "Can't open %s for write\n", temp);
+		exit(1);
+	}
+	uint32_t n = 0;
+	while (in && fgets(line, sizeof(line), in))
+	{
+		if (n++ < aKeep)
+		{
+			fputs(line, out);
+			continue;
+		}
+		line[strcspn(line, "\r\n")] = 0;
+		remove(line);
+	}
+	if (in)
+		fclose(in);
+	fclose(out);
+#ifdef _WIN32
+	remove(iLog);
+#endif
+	rename(temp, iLog);
+}
+
+// Called after each read; saves a checkpoint once the interval has passed
+void CResumableDecode::Tick()
+{
+	double now = Now();
+	if (now - iLast < iOpt.iInterval)
+		return;
+	iLast = now;
+	if (!State(false))
+		printf("Couldn't write checkpoint %s\n", iOpt.iCheckpoint);
+}
+
+// The decode is complete, so the checkpoint is no longer needed
+void CResumableDecode::Done()
+{
+	iOutput->SetLog(0);
+	remove(iOpt.iCheckpoint);
+	remove(iLog);
+}
+
+// parse <fs>,<bits>[,<channels>] for -raw
+void parse_raw_format(TOptions& opt, const char* arg)
+{
+	char* e;
+	opt.iRawFs = strtoul(arg, &e, 10);
+	if (*e != ',' || opt.iRawFs == 0)
+		usage("Bad raw format ", arg);
+	uint32_t bits = strtoul(e+1, &e, 10);
+	bool isFloat = false;
+	if (*e == 'f')
+	{
+		isFloat = true;
+		++e;
+	}
+	switch (bits)
+	{
+	case 8: opt.iRawFormat = ESampleU8; break;
+	case 16: opt.iRawFormat = ESampleS16; break;
+	case 24: opt.iRawFormat = ESampleS24; break;
+	case 32: opt.iRawFormat = isFloat ? ESampleF32 : ESampleS32; break;
+	default: usage("Bad raw format ", arg);
+	}
+	if (isFloat && bits != 32)
+		usage("Bad raw format ", arg);
+	if (*e == ',')
+	{
+		opt.iRawNCh = strtoul(e+1, &e, 10);
+		if (opt.iRawNCh == 0)
+			usage("Bad raw format ", arg);
+	}
+	if (*e != 0)
+		usage("Bad raw format ", arg);
+}
+
+// demodulator for the selected engine, behind a carrier gate if requested;
+// the pulse engine's correlator fallback needs the decoder in the same
+// thread, so without aSameThread the pulse engine is used on its own
+CDemodulator* create_demodulator(const TOptions& opt, double aFs, uint32_t aBitsPerSample, bool aSameThread = true)
+{
+	CDemodulator* pDemod;
+	if (opt.iEngine == CDemodulator::EPulse && !aSameThread)
+		pDemod = new CPulseDemodulator(aFs);
+	else
+		pDemod = CDemodulator::New(aFs, opt.iEngine, aBitsPerSample);
+	if (opt.iGate)
+	{
+		pDemod = new CGatedDemodulator(aFs, pDemod, opt.iPreRoll);
+	}
+	return pDemod;
+}
+
+// decode each of several captures of the same tape on its own thread and
+// write one merged set of files
+int merge_captures(const TOptions& opt, CEventLog* aLog)
+{
+	uint32_t n = opt.iInputCount;
+	uint32_t i;
+	CSampleSource** srcs = new CSampleSource*[n];
+	CFrontEnd** frontEnds = new CFrontEnd*[n];
+	CDemodulator** demods = new CDemodulator*[n];
+	for (i=0; i<n; ++i)
+	{
+		printf("Capture %u: %s\n", i, opt.iInputNames[i]);
+		srcs[i] = new CWavFile(opt.iInputNames[i]);
+		check_source(srcs[i], opt.iInputNames[i]);
+		frontEnds[i] = 0;
+		double demodFs = (double)srcs[i]->SampleRate();
+		if (opt.iDecimate)
+		{
+			frontEnds[i] = new CFrontEnd(demodFs, opt.iTargetRate);
+			demodFs = frontEnds[i]->OutputRate();
+			printf("Front end decimating by %u to %g Hz\n", frontEnds[i]->Decimation(), demodFs);
+		}
+		demods[i] = create_demodulator(opt, demodFs, srcs[i]->BitsPerSample());
+	}
+	CDecoderX* pDecoder = new CDecoderX(aLog);
+	printf("Reading files...\n");
+	CCaptureMerger* pMerger = new CCaptureMerger(srcs, frontEnds, demods, opt.iInputNames, n, pDecoder);
+	pMerger->Run();
+	delete pMerger;
+	delete pDecoder;
+	return 0;
+}
+
+// front ends and demodulators for batch mode, as selected by the options
+class COptionsFactory : public CDemodFactory
+{
+public:
+	COptionsFactory(const TOptions& aOpt) : iOpt(aOpt) {}
+	virtual CFrontEnd* NewFrontEnd(double aFs)
+	{
+		return iOpt.iDecimate ? new CFrontEnd(aFs, iOpt.iTargetRate) : 0;
+	}
+	virtual CDemodulator* NewDemodulator(double aFs, uint32_t aBitsPerSample)
+	{
+		return create_demodulator(iOpt, aFs, aBitsPerSample);
+	}
+private:
+	const TOptions& iOpt;
+};
+
+// decode every WAV file in a directory or list into its own directory
+int decode_batch(const TOptions& opt)
+{
+	uint32_t threads = opt.iSplit;
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+	if (strlen(opt.iOutDir) + 1 + strlen(BATCH_MANIFEST) >= BATCH_MAX_PATH)
+	{
+		fprintf(stderr, "Output directory name too long: %s\n", opt.iOutDir);
+		exit(1);
+	}
+	COptionsFactory factory(opt);
+	CBatch* pBatch = new CBatch(opt.iOutDir, &factory, threads);
+	if (!pBatch->Add(opt.iBatch))
+	{
+		fprintf(stderr, "Can't read %s\n", opt.iBatch);
+		exit(1);
+	}
+	if (pBatch->Count() == 0)
+	{
+		fprintf(stderr, "No WAV files found in %s\n", opt.iBatch);
+		exit(1);
+	}
+	printf("Decoding %u inputs on %u threads\n", pBatch->Count(), threads);
+	bool ok = pBatch->Run();
+	delete pBatch;
+	return ok ? 0 : 1;
+}
+
+// Decode frames aStart to aEnd of aSrc with a fresh front end, demodulator
+// and decoder; if aHdr is not the first block of its file, pick the file up
+// from there
+void decode_region(CWavFile* aSrc, CDemodFactory& aFactory, uint64_t aStart, uint64_t aEnd, const SBlockHeader* aHdr, CEventLog* aLog)
+{
+	if (!aSrc->SetRange(aStart, aEnd))
+	{
+		fprintf(stderr, "Can't seek in input file\n");
+		exit(1);
+	}
+	double fs = (double)aSrc->SampleRate();
+	CFrontEnd* pFrontEnd = aFactory.NewFrontEnd(fs);
+	CDemodulator* pDemod = aFactory.NewDemodulator(pFrontEnd ? pFrontEnd->OutputRate() : fs, aSrc->BitsPerSample());
+	CDecoderX* pDecoder = new CDecoderX(aLog);
+	pDecoder->SetBitSource(pDecoder);
+	pDecoder->SetRecovery(pDemod->Recovery());
+	if (aHdr->iBlockNum > 0)
+	{
+		pDecoder->Continue(aHdr);
+		pDecoder->File(aHdr);
+	}
+	decode_serial(aSrc, pFrontEnd, pDemod, pDecoder, aSrc->Index());
+	if (aLog)
+		aLog->Flush();
+	delete pDecoder;
+	delete pDemod;
+	delete pFrontEnd;
+}
+
+// Decode file opt.iExtract, or just block opt.iExtractBlock of it, from the
+// stretches of the capture its index says it lies in. If the capture has
+// no index, or the index is out of date, it is indexed first.
+int extract_file(const TOptions& opt, CEventLog* aLog)
+{
+	CWavFile* pSrc = new CWavFile(opt.iInputName, false);
+	check_source(pSrc, opt.iInputName);
+	COptionsFactory factory(opt);
+	CTapeIndex index;
+	char path[BATCH_MAX_PATH];
+	CTapeIndex::FileName(path, sizeof(path), opt.iInputName);
+	if (!index.Read(path, pSrc))
+	{
+		printf("Indexing %s...\n", opt.iInputName);
+		double fs = (double)pSrc->SampleRate();
+		CFrontEnd* pFrontEnd = factory.NewFrontEnd(fs);
+		CDemodulator* pDemod = factory.NewDemodulator(pFrontEnd ? pFrontEnd->OutputRate() : fs, pSrc->BitsPerSample());
+		CIndexDecoder* pIndexer = new CIndexDecoder(0, &index);
+		pIndexer->SetRecovery(pDemod->Recovery());
+		decode_serial(pSrc, pFrontEnd, pDemod, pIndexer, 0, pIndexer);
+		pIndexer->Finish();
+		delete pIndexer;
+		delete pDemod;
+		delete pFrontEnd;
+		if (!opt.iNoIndex && !index.Write(path, pSrc))
+			printf("Couldn't write index %s\n", path);
+	}
+	uint64_t preRoll = (uint64_t)(INDEX_PRE_ROLL * pSrc->SampleRate());
+	uint64_t postRoll = (uint64_t)(INDEX_POST_ROLL * pSrc->SampleRate());
+	uint32_t found = 0;
+	uint32_t i = 0;
+	while (i < index.Count())
+	{
+		if (strcmp(index.Entry(i).iHdr.iName, opt.iExtract) != 0)
+		{
+			++i;
+			continue;
+		}
+		uint32_t first = i;
+		uint32_t last = index.FileEnd(i);
+		i = last + 1;
+		if (opt.iExtractBlock >= 0)
+		{
+			// the block wanted, preferring a copy which decoded
+			uint32_t j;
+			uint32_t k = last + 1;
+			for (j=first; j<=last; ++j)
+			{
+				const SIndexEntry& e = index.Entry(j);
+				if (e.iHdr.iBlockNum != opt.iExtractBlock || strcmp(e.iHdr.iName, opt.iExtract) != 0)
+					continue;
+				if (k > last || (index.Entry(k).iErr != 0 && e.iErr == 0))
+					k = j;
+			}
+			if (k > last)
+				continue;
+			first = k;
+			last = k;
+		}
+		const SIndexEntry& e0 = index.Entry(first);
+		const SIndexEntry& e1 = index.Entry(last);
+		uint64_t start = (e0.iHeader > preRoll) ? e0.iHeader - preRoll : 0;
+		// if the last header was rejected its data wasn't read, so allow
+		// for as much as it claimed
+		uint64_t end = e1.iData + (uint64_t)((e1.iHdr.iBlockLen + 2) * 10 * pSrc->SampleRate() / FREQ0);
+		if (end < e1.iEnd)
+			end = e1.iEnd;
+		end += postRoll;
+		printf("Decoding %s block %02x onwards from frames %llu to %llu\n", e0.iHdr.iName, e0.iHdr.iBlockNum,
+			(unsigned long long)start, (unsigned long long)end);
+		decode_region(pSrc, factory, start, end, &e0.iHdr, aLog);
+		++found;
+	}
+	delete pSrc;
+	if (found == 0)
+	{
+		fprintf(stderr, "%s not found in %s\n", opt.iExtract, opt.iInputName);
+		return 1;
+	}
+	return 0;
+}
+
+// Print the stage timings and decoder counts and write the trace, as the
+// options ask
+void report_stats(const TOptions& opt, const CStats* aStats, const CDecoder* aDecoder)
+{
+	if (opt.iStats)
+		aStats->Report(stdout, aDecoder);
+	if (opt.iTrace)
+	{
+		if (aStats->WriteTrace(opt.iTrace))
+			printf("Trace written to %s\n", opt.iTrace);
+		else
+			printf("Couldn't write trace %s\n", opt.iTrace);
+	}
+}
+
+// Open the event log the options ask for; 0 if nothing is to be logged
+CEventLog* open_event_log(const TOptions& opt)
+{
+	if (opt.iLogLevel == ESeverityNone)
+		return 0;
+	FILE* f = stdout;
+	if (strcmp(opt.iLogName, "-") != 0)
+	{
+		f = fopen(opt.iLogName, opt.iLogFormat == EEventBinary ? "wb" : "w");
+		if (!f)
+		{
+			fprintf(stderr, "Can't open %s for write\n", opt.iLogName);
+			exit(1);
+		}
+	}
+#ifdef _WIN32
+	else if (opt.iLogFormat == EEventBinary)
+	{
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+	return new CEventLog(f, opt.iLogFormat, opt.iLogLevel, opt.iLogAsync);
+}
 
 int main(int argc, char** argv)
 {
-    if (argc != 2)
-    {
-        fprintf(stderr, "tape_reader <input file>\n");
-        exit(1);
-    }
-	CWavFile* pWav = new CWavFile(argv[1]);
-	CDecoderX* pDecoder = new CDecoderX();
-	CDemodulator* pDemod = new CDemodulator((double)pWav->SampleRate());
-	uint8_t* frameBuf = new uint8_t[pWav->BytesPerFrame()];
+	int i;
+	TOptions opt;
+	if (argc <= 1)
+	{
+		usage();
+	}
+	for (i=1; i<argc; ++i)
+	{
+		int remain = argc - i - 1;
+		const char* arg = argv[i];
+		if (strcmp(arg, "-stream") == 0)
+		{
+			opt.iStream = true;
+			continue;
+		}
+		if (strcmp(arg, "-follow") == 0)
+		{
+			opt.iStream = true;
+			opt.iFollow = true;
+			continue;
+		}
+		if (strcmp(arg, "-timeout") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-timeout option needs argument");
+			}
+			opt.iIdleTimeout = strtoul(argv[++i], 0, 10) * 1000;
+			continue;
+		}
+		if (strcmp(arg, "-raw") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-raw option needs argument");
+			}
+			parse_raw_format(opt, argv[++i]);
+			opt.iStream = true;
+			opt.iRaw = true;
+			continue;
+		}
+		if (strcmp(arg, "-demod") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-demod option needs argument");
+			}
+			if (!CDemodulator::EngineFromName(argv[++i], opt.iEngine))
+			{
+				usage("Unrecognised demodulator engine ", argv[i]);
+			}
+			continue;
+		}
+		if (strcmp(arg, "-decimate") == 0)
+		{
+			opt.iDecimate = true;
+			continue;
+		}
+		if (strcmp(arg, "-rate") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-rate option needs argument");
+			}
+			opt.iTargetRate = strtod(argv[++i], 0);
+			if (opt.iTargetRate < 2 * FRONTEND_HIGH_CUT)
+			{
+				usage("-rate too low for band-pass filter");
+			}
+			opt.iDecimate = true;
+			continue;
+		}
+		if (strcmp(arg, "-gate") == 0)
+		{
+			opt.iGate = true;
+			continue;
+		}
+		if (strcmp(arg, "-preroll") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-preroll option needs argument");
+			}
+			opt.iPreRoll = strtod(argv[++i], 0) / 1000.0;
+			opt.iGate = true;
+			continue;
+		}
+		if (strcmp(arg, "-bank") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-bank option needs argument");
+			}
+			opt.iBank = strtoul(argv[++i], 0, 10);
+			if (opt.iBank == 0 || opt.iBank > BANK_MAX_VARIANTS)
+			{
+				usage("Bad number of variants for -bank");
+			}
+			continue;
+		}
+		if (strcmp(arg, "-split") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-split option needs argument");
+			}
+			opt.iSplit = strtoul(argv[++i], 0, 10);
+			if (opt.iSplit == 0)
+			{
+				usage("-split option needs a non-zero argument");
+			}
+			continue;
+		}
+		if (strcmp(arg, "-batch") == 0 || strcmp(arg, "-out") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage(arg, " option needs argument");
+			}
+			if (arg[1] == 'b')
+				opt.iBatch = argv[++i];
+			else
+				opt.iOutDir = argv[++i];
+			continue;
+		}
+		if (strcmp(arg, "-noindex") == 0)
+		{
+			opt.iNoIndex = true;
+			continue;
+		}
+		if (strcmp(arg, "-extract") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-extract option needs argument");
+			}
+			opt.iExtract = argv[++i];
+			continue;
+		}
+		if (strcmp(arg, "-blocknum") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-blocknum option needs argument");
+			}
+			opt.iExtractBlock = (int32_t)strtoul(argv[++i], 0, 10);
+			continue;
+		}
+		if (strcmp(arg, "-checkpoint") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-checkpoint option needs argument");
+			}
+			opt.iCheckpoint = argv[++i];
+			continue;
+		}
+		if (strcmp(arg, "-interval") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-interval option needs argument");
+			}
+			opt.iInterval = strtod(argv[++i], 0);
+			continue;
+		}
+		if (strcmp(arg, "-resume") == 0)
+		{
+			opt.iResume = true;
+			continue;
+		}
+		if (strcmp(arg, "-log") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-log option needs argument");
+			}
+			opt.iLogName = argv[++i];
+			continue;
+		}
+		if (strcmp(arg, "-logformat") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-logformat option needs argument");
+			}
+			if (!CEventLog::FormatFromName(argv[++i], opt.iLogFormat))
+			{
+				usage("Unrecognised log format ", argv[i]);
+			}
+			continue;
+		}
+		if (strcmp(arg, "-loglevel") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-loglevel option needs argument");
+			}
+			if (!CEventLog::SeverityFromName(argv[++i], opt.iLogLevel))
+			{
+				usage("Unrecognised log level ", argv[i]);
+			}
+			continue;
+		}
+		if (strcmp(arg, "-logasync") == 0)
+		{
+			opt.iLogAsync = true;
+			continue;
+		}
+		if (strcmp(arg, "-stats") == 0)
+		{
+			opt.iStats = true;
+			continue;
+		}
+		if (strcmp(arg, "-trace") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage("-trace option needs argument");
+			}
+			opt.iTrace = argv[++i];
+			continue;
+		}
+		if (strcmp(arg, "-threads") == 0)
+		{
+			opt.iThreads = true;
+			continue;
+		}
+		if (strcmp(arg, "-block") == 0 || strcmp(arg, "-queue") == 0)
+		{
+			if (remain <= 0)
+			{
+				usage(arg, " option needs argument");
+			}
+			uint32_t n = strtoul(argv[++i], 0, 10);
+			if (n == 0)
+			{
+				usage(arg, " option needs a non-zero argument");
+			}
+			if (arg[1] == 'b')
+				opt.iBlockFrames = n;
+			else
+				opt.iQueueDepth = n;
+			continue;
+		}
+		if (*arg == '-' && arg[1] != 0)
+		{
+			usage("Unrecognised option ", arg);
+		}
+		if (opt.iInputCount == MERGE_MAX_INPUTS)
+		{
+			usage("Too many input files");
+		}
+		opt.iInputNames[opt.iInputCount++] = arg;
+		opt.iInputName = opt.iInputNames[0];
+	}
+	if (opt.iResume && !opt.iCheckpoint)
+		usage("-resume needs -checkpoint");
+	if (opt.iCheckpoint && (opt.iBatch || opt.iInputCount > 1 || opt.iExtract || opt.iBank || opt.iThreads || opt.iSplit))
+		usage("-checkpoint can't be used with -batch, several inputs, -extract, -bank, -split or -threads");
+	if (opt.iCheckpoint && !CCheckpoint::PathFits(opt.iCheckpoint))
+		usage("-checkpoint path is too long");
+	if ((opt.iStats || opt.iTrace) && (opt.iBatch || opt.iInputCount > 1 || opt.iExtract || opt.iBank || opt.iSplit))
+		usage("-stats and -trace can't be used with -batch, several inputs, -extract, -bank or -split");
+	if (opt.iBatch)
+	{
+		if (opt.iInputName)
+			usage("-batch takes the place of input file names");
+		if (opt.iStream || opt.iBank || opt.iThreads || opt.iExtract)
+			usage("-batch can't be used with -stream, -raw, -bank, -threads or -extract");
+		return decode_batch(opt);
+	}
+	if (!opt.iInputName)
+		usage("Input filename not specified");
+	if (opt.iBank && opt.iThreads)
+		usage("-bank runs its own threads, so can't be used with -threads");
+	if (opt.iInputCount > 1)
+	{
+		if (opt.iStream || opt.iBank || opt.iThreads || opt.iSplit || opt.iExtract)
+			usage("Several input files can't be used with -stream, -raw, -bank, -split, -threads or -extract");
+		for (i=0; i<(int)opt.iInputCount; ++i)
+		{
+			if (strcmp(opt.iInputNames[i], "-") == 0)
+				usage("Several input files can't include stdin");
+		}
+		CEventLog* pLog = open_event_log(opt);
+		int r = merge_captures(opt, pLog);
+		delete pLog;
+		return r;
+	}
+	if (strcmp(opt.iInputName, "-") == 0)
+		opt.iStream = true;
+	if (opt.iExtractBlock >= 0 && !opt.iExtract)
+		usage("-blocknum needs -extract");
+	if (opt.iExtract)
+	{
+		if (opt.iStream || opt.iBank || opt.iThreads || opt.iSplit)
+			usage("-extract needs a WAV file, and can't be used with -bank, -split or -threads");
+		CEventLog* pLog = open_event_log(opt);
+		int r = extract_file(opt, pLog);
+		delete pLog;
+		return r;
+	}
+	if (opt.iSplit && (opt.iStream || opt.iBank || opt.iThreads))
+		usage("-split needs a WAV file, and can't be used with -bank or -threads");
+	if (opt.iCheckpoint && opt.iStream)
+		usage("-checkpoint needs a WAV file");
+
+	CSampleSource* pSrc;
+	if (opt.iStream)
+	{
+		CPcmStream* pStream;
+		if (opt.iRaw)
+			pStream = new CPcmStream(opt.iInputName, opt.iFollow, opt.iRawFs, opt.iRawNCh, opt.iRawFormat);
+		else
+			pStream = new CPcmStream(opt.iInputName, opt.iFollow, opt.iIdleTimeout);
+		check_source(pStream, opt.iInputName);
+		pStream->SetIdleTimeout(opt.iIdleTimeout);
+		printf("Streaming %s from %s:\n", opt.iRaw ? "raw PCM" : "WAV", pStream->Stdin() ? "stdin" : opt.iInputName);
+		printf("Fs           = %u\n", pStream->SampleRate());
+		printf("#Channels    = %u\n", pStream->NumChannels());
+		printf("Bits/sample  = %u%s\n", pStream->BitsPerSample(), pStream->SampleFormat() == ESampleF32 ? " (float)" : "");
+		printf("Bytes/frame  = %u\n", pStream->BytesPerFrame());
+		printf("Follow       = %s\n", pStream->Following() ? "yes" : "no");
+		pSrc = pStream;
+	}
+	else
+	{
+		pSrc = new CWavFile(opt.iInputName);
+		check_source(pSrc, opt.iInputName);
+	}
+	CEventLog* pLog = open_event_log(opt);
+	CDecoderX* pDecoder = new CDecoderX(pLog);
+	CFrontEnd* pFrontEnd = 0;
+	double demodFs = (double)pSrc->SampleRate();
+	if (opt.iDecimate)
+	{
+		pFrontEnd = new CFrontEnd(demodFs, opt.iTargetRate);
+		demodFs = pFrontEnd->OutputRate();
+		printf("Front end decimating by %u to %g Hz\n", pFrontEnd->Decimation(), demodFs);
+	}
+	if (opt.iBank)
+	{
+		CDemodulator** demods = new CDemodulator*[opt.iBank];
+		for (i=0; i<(int)opt.iBank; ++i)
+		{
+			const SDemodVariant& v = CDemodulatorBank::Variant(i);
+			demods[i] = create_demodulator(opt, demodFs / v.iSpeed, pSrc->BitsPerSample());
+			demods[i]->Tune(v.iBias, v.iPhase);
+		}
+	    printf("Reading file...\n");
+		CDemodulatorBank* pBank = new CDemodulatorBank(pSrc, pFrontEnd, pDecoder, demods, opt.iBank, demodFs);
+		pBank->Run();
+		delete pBank;
+		delete pFrontEnd;
+		delete pDecoder;
+		delete pLog;
+		delete pSrc;
+		return 0;
+	}
+	if (opt.iSplit && !((CWavFile*)pSrc)->IsMapped())
+	{
+		printf("Input file couldn't be mapped, so won't be split\n");
+		opt.iSplit = 0;
+	}
+	if (opt.iSplit)
+	{
+		uint32_t align = pFrontEnd ? pFrontEnd->Decimation() : 1;
+		CSegmenter* pSegmenter = new CSegmenter((CWavFile*)pSrc, pDecoder, opt.iSplit, align);
+		uint32_t n = pSegmenter->Split();
+		CFrontEnd** frontEnds = new CFrontEnd*[n];
+		CDemodulator** demods = new CDemodulator*[n];
+		for (i=0; i<(int)n; ++i)
+		{
+			frontEnds[i] = pFrontEnd ? new CFrontEnd((double)pSrc->SampleRate(), opt.iTargetRate) : 0;
+			demods[i] = create_demodulator(opt, demodFs, pSrc->BitsPerSample());
+		}
+	    printf("Reading file...\n");
+		printf("Decoding %u segments on %u threads\n", n, pSegmenter->Threads());
+		pSegmenter->Run(frontEnds, demods);
+		delete[] demods;
+		delete[] frontEnds;
+		delete pSegmenter;
+		delete pFrontEnd;
+		delete pDecoder;
+		delete pLog;
+		delete pSrc;
+		return 0;
+	}
+	CDemodulator* pDemod = create_demodulator(opt, demodFs, pSrc->BitsPerSample(), !opt.iThreads);
+	CStats* pStats = (opt.iStats || opt.iTrace) ? new CStats(opt.iTrace != 0) : 0;
     printf("Reading file...\n");
 
-	while (pWav->Remain())
+	if (opt.iThreads)
 	{
-		pWav->ReadSamples(frameBuf, 1);
-		int32_t sample = pWav->GetSample(frameBuf, 0, 0);
-		int bit = pDemod->Sample(sample);
-		if (bit != NO_BIT)
+		if (opt.iEngine == CDemodulator::EPulse)
+		{
+			printf("Correlator fallback not available with -threads\n");
+		}
+		pDecoder->SetBitSource(pDecoder);
+		CPipeline* pPipe = new CPipeline(pSrc, pFrontEnd, pDemod, pDecoder, opt.iBlockFrames, opt.iQueueDepth);
+		pPipe->SetStats(pStats);
+		pPipe->Run();
+		delete pPipe;
+		if (pStats)
+			report_stats(opt, pStats, pDecoder);
+	}
+	else
+	{
+		// index the capture as it is decoded, for -extract
+		CTapeIndex index;
+		CIndexDecoder* pIndexer = (!opt.iStream && !opt.iNoIndex) ? new CIndexDecoder(pDecoder, &index) : 0;
+		CDecoder* pBitDecoder = pIndexer ? (CDecoder*)pIndexer : (CDecoder*)pDecoder;
+		pBitDecoder->SetRecovery(pDemod->Recovery());
+		pBitDecoder->SetEventLog(pLog);
+		pDecoder->SetBitSource(pBitDecoder);
+		CResumableDecode* pResume = 0;
+		if (opt.iCheckpoint)
+		{
+			pResume = new CResumableDecode(opt, (CWavFile*)pSrc, pFrontEnd, pDemod, pBitDecoder, pDecoder);
+			if (pResume->Restore())
+				printf("Resuming from frame %llu\n", (unsigned long long)pResume->Frame());
+		}
+		decode_serial(pSrc, pFrontEnd, pDemod, pBitDecoder, pResume ? pResume->Frame() : 0, pIndexer, pResume, pStats);
+		if (pLog)
+			pLog->Flush();
+		if (pStats)
+			report_stats(opt, pStats, pBitDecoder);
+		if (pIndexer)
+		{
+			pIndexer->Finish();
+			delete pIndexer;
+			char path[BATCH_MAX_PATH];
+			CTapeIndex::FileName(path, sizeof(path), opt.iInputName);
+			if (index.Write(path, (CWavFile*)pSrc))
+				printf("Index of %u blocks written to %s\n", index.Count(), path);
+			else
+				printf("Couldn't write index %s\n", path);
+		}
+		if (pResume)
 		{
-			pDecoder->Bit((uint32_t)bit);
+			pResume->Done();
+			delete pResume;
 		}
 	}
-	delete[] frameBuf;
+	delete pStats;
 	delete pDemod;
+	delete pFrontEnd;
 	delete pDecoder;
-	delete pWav;
+	delete pLog;
+	delete pSrc;
 	return 0;
 }
@@ -0,0 +1,240 @@
+/*
+* C interface to the tape decoding library
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <new>
+#include "wav.h"
+#include "demod.h"
+#include "decoder.h"
+#include "frontend.h"
+#include "gate.h"
+#include "serial.h"
+#include "tapereader.h"
+
+#define	TR_FRAMES_PER_READ	(4096)		// frames taken from a WAV file at a time
+
+// the C types are views of the C++ ones, so must match them exactly
+static_assert((int)TR_ERR_FORMAT == (int)EWavFormat, "tr_status must extend TWavError");
+static_assert((int)TR_SAMPLE_F32 == (int)ESampleF32, "tr_sample_format must match TSampleFormat");
+static_assert((int)TR_ENGINE_PULSE == (int)CDemodulator::EPulse, "tr_engine must match CDemodulator::TEngine");
+static_assert(TR_BLOCK_TRUNCATED_HEADER == CDecoder::ETruncatedHeader, "TR_BLOCK_xxx must match CDecoder::TError");
+static_assert(sizeof(tr_block_header) == sizeof(SBlockHeader), "tr_block_header must match SBlockHeader");
+static_assert(offsetof(tr_block_header, load_addr) == offsetof(SBlockHeader, iLoadAddr), "tr_block_header must match SBlockHeader");
+static_assert(offsetof(tr_block_header, block_num) == offsetof(SBlockHeader, iBlockNum), "tr_block_header must match SBlockHeader");
+static_assert(offsetof(tr_block_header, next_file) == offsetof(SBlockHeader, iNextFile), "tr_block_header must match SBlockHeader");
+static_assert(offsetof(tr_block_header, block_flag) == offsetof(SBlockHeader, iBlockFlag), "tr_block_header must match SBlockHeader");
+static_assert(offsetof(tr_block_header, speed) == offsetof(SBlockHeader, iSpeed), "tr_block_header must match SBlockHeader");
+static_assert(offsetof(tr_block_header, quality) == offsetof(SBlockHeader, iQuality), "tr_block_header must match SBlockHeader");
+static_assert(sizeof(tr_signal_quality) == sizeof(SBlockQuality), "tr_signal_quality must match SBlockQuality");
+static_assert(offsetof(tr_signal_quality, bits) == offsetof(SBlockQuality, iBits), "tr_signal_quality must match SBlockQuality");
+static_assert(offsetof(tr_signal_quality, margin_bins) == offsetof(SBlockQuality, iMarginBins), "tr_signal_quality must match SBlockQuality");
+static_assert(TR_QUALITY_MARGIN_BINS == QUALITY_MARGIN_BINS, "tr_signal_quality must match SBlockQuality");
+
+inline const tr_block_header* View(const SBlockHeader* aHdr)
+{
+	return (const tr_block_header*)aHdr;
+}
+
+// passes the decoder's events to the caller's sinks
+class CSinkDecoder : public CDecoder
+{
+public:
+	CSinkDecoder(const tr_sinks& aSinks) : iSinks(aSinks) {}
+	virtual void Block(const SBlockHeader* aHdr, const uint8_t* aData)
+	{
+		if (iSinks.block)
+			iSinks.block(iSinks.context, View(aHdr), aData);
+	}
+	virtual void File(const SBlockHeader* aHdr)
+	{
+		if (iSinks.file)
+			iSinks.file(iSinks.context, View(aHdr));
+	}
+	virtual void Eof()
+	{
+		if (iSinks.eof)
+			iSinks.eof(iSinks.context);
+	}
+	virtual void BadBlock(const SBlockHeader* aHdr, const uint8_t* aData, const uint8_t* aConf)
+	{
+		if (iSinks.bad_block)
+			iSinks.bad_block(iSinks.context, View(aHdr), aData, aConf);
+	}
+	virtual void Error(uint32_t aBlockNum, uint32_t aErr, const SBlockHeader* aHdr)
+	{
+		if (iSinks.error)
+			iSinks.error(iSinks.context, aBlockNum, aErr, View(aHdr));
+	}
+private:
+	tr_sinks		iSinks;
+};
+
+struct tr_decoder
+{
+	CSinkDecoder*	iDecoder;
+	CFrontEnd*		iFrontEnd;		// may be 0
+	CDemodulator*	iDemod;
+	CSerialDecoder*	iSerial;
+	uint32_t		iStride;		// bytes per frame
+	TSampleFormat	iFormat;
+};
+
+const char* tr_status_text(tr_status status)
+{
+	switch (status)
+	{
+	case TR_ERR_ARGUMENT: return "invalid argument";
+	case TR_ERR_MEMORY: return "out of memory";
+	default: return CSampleSource::ErrorText((TWavError)status);
+	}
+}
+
+void tr_default_options(tr_options* options)
+{
+	if (!options)
+		return;
+	options->engine = TR_ENGINE_CORRELATOR;
+	options->decimate = 0;
+	options->target_rate = FRONTEND_TARGET_RATE;
+	options->gate = 0;
+	options->pre_roll = GATE_PRE_ROLL / 1000.0;
+}
+
+void tr_destroy(tr_decoder* decoder)
+{
+	if (!decoder)
+		return;
+	delete decoder->iSerial;
+	delete decoder->iDemod;
+	delete decoder->iFrontEnd;
+	delete decoder->iDecoder;
+	delete decoder;
+}
+
+tr_status tr_create(tr_decoder** decoder, uint32_t sample_rate, uint32_t channels, tr_sample_format format, const tr_options* options, const tr_sinks* sinks)
+{
+	if (!decoder)
+		return TR_ERR_ARGUMENT;
+	*decoder = 0;
+	tr_options opt;
+	tr_default_options(&opt);
+	if (options)
+		opt = *options;
+	if (!sinks || sample_rate == 0 || channels == 0 || channels > 0xFFFF
+		|| (uint32_t)format > TR_SAMPLE_F32 || (uint32_t)opt.engine > TR_ENGINE_PULSE
+		|| (opt.decimate && opt.target_rate <= 0) || (opt.gate && opt.pre_roll < 0))
+		return TR_ERR_ARGUMENT;
+	static const uint32_t bytes[] = { 1, 2, 3, 4, 4 };
+	tr_decoder* d = new(std::nothrow) tr_decoder();
+	if (!d)
+		return TR_ERR_MEMORY;
+	try
+	{
+		d->iStride = bytes[format] * channels;
+		d->iFormat = (TSampleFormat)format;
+		d->iDecoder = new CSinkDecoder(*sinks);
+		double fs = (double)sample_rate;
+		if (opt.decimate)
+		{
+			d->iFrontEnd = new CFrontEnd(fs, opt.target_rate);
+			fs = d->iFrontEnd->OutputRate();
+		}
+		d->iDemod = CDemodulator::New(fs, (CDemodulator::TEngine)opt.engine, bytes[format] << 3);
+		if (opt.gate)
+			d->iDemod = new CGatedDemodulator(fs, d->iDemod, opt.pre_roll);
+		d->iDecoder->SetRecovery(d->iDemod->Recovery());
+		d->iSerial = new CSerialDecoder(d->iFrontEnd, d->iDemod, d->iDecoder);
+	}
+	catch (const std::bad_alloc&)
+	{
+		tr_destroy(d);
+		return TR_ERR_MEMORY;
+	}
+	*decoder = d;
+	return TR_OK;
+}
+
+tr_status tr_write(tr_decoder* decoder, const void* frames, size_t count)
+{
+	if (!decoder || (!frames && count))
+		return TR_ERR_ARGUMENT;
+	const uint8_t* p = (const uint8_t*)frames;
+	try
+	{
+		while (count)
+		{
+			uint32_t n = count < TR_FRAMES_PER_READ ? (uint32_t)count : TR_FRAMES_PER_READ;
+			decoder->iSerial->Process(p, n, decoder->iStride, decoder->iFormat);
+			p += (size_t)n * decoder->iStride;
+			count -= n;
+		}
+	}
+	catch (const std::bad_alloc&)
+	{
+		return TR_ERR_MEMORY;
+	}
+	return TR_OK;
+}
+
+tr_status tr_decode_buffer(const void* frames, size_t count, uint32_t sample_rate, uint32_t channels, tr_sample_format format, const tr_options* options, const tr_sinks* sinks)
+{
+	tr_decoder* d;
+	tr_status status = tr_create(&d, sample_rate, channels, format, options, sinks);
+	if (status != TR_OK)
+		return status;
+	status = tr_write(d, frames, count);
+	tr_destroy(d);
+	return status;
+}
+
+tr_status tr_decode_wav(const char* path, const tr_options* options, const tr_sinks* sinks)
+{
+	if (!path)
+		return TR_ERR_ARGUMENT;
+	CWavFile* src = 0;
+	try
+	{
+		src = new CWavFile(path, false);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return TR_ERR_MEMORY;
+	}
+	tr_decoder* d = 0;
+	tr_status status = (tr_status)src->Error();
+	if (status == TR_OK)
+		status = tr_create(&d, src->SampleRate(), src->NumChannels(), (tr_sample_format)src->SampleFormat(), options, sinks);
+	while (status == TR_OK)
+	{
+		const uint8_t* frames;
+		uint32_t n = src->ReadFrames(frames, TR_FRAMES_PER_READ);
+		if (n == 0)
+		{
+			status = (tr_status)src->Error();
+			break;
+		}
+		status = tr_write(d, frames, n);
+	}
+	tr_destroy(d);
+	delete src;
+	return status;
+}
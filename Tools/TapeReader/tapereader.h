@@ -0,0 +1,173 @@
+/*
+* C interface to the tape decoding library
+*
+* Copyright 2021, Dennis May
+* First Published 2021
+*
+* This file is part of Miscellaneous Electron Software.
+*
+* Miscellaneous Electron Software is free software: you can redistribute it
+* and/or modify it under the terms of the GNU General Public License as
+* published by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Miscellaneous Electron Software is distributed in the hope that it will be
+* useful, but WITHOUT ANY WARRANTY* without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* Miscellaneous Electron Software.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* libtapereader decodes Acorn Electron and BBC Micro cassette recordings in
+* process. Samples are given either as a WAV file, which is memory mapped
+* where possible, or as buffers of PCM frames already in memory, pushed in
+* as they arrive. Nothing is printed and nothing is written to disk: each
+* file, block and error found is passed to the caller's sinks, and every
+* function returns a status code. The headers and data given to a sink
+* point straight into the decoder's buffers and are only valid until the
+* sink returns. Only the first channel of the input is decoded.
+*
+* The C++ classes behind this interface (CWavFile, CDecoder, CSegmenter,
+* CBatch and so on) can also be used directly from C++.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define	TR_API_VERSION		(2)			// changes whenever this interface does
+
+// block error bits passed to tr_sinks.error, as CDecoder::TError
+#define	TR_BLOCK_INVALID_NAME		(1U<<0)
+#define	TR_BLOCK_INVALID_LENGTH		(1U<<1)
+#define	TR_BLOCK_INVALID_FLAG		(1U<<2)
+#define	TR_BLOCK_INVALID_HDR_CRC	(1U<<3)
+#define	TR_BLOCK_INVALID_DATA_CRC	(1U<<4)
+#define	TR_BLOCK_UNEXPECTED			(1U<<5)
+#define	TR_BLOCK_SKIPPED			(1U<<6)
+#define	TR_BLOCK_REPEATED			(1U<<7)
+#define	TR_BLOCK_TRUNCATED			(1U<<8)
+#define	TR_BLOCK_TRUNCATED_HEADER	(1U<<9)
+
+#define	TR_QUALITY_MARGIN_BINS		(8)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum tr_status
+{
+	TR_OK = 0,
+	TR_ERR_OPEN = 1,				// file couldn't be opened
+	TR_ERR_READ = 2,				// read failed, or file too small
+	TR_ERR_NOT_WAV = 3,				// not a RIFF, RF64 or BW64 WAVE file
+	TR_ERR_NO_SECTION = 4,			// fmt or data chunk missing
+	TR_ERR_FORMAT = 5,				// sample format not supported
+	TR_ERR_ARGUMENT = 6,			// null pointer or value out of range
+	TR_ERR_MEMORY = 7,				// out of memory
+} tr_status;
+
+typedef enum tr_sample_format
+{
+	TR_SAMPLE_U8 = 0,				// 8 bit unsigned PCM (offset 128)
+	TR_SAMPLE_S16 = 1,				// 16 bit signed little endian PCM
+	TR_SAMPLE_S24 = 2,				// 24 bit signed little endian PCM, packed
+	TR_SAMPLE_S32 = 3,				// 32 bit signed little endian PCM
+	TR_SAMPLE_F32 = 4,				// 32 bit IEEE float, little endian
+} tr_sample_format;
+
+typedef enum tr_engine
+{
+	TR_ENGINE_CORRELATOR = 0,		// direct correlation against reference tables
+	TR_ENGINE_SDFT = 1,				// recursive sliding DFT
+	TR_ENGINE_SIMD = 2,				// block correlator using float SIMD kernels
+	TR_ENGINE_FIXED = 3,			// integer correlator
+	TR_ENGINE_GENERIC = 4,			// correlator with run time tables even at standard rates
+	TR_ENGINE_PULSE = 5,			// zero crossing pulse width, correlator on CRC failure
+} tr_engine;
+
+typedef struct tr_options
+{
+	tr_engine	engine;
+	int			decimate;			// non-zero to band-pass and decimate first
+	double		target_rate;		// lowest rate to decimate to, in Hz
+	int			gate;				// non-zero to skip silence and speech
+	double		pre_roll;			// seconds replayed when the gate opens
+} tr_options;
+
+/*
+* Signal quality measured by the demodulator from a block's leader to its
+* end. Levels are in the units of a sample of the input format (float is
+* scaled so that 1.0 is 2^23). margin_bins counts bit decisions by how far
+* the discriminant was from the threshold, in steps of a quarter of its
+* running average; many decisions in the low bins mean the block nearly
+* failed. jitter is the RMS symbol clock error at 1 to 0 transitions, and
+* resyncs the transitions too far out to track.
+*/
+typedef struct tr_signal_quality
+{
+	double		snr;				// decision margin mean squared over its variance, in dB
+	double		jitter;				// in symbols
+	double		dc_offset;			// mean sample value
+	double		level;				// RMS sample value about dc_offset
+	double		peak;				// largest sample magnitude
+	uint32_t	bits;				// bit decisions
+	uint32_t	resyncs;
+	uint32_t	margin_bins[TR_QUALITY_MARGIN_BINS];
+} tr_signal_quality;
+
+// header of a block, laid out as the decoder holds it
+typedef struct tr_block_header
+{
+	char		name[11];			// nul terminated
+	uint32_t	load_addr;
+	uint32_t	exec_addr;
+	uint16_t	block_num;
+	uint16_t	block_len;			// bytes of data in the block
+	uint32_t	next_file;
+	uint8_t		block_flag;			// bit 7 set on the last block of a file
+	double		speed;				// tape speed relative to nominal, 0 if unknown
+	tr_signal_quality	quality;	// all 0 if unknown
+} tr_block_header;
+
+/*
+* Receivers for what the decoder finds; any may be 0. context is passed
+* back to each. file is called at the first block of each file, block for
+* each good block (with header->block_len bytes of data) and eof after the
+* last block of a file. bad_block gives the data of a block which failed its
+* CRC check with the confidence of each bit (0 to 255, 0 if never received),
+* error reports a lost or damaged block with TR_BLOCK_xxx bits and its
+* header if one was read, otherwise 0.
+*/
+typedef struct tr_sinks
+{
+	void*	context;
+	void	(*file)(void* context, const tr_block_header* header);
+	void	(*block)(void* context, const tr_block_header* header, const uint8_t* data);
+	void	(*eof)(void* context);
+	void	(*bad_block)(void* context, const tr_block_header* header, const uint8_t* data, const uint8_t* confidence);
+	void	(*error)(void* context, uint32_t block_num, uint32_t errors, const tr_block_header* header);
+} tr_sinks;
+
+typedef struct tr_decoder tr_decoder;
+
+const char* tr_status_text(tr_status status);
+void tr_default_options(tr_options* options);
+
+// Decode a WAV file from start to end. The options may be 0 for the defaults.
+tr_status tr_decode_wav(const char* path, const tr_options* options, const tr_sinks* sinks);
+
+// Decode count interleaved frames held in memory, all at once
+tr_status tr_decode_buffer(const void* frames, size_t count, uint32_t sample_rate, uint32_t channels, tr_sample_format format, const tr_options* options, const tr_sinks* sinks);
+
+// Make a decoder to be given frames in order with tr_write(), from any
+// number of buffers of any size; the sinks are called from tr_write()
+tr_status tr_create(tr_decoder** decoder, uint32_t sample_rate, uint32_t channels, tr_sample_format format, const tr_options* options, const tr_sinks* sinks);
+tr_status tr_write(tr_decoder* decoder, const void* frames, size_t count);
+void tr_destroy(tr_decoder* decoder);
+
+#ifdef __cplusplus
+}
+#endif
@@ -21,127 +21,768 @@
 */
 
 #include "wav.h"
+#include "cpu.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-CWavFile::CWavFile(const char* aFileName)
-:	iTotalSize(0),
+#define	READ_BUF_SIZE	(65536)			// size of buffer used by ReadFrames() if file can't be mapped
+
+// Seek forward aCount bytes. For streams which can't seek, read and discard.
+static bool SkipBytes(FILE* aFile, uint64_t aCount)
+{
+#ifdef _WIN32
+	if (_fseeki64(aFile, (__int64)aCount, SEEK_CUR) == 0)
+		return true;
+#else
+	if (fseeko(aFile, (off_t)aCount, SEEK_CUR) == 0)
+		return true;
+#endif
+	uint8_t buf[4096];
+	while (aCount)
+	{
+		size_t n = aCount < sizeof(buf) ? (size_t)aCount : sizeof(buf);
+		if (fread(buf, 1, n, aFile) != n)
+			return false;
+		aCount -= n;
+	}
+	return true;
+}
+
+// Return size of file in bytes, or 0 if not known (e.g. a pipe)
+static uint64_t FileSize(FILE* aFile)
+{
+#ifdef _WIN32
+	struct _stati64 st;
+	if (_fstati64(_fileno(aFile), &st) != 0 || !(st.st_mode & _S_IFREG))
+		return 0;
+#else
+	struct stat st;
+	if (fstat(fileno(aFile), &st) != 0 || !S_ISREG(st.st_mode))
+		return 0;
+#endif
+	return (uint64_t)st.st_size;
+}
+
+// GUID tail common to all KSDATAFORMAT_SUBTYPE_xxx values
+static const uint8_t KSubFormatGuidTail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 };
+
+#define	WAVE_FORMAT_PCM			(0x0001)
+#define	WAVE_FORMAT_IEEE_FLOAT	(0x0003)
+#define	WAVE_FORMAT_EXTENSIBLE	(0xFFFE)
+
+CSampleSource::CSampleSource()
+:	iError(EWavOk),
+	iTotalSize(0),
 	iFs(0),
 	iNCh(0),
 	iBitsPerSample(0),
 	iBytesPerSample(0),
 	iBytesPerFrame(0),
-	iLength(0),
-	iIndex(0),
-	iFile(0)
+	iFormat(ESampleS16),
+	iDataSize(0),
+	iBytesPerSec(0),
+	iFmtSection(0),
+	iFmtLen(0),
+	iDataOffset(0),
+	iRf64(false)
 {
-	iFile = fopen(aFileName, "rb");
-	if (!iFile)
+}
+
+CSampleSource::~CSampleSource()
+{
+	delete[] iFmtSection;
+}
+
+const char* CSampleSource::ErrorText(TWavError aError)
+{
+	switch (aError)
+	{
+	case EWavOk: return "no error";
+	case EWavOpen: return "can't open file for read";
+	case EWavRead: return "problem reading file (or file too small)";
+	case EWavNotWav: return "not a valid WAV file";
+	case EWavNoSection: return "WAV file format or data section not found";
+	case EWavFormat: return "unrecognized format";
+	}
+	return "unknown error";
+}
+
+// magnitude of a full scale sample, as GetSamples() gives it
+double CSampleSource::FullScale() const
+{
+	switch (iFormat)
 	{
-		fprintf(stderr, "Can't open file %s for read\n", aFileName);
-		exit(1);
+	case ESampleU8: return 128.0;
+	case ESampleS16: return 32768.0;
+	case ESampleS32: return 2147483648.0;
+	default: return 8388608.0;
 	}
-	char hdrBuf[20];
-	size_t r = fread(hdrBuf, 1, sizeof(hdrBuf), iFile);
+}
+
+void CSampleSource::SetFormat(uint32_t aFs, uint32_t aNCh, TSampleFormat aFormat)
+{
+	static const uint16_t bytes[] = { 1, 2, 3, 4, 4 };
+	iFs = aFs;
+	iNCh = (uint16_t)aNCh;
+	iFormat = aFormat;
+	iBytesPerSample = bytes[aFormat];
+	iBitsPerSample = iBytesPerSample << 3;
+	iBytesPerFrame = iBytesPerSample * iNCh;
+	iBytesPerSec = iBytesPerFrame * iFs;
+}
+
+/*
+* Walk the RIFF chunks up to the data chunk. Chunks other than fmt, ds64
+* and data (LIST, bext, fact, JUNK etc.) are skipped. RF64 and BW64 files
+* take their sizes from the ds64 chunk. On return aFile is positioned at
+* the start of the data. Returns false, with iError set, if the header
+* isn't valid.
+*/
+bool CSampleSource::ReadWavHeader(FILE* aFile)
+{
+	// start afresh, as a stream may read a partly written header again
+	delete[] iFmtSection;
+	iFmtSection = 0;
+	iRf64 = false;
+	iError = EWavOk;
+
+	char hdrBuf[12];
+	size_t r = fread(hdrBuf, 1, sizeof(hdrBuf), aFile);
 	if (r != sizeof(hdrBuf))
 	{
 read_error:
-		fprintf(stderr, "Problem reading file %s (or file too small)\n", aFileName);
-		exit(1);
+		iError = EWavRead;
+		return false;
+	}
+	if (memcmp(hdrBuf, "RF64", 4) == 0 || memcmp(hdrBuf, "BW64", 4) == 0)
+	{
+		iRf64 = true;
 	}
-	if (memcmp(hdrBuf, "RIFF", 4) != 0)
+	else if (memcmp(hdrBuf, "RIFF", 4) != 0)
 	{
 not_valid_wav:
-		fprintf(stderr, "File %s is not a valid WAV file\n", aFileName);
-		exit(1);
+		iError = EWavNotWav;
+		return false;
 	}
 	iTotalSize = GetUInt32LE(hdrBuf + 4);
-	if (memcmp(hdrBuf+8, "WAVEfmt ", 8) != 0)
+	if (memcmp(hdrBuf+8, "WAVE", 4) != 0)
 		goto not_valid_wav;
 
-	uint32_t fmtLen = GetUInt32LE(hdrBuf + 16);
-	iFmtSection = new uint8_t[fmtLen];
-	r = fread(iFmtSection, 1, fmtLen, iFile);
-	if (r != fmtLen)
-		goto read_error;
-	if (fmtLen != 16)
+	uint32_t type = 0;
+	uint64_t offset = sizeof(hdrBuf);
+	uint64_t ds64DataSize = 0;
+	bool haveDs64 = false;
+	bool haveData = false;
+	while (!haveData)
 	{
-fmt_unrec:
-		fprintf(stderr, "File %s has unrecognized format\n", aFileName);
-		exit(1);
+		char ckHdr[8];
+		r = fread(ckHdr, 1, sizeof(ckHdr), aFile);
+		if (r != sizeof(ckHdr))
+		{
+			iError = EWavNoSection;
+			return false;
+		}
+		offset += sizeof(ckHdr);
+		uint64_t ckLen = GetUInt32LE(ckHdr + 4);
+		if (memcmp(ckHdr, "ds64", 4) == 0 && iRf64)
+		{
+			uint8_t ds64[24];
+			if (ckLen < sizeof(ds64))
+				goto not_valid_wav;
+			r = fread(ds64, 1, sizeof(ds64), aFile);
+			if (r != sizeof(ds64))
+				goto read_error;
+			iTotalSize = GetUInt64LE(ds64);
+			ds64DataSize = GetUInt64LE(ds64 + 8);
+			haveDs64 = true;
+			if (!SkipBytes(aFile, ckLen - sizeof(ds64) + (ckLen & 1)))
+				goto read_error;
+		}
+		else if (memcmp(ckHdr, "fmt ", 4) == 0)
+		{
+			if (iFmtSection || ckLen < 16 || ckLen > 65536)
+				goto fmt_unrec;
+			iFmtLen = (uint32_t)ckLen;
+			iFmtSection = new uint8_t[iFmtLen];
+			r = fread(iFmtSection, 1, iFmtLen, aFile);
+			if (r != iFmtLen)
+				goto read_error;
+			if ((ckLen & 1) && !SkipBytes(aFile, 1))
+				goto read_error;
+		}
+		else if (memcmp(ckHdr, "data", 4) == 0)
+		{
+			if (!iFmtSection)
+			{
+				iError = EWavNoSection;
+				return false;
+			}
+			iDataSize = ckLen;
+			if (iRf64 && ckLen == 0xFFFFFFFFU)
+			{
+				if (!haveDs64)
+					goto not_valid_wav;
+				iDataSize = ds64DataSize;
+			}
+			iDataOffset = offset;
+			haveData = true;
+		}
+		else
+		{
+			if (!SkipBytes(aFile, ckLen + (ckLen & 1)))
+				goto read_error;
+		}
+		if (!haveData)
+			offset += ckLen + (ckLen & 1);
 	}
-	uint32_t type = GetUInt16LE(iFmtSection);
-	if (type != 1)
-		goto fmt_unrec;
+
+	type = GetUInt16LE(iFmtSection);
 	iNCh = GetUInt16LE(iFmtSection + 2);
 	iFs = GetUInt32LE(iFmtSection + 4);
 	iBytesPerSec = GetUInt32LE(iFmtSection + 8);
 	iBytesPerFrame = GetUInt16LE(iFmtSection + 12);
 	iBitsPerSample = GetUInt16LE(iFmtSection + 14);
+	if (type == WAVE_FORMAT_EXTENSIBLE)
+	{
+		// cbSize, wValidBitsPerSample, dwChannelMask, SubFormat GUID
+		if (iFmtLen < 40 || GetUInt16LE(iFmtSection + 16) < 22)
+			goto fmt_unrec;
+		if (memcmp(iFmtSection + 26, KSubFormatGuidTail, sizeof(KSubFormatGuidTail)) != 0)
+			goto fmt_unrec;
+		type = GetUInt16LE(iFmtSection + 24);
+	}
 	iBytesPerSample = (iBitsPerSample + 7) >> 3;
 	iBitsPerSample = iBytesPerSample << 3;
-	if (iBytesPerFrame != iBytesPerSample * iNCh)
+	if (iNCh == 0 || iFs == 0 || iBytesPerFrame != iBytesPerSample * iNCh)
 		goto fmt_unrec;
+	if (type == WAVE_FORMAT_PCM)
+	{
+		switch (iBytesPerSample)
+		{
+		case 1: iFormat = ESampleU8; break;
+		case 2: iFormat = ESampleS16; break;
+		case 3: iFormat = ESampleS24; break;
+		case 4: iFormat = ESampleS32; break;
+		default: goto fmt_unrec;
+		}
+	}
+	else if (type == WAVE_FORMAT_IEEE_FLOAT && iBytesPerSample == 4)
+	{
+		iFormat = ESampleF32;
+	}
+	else
+	{
+fmt_unrec:
+		iError = EWavFormat;
+		return false;
+	}
+	return true;
+}
 
-	char dsHdr[8];
-	r = fread(dsHdr, 1, sizeof(dsHdr), iFile);
-	if (r != sizeof(dsHdr))
-		goto read_error;
-	if (memcmp(dsHdr, "data", 4) != 0)
+/*
+* If the data size is unknown or larger than the file (header not yet fixed
+* up by the recorder) the data is assumed to run to the end of the file.
+* The header details, and any such inconsistency, are printed if aVerbose is
+* set. If the file can't be opened or its header isn't valid, Error() says
+* why and there are no frames to read.
+*/
+CWavFile::CWavFile(const char* aFileName, bool aVerbose)
+:	iLength(0),
+	iIndex(0),
+	iEnd(0),
+	iFile(0),
+	iMapBase(0),
+	iMapSize(0),
+	iMapHandle(0),
+	iMapData(0),
+	iReadBuf(0),
+	iReadBufFrames(0)
+{
+	iFile = fopen(aFileName, "rb");
+	if (!iFile)
 	{
-		fprintf(stderr, "WAV file data section not found\n");
-		exit(1);
+		iError = EWavOpen;
+		return;
 	}
-	iDataSize = GetUInt32LE(dsHdr + 4);
-	if (iDataSize + fmtLen + 20 != iTotalSize)
+	if (!ReadWavHeader(iFile))
+		return;
+
+	uint64_t fileSize = FileSize(iFile);
+	if (fileSize > iDataOffset && (iDataSize == 0 || iDataSize > fileSize - iDataOffset))
 	{
-		fprintf(stderr, "WAV file total size and data size inconsistent\n");
-		exit(1);
+		// header not filled in or file truncated - use what is there
+		if (aVerbose)
+			fprintf(stderr, "WAV file data size (%llu) inconsistent with file size, using file size\n", (unsigned long long)iDataSize);
+		iDataSize = fileSize - iDataOffset;
 	}
 	iLength = iDataSize / iBytesPerFrame;
-	printf("Finished reading header info for %s:\n", aFileName);
-	printf("Total size   = %u\n", iTotalSize);
-	printf("Fs           = %u\n", iFs);
-	printf("#Channels    = %u\n", iNCh);
-	printf("Bits/sample  = %u\n", iBitsPerSample);
-	printf("Bytes/sample = %u\n", iBytesPerSample);
-	printf("Bytes/frame  = %u\n", iBytesPerFrame);
-	printf("Length       = %u\n", iLength);
-	printf("Index        = %u\n", iIndex);
-	printf("Data size    = %u\n", iDataSize);
-	printf("Bytes/second = %u\n", iBytesPerSec);
+	iEnd = iLength;
+	if (!MapFile(aFileName, iDataOffset))
+	{
+		// fall back to buffered reads
+		iReadBufFrames = READ_BUF_SIZE / iBytesPerFrame;
+		if (iReadBufFrames == 0)
+			iReadBufFrames = 1;
+		iReadBuf = new uint8_t[iReadBufFrames * iBytesPerFrame];
+	}
+	if (aVerbose)
+	{
+		printf("Finished reading header info for %s:\n", aFileName);
+		printf("Total size   = %llu\n", (unsigned long long)iTotalSize);
+		printf("Format       = %s%s\n", iFormat == ESampleF32 ? "float" : "PCM", iRf64 ? " (RF64)" : "");
+		printf("Fs           = %u\n", iFs);
+		printf("#Channels    = %u\n", iNCh);
+		printf("Bits/sample  = %u\n", iBitsPerSample);
+		printf("Bytes/sample = %u\n", iBytesPerSample);
+		printf("Bytes/frame  = %u\n", iBytesPerFrame);
+		printf("Length       = %llu\n", (unsigned long long)iLength);
+		printf("Index        = %llu\n", (unsigned long long)iIndex);
+		printf("Data offset  = %llu\n", (unsigned long long)iDataOffset);
+		printf("Data size    = %llu\n", (unsigned long long)iDataSize);
+		printf("Bytes/second = %u\n", iBytesPerSec);
+		printf("Mapped       = %s\n", iMapData ? "yes" : "no");
+	}
 }
 
 CWavFile::~CWavFile()
 {
-	delete[] iFmtSection;
+	UnmapFile();
+	delete[] iReadBuf;
 	if (iFile)
 		fclose(iFile);
 }
 
-void CWavFile::ReadSamples(void* aPtr, uint32_t aNFrames)
+// Map the whole file read-only so that the data section can be accessed
+// directly from the page cache. Returns false if mapping is not possible,
+// in which case the caller falls back to reading through iFile.
+bool CWavFile::MapFile(const char* aFileName, uint64_t aDataOffset)
+{
+	uint64_t mapSize64 = aDataOffset + iLength * iBytesPerFrame;
+	size_t mapSize = (size_t)mapSize64;
+	if (mapSize == 0 || mapSize != mapSize64)
+		return false;			// empty, or too big for address space
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(aFileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	HANDLE hMap = CreateFileMappingA(hFile, 0, PAGE_READONLY, 0, 0, 0);
+	CloseHandle(hFile);
+	if (!hMap)
+		return false;
+	void* p = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, mapSize);
+	if (!p)
+	{
+		CloseHandle(hMap);
+		return false;
+	}
+	iMapHandle = hMap;
+#else
+	int fd = open(aFileName, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < (uint64_t)mapSize)
+	{
+		close(fd);
+		return false;
+	}
+	void* p = mmap(0, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	madvise(p, mapSize, MADV_SEQUENTIAL);
+#endif
+	iMapBase = p;
+	iMapSize = mapSize;
+	iMapData = (const uint8_t*)p + aDataOffset;
+	return true;
+}
+
+void CWavFile::UnmapFile()
+{
+	if (!iMapBase)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(iMapBase);
+	CloseHandle((HANDLE)iMapHandle);
+#else
+	munmap(iMapBase, iMapSize);
+#endif
+	iMapBase = 0;
+	iMapSize = 0;
+	iMapHandle = 0;
+	iMapData = 0;
+}
+
+// Copy aNFrames frames to aPtr. On failure, iError is set and the read
+// range is ended at the current index.
+bool CWavFile::ReadSamples(void* aPtr, uint32_t aNFrames)
 {
 	size_t readSize = iBytesPerFrame * aNFrames;
-	size_t r = fread(aPtr, 1, readSize, iFile);
-	if (r != readSize)
+	if (iMapData)
 	{
-		fprintf(stderr, "Problem reading WAV file\n");
-		exit(1);
+		if (aNFrames > Remain())
+			goto read_error;
+		memcpy(aPtr, iMapData + (size_t)iIndex * iBytesPerFrame, readSize);
+		iIndex += aNFrames;
+		return true;
+	}
+	if (fread(aPtr, 1, readSize, iFile) != readSize)
+	{
+read_error:
+		iError = EWavRead;
+		iEnd = iIndex;
+		return false;
 	}
 	iIndex += aNFrames;
+	return true;
+}
+
+// Read only frames aStart to aEnd from now on. Returns false if the file
+// can't seek to aStart, in which case nothing is changed.
+bool CWavFile::SetRange(uint64_t aStart, uint64_t aEnd)
+{
+	if (aEnd > iLength)
+		aEnd = iLength;
+	if (aStart > aEnd)
+		aStart = aEnd;
+	if (!iMapData)
+	{
+		uint64_t pos = iDataOffset + aStart * iBytesPerFrame;
+#ifdef _WIN32
+		if (_fseeki64(iFile, (__int64)pos, SEEK_SET) != 0)
+			return false;
+#else
+		if (fseeko(iFile, (off_t)pos, SEEK_SET) != 0)
+			return false;
+#endif
+	}
+	iIndex = aStart;
+	iEnd = aEnd;
+	return true;
 }
 
-int32_t CWavFile::GetSample(const void* aBuf, uint32_t aFrame, uint32_t aCh)
+// Return a read-only view of up to aMaxFrames frames starting at the current
+// index, and advance the index past them. If the file is mapped the view points
+// straight into the mapping, otherwise it points to an internal buffer which
+// is only valid until the next call. Returns the number of frames in the view.
+uint32_t CWavFile::ReadFrames(const uint8_t*& aPtr, uint32_t aMaxFrames)
+{
+	uint64_t remain = Remain();
+	uint32_t n = (remain > aMaxFrames) ? aMaxFrames : (uint32_t)remain;
+	if (iMapData)
+	{
+		aPtr = iMapData + (size_t)iIndex * iBytesPerFrame;
+		iIndex += n;
+		return n;
+	}
+	if (n > iReadBufFrames)
+		n = iReadBufFrames;
+	aPtr = iReadBuf;
+	return ReadSamples(iReadBuf, n) ? n : 0;
+}
+
+int32_t CSampleSource::GetSample(const void* aBuf, uint32_t aFrame, uint32_t aCh)
 {
 	const uint8_t* p = (const uint8_t*)aBuf;
 	p += aFrame * iBytesPerFrame;
 	p += aCh * iBytesPerSample;
 	switch (iBytesPerSample)
 	{
-	case 1: return GetInt8(p);
+	case 1: return (int32_t)GetUInt8(p) - 128;
 	case 2: return GetInt16LE(p);
 	case 3: return GetInt24LE(p);
-	default: fprintf(stderr, "%u bytes per sample not supported\n", iBytesPerSample); exit(1);
+	case 4: return GetInt32LE(p);
+	default: return 0;		// ReadWavHeader() only accepts 1 to 4
+	}
+}
+
+void CSampleSource::GetSamples(int32_t* aOut, const void* aBuf, uint32_t aNFrames, uint32_t aCh) const
+{
+	const uint8_t* p = (const uint8_t*)aBuf + aCh * iBytesPerSample;
+	ConvertSamples(aOut, p, aNFrames, iBytesPerFrame, iFormat);
+}
+
+void CSampleSource::GetSamples(float* aOut, const void* aBuf, uint32_t aNFrames, uint32_t aCh) const
+{
+	const uint8_t* p = (const uint8_t*)aBuf + aCh * iBytesPerSample;
+	ConvertSamples(aOut, p, aNFrames, iBytesPerFrame, iFormat);
+}
+
+/*
+* Batch sample conversion
+*
+* The format is examined once per call and a loop specialised for that
+* format is run over the whole block. On x86 the common layouts (mono and
+* stereo 16 bit, mono 8/24/32 bit and float) have SSE2 and AVX2 versions,
+* the AVX2 ones being selected at run time if the CPU supports them.
+* Anything else, and any remaining frames at the end of a block, go through
+* the scalar loop.
+*/
+
+#define	SCALE_U8	(1.0f / 128.0f)
+#define	SCALE_S16	(1.0f / 32768.0f)
+#define	SCALE_S24	(1.0f / 8388608.0f)
+#define	SCALE_S32	(1.0f / 2147483648.0f)
+
+inline int32_t FloatToInt(float aX)
+{
+	float x = aX * 8388608.0f;
+	if (x >= 8388607.0f)
+		return 8388607;
+	if (x <= -8388608.0f)
+		return -8388608;
+	return (int32_t)x;
+}
+
+inline float GetF32LE(const void* aPtr)
+{
+	uint32_t u = GetUInt32LE(aPtr);
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+template<class T> inline T LoadSample(const uint8_t* aPtr, TSampleFormat aFormat);
+
+template<> inline int32_t LoadSample<int32_t>(const uint8_t* aPtr, TSampleFormat aFormat)
+{
+	switch (aFormat)
+	{
+	case ESampleU8: return (int32_t)GetUInt8(aPtr) - 128;
+	case ESampleS16: return GetInt16LE(aPtr);
+	case ESampleS24: return GetInt24LE(aPtr);
+	case ESampleS32: return GetInt32LE(aPtr);
+	default: return FloatToInt(GetF32LE(aPtr));
+	}
+}
+
+template<> inline float LoadSample<float>(const uint8_t* aPtr, TSampleFormat aFormat)
+{
+	switch (aFormat)
+	{
+	case ESampleU8: return (float)((int32_t)GetUInt8(aPtr) - 128) * SCALE_U8;
+	case ESampleS16: return (float)GetInt16LE(aPtr) * SCALE_S16;
+	case ESampleS24: return (float)GetInt24LE(aPtr) * SCALE_S24;
+	case ESampleS32: return (float)GetInt32LE(aPtr) * SCALE_S32;
+	default: return GetF32LE(aPtr);
+	}
+}
+
+// scalar loop, instantiated per format so that the switch in LoadSample()
+// is resolved at compile time
+template<class T, TSampleFormat F> void ConvertScalar(T* aOut, const uint8_t* aIn, uint32_t aN, uint32_t aStride)
+{
+	uint32_t i;
+	for (i=0; i<aN; ++i, aIn+=aStride)
+		aOut[i] = LoadSample<T>(aIn, F);
+}
+
+template<class T> void ConvertScalar(T* aOut, const uint8_t* aIn, uint32_t aN, uint32_t aStride, TSampleFormat aFormat)
+{
+	switch (aFormat)
+	{
+	case ESampleU8: ConvertScalar<T, ESampleU8>(aOut, aIn, aN, aStride); break;
+	case ESampleS16: ConvertScalar<T, ESampleS16>(aOut, aIn, aN, aStride); break;
+	case ESampleS24: ConvertScalar<T, ESampleS24>(aOut, aIn, aN, aStride); break;
+	case ESampleS32: ConvertScalar<T, ESampleS32>(aOut, aIn, aN, aStride); break;
+	case ESampleF32: ConvertScalar<T, ESampleF32>(aOut, aIn, aN, aStride); break;
 	}
 }
+
+#ifdef HAVE_SSE2
+static const bool HaveAvx2 = CpuHasAvx2();
+
+// Output helpers: take 4 or 8 int32 lanes and store either as int32 or as
+// float multiplied by aScale.
+inline void Store4(int32_t* aOut, __m128i aX, float)
+{
+	_mm_storeu_si128((__m128i*)aOut, aX);
+}
+
+inline void Store4(float* aOut, __m128i aX, float aScale)
+{
+	_mm_storeu_ps(aOut, _mm_mul_ps(_mm_cvtepi32_ps(aX), _mm_set1_ps(aScale)));
+}
+
+TARGET_AVX2 inline void Store8(int32_t* aOut, __m256i aX, float)
+{
+	_mm256_storeu_si256((__m256i*)aOut, aX);
+}
+
+TARGET_AVX2 inline void Store8(float* aOut, __m256i aX, float aScale)
+{
+	_mm256_storeu_ps(aOut, _mm256_mul_ps(_mm256_cvtepi32_ps(aX), _mm256_set1_ps(aScale)));
+}
+
+// SSE2 kernels: each returns the number of frames converted, which is a
+// multiple of the vector width, and never reads past the last frame.
+template<class T> uint32_t ConvertSse2(T* aOut, const uint8_t* aIn, uint32_t aN, uint32_t aStride, TSampleFormat aFormat)
+{
+	uint32_t i = 0;
+	if (aFormat == ESampleS16 && aStride == 2)
+	{
+		for (; i+8<=aN; i+=8)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(aIn + 2*i));
+			Store4(aOut+i, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16), SCALE_S16);
+			Store4(aOut+i+4, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16), SCALE_S16);
+		}
+	}
+	else if (aFormat == ESampleS16 && aStride == 4)
+	{
+		// stereo: the wanted channel is in the low half of each 32 bit word;
+		// need one frame beyond the four loaded when reading the second channel
+		for (; i+5<=aN; i+=4)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(aIn + 4*i));
+			Store4(aOut+i, _mm_srai_epi32(_mm_slli_epi32(x, 16), 16), SCALE_S16);
+		}
+	}
+	else if (aFormat == ESampleU8 && aStride == 1)
+	{
+		const __m128i bias = _mm_set1_epi8((char)0x80);
+		for (; i+16<=aN; i+=16)
+		{
+			__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(aIn + i)), bias);
+			__m128i lo = _mm_unpacklo_epi8(x, x);
+			__m128i hi = _mm_unpackhi_epi8(x, x);
+			Store4(aOut+i, _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 24), SCALE_U8);
+			Store4(aOut+i+4, _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 24), SCALE_U8);
+			Store4(aOut+i+8, _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 24), SCALE_U8);
+			Store4(aOut+i+12, _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 24), SCALE_U8);
+		}
+	}
+	else if (aFormat == ESampleS32 && aStride == 4)
+	{
+		for (; i+4<=aN; i+=4)
+			Store4(aOut+i, _mm_loadu_si128((const __m128i*)(aIn + 4*i)), SCALE_S32);
+	}
+	return i;
+}
+
+// float input is handled separately since it doesn't go through int32 lanes
+inline uint32_t ConvertF32Sse2(float* aOut, const uint8_t* aIn, uint32_t aN, uint32_t aStride)
+{
+	uint32_t i = 0;
+	if (aStride == 4)
+	{
+		for (; i+4<=aN; i+=4)
+			_mm_storeu_ps(aOut+i, _mm_loadu_ps((const float*)(aIn + 4*i)));
+	}
+	else if (aStride == 8)
+	{
+		for (; i+5<=aN; i+=4)
+		{
+			__m128 a = _mm_loadu_ps((const float*)(aIn + 8*i));
+			__m128 b = _mm_loadu_ps((const float*)(aIn + 8*i + 16));
+			_mm_storeu_ps(aOut+i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)));
+		}
+	}
+	return i;
+}
+
+inline uint32_t ConvertF32Sse2(int32_t* aOut, const uint8_t* aIn, uint32_t aN, uint32_t aStride)
+{
+	uint32_t i = 0;
+	if (aStride == 4)
+	{
+		const __m128 scale = _mm_set1_ps(8388608.0f);
+		const __m128 hi = _mm_set1_ps(8388607.0f);
+		const __m128 lo = _mm_set1_ps(-8388608.0f);
+		for (; i+4<=aN; i+=4)
+		{
+			__m128 x = _mm_mul_ps(_mm_loadu_ps((const float*)(aIn + 4*i)), scale);
+			x = _mm_max_ps(_mm_min_ps(x, hi), lo);
+			_mm_storeu_si128((__m128i*)(aOut+i), _mm_cvttps_epi32(x));
+		}
+	}
+	return i;
+}
+
+template<class T> TARGET_AVX2 uint32_t ConvertAvx2(T* aOut, const uint8_t* aIn, uint32_t aN, uint32_t aStride, TSampleFormat aFormat)
+{
+	uint32_t i = 0;
+	if (aFormat == ESampleS16 && aStride == 2)
+	{
+		for (; i+8<=aN; i+=8)
+			Store8(aOut+i, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(aIn + 2*i))), SCALE_S16);
+	}
+	else if (aFormat == ESampleS16 && aStride == 4)
+	{
+		for (; i+9<=aN; i+=8)
+		{
+			__m256i x = _mm256_loadu_si256((const __m256i*)(aIn + 4*i));
+			Store8(aOut+i, _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16), SCALE_S16);
+		}
+	}
+	else if (aFormat == ESampleU8 && aStride == 1)
+	{
+		const __m256i bias = _mm256_set1_epi32(128);
+		for (; i+8<=aN; i+=8)
+		{
+			__m128i x = _mm_loadl_epi64((const __m128i*)(aIn + i));
+			Store8(aOut+i, _mm256_sub_epi32(_mm256_cvtepu8_epi32(x), bias), SCALE_U8);
+		}
+	}
+	else if (aFormat == ESampleS24 && aStride == 3)
+	{
+		// 8 samples occupy 24 bytes; spread dwords 0-2 into the low lane and
+		// 3-5 into the high lane, then shuffle each 3 byte sample into the top
+		// of a 32 bit word and shift down to sign extend. The 32 byte load
+		// needs 8 bytes (3 frames) beyond the last sample converted.
+		const __m256i perm = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+		const __m256i shuf = _mm256_setr_epi8(
+			-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+			-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+		for (; i+11<=aN; i+=8)
+		{
+			__m256i x = _mm256_loadu_si256((const __m256i*)(aIn + 3*i));
+			x = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(x, perm), shuf);
+			Store8(aOut+i, _mm256_srai_epi32(x, 8), SCALE_S24);
+		}
+	}
+	return i;
+}
+
+template<class T> uint32_t ConvertVector(T* aOut, const uint8_t* aIn, uint32_t aN, uint32_t aStride, TSampleFormat aFormat)
+{
+	if (aFormat == ESampleF32)
+		return ConvertF32Sse2(aOut, aIn, aN, aStride);
+	uint32_t i = 0;
+	if (HaveAvx2)
+		i = ConvertAvx2(aOut, aIn, aN, aStride, aFormat);
+	if (i == 0)
+		i = ConvertSse2(aOut, aIn, aN, aStride, aFormat);
+	return i;
+}
+#endif
+
+template<class T> void ConvertBlock(T* aOut, const void* aIn, uint32_t aNFrames, uint32_t aStride, TSampleFormat aFormat)
+{
+	const uint8_t* p = (const uint8_t*)aIn;
+	uint32_t i = 0;
+#ifdef HAVE_SSE2
+	i = ConvertVector(aOut, p, aNFrames, aStride, aFormat);
+#endif
+	ConvertScalar(aOut + i, p + (size_t)i * aStride, aNFrames - i, aStride, aFormat);
+}
+
+void ConvertSamples(int32_t* aOut, const void* aIn, uint32_t aNFrames, uint32_t aStride, TSampleFormat aFormat)
+{
+	ConvertBlock(aOut, aIn, aNFrames, aStride, aFormat);
+}
+
+void ConvertSamples(float* aOut, const void* aIn, uint32_t aNFrames, uint32_t aStride, TSampleFormat aFormat)
+{
+	ConvertBlock(aOut, aIn, aNFrames, aStride, aFormat);
+}
@@ -58,9 +58,14 @@ inline uint32_t GetUInt32LE(const void* aPtr)
 	return (uint32_t)((GetUInt8(aPtr,3)<<24)|(GetUInt8(aPtr,2)<<16)|(GetUInt8(aPtr,1)<<8)|GetUInt8(aPtr));
 }
 
+inline uint64_t GetUInt64LE(const void* aPtr)
+{
+	return ((uint64_t)GetUInt32LE((const uint8_t*)aPtr + 4) << 32) | GetUInt32LE(aPtr);
+}
+
 inline int32_t GetInt24LE(const void* aPtr)
 {
-	return (int32_t)((GetUInt8(aPtr,2)<<16)|(GetUInt8(aPtr,1)<<8)|GetUInt8(aPtr));
+	return (int32_t)(((uint32_t)GetUInt8(aPtr,2)<<24)|(GetUInt8(aPtr,1)<<16)|(GetUInt8(aPtr)<<8)) >> 8;
 }
 
 inline int32_t GetInt32LE(const void* aPtr)
@@ -68,33 +73,103 @@ inline int32_t GetInt32LE(const void* aPtr)
 	return (int32_t)((GetUInt8(aPtr,3)<<24)|(GetUInt8(aPtr,2)<<16)|(GetUInt8(aPtr,1)<<8)|GetUInt8(aPtr));
 }
 
-class CWavFile
+// sample formats understood by the batch conversion functions
+enum TSampleFormat
+{
+	ESampleU8 = 0,					// 8 bit unsigned PCM (offset 128)
+	ESampleS16 = 1,					// 16 bit signed PCM
+	ESampleS24 = 2,					// 24 bit signed PCM
+	ESampleS32 = 3,					// 32 bit signed PCM
+	ESampleF32 = 4,					// 32 bit IEEE float
+};
+
+// Convert aNFrames samples of one channel to a contiguous buffer.
+// aIn points to the first sample of the required channel, aStride is the
+// number of bytes between successive frames. Integer output keeps the native
+// range of the PCM format (8 bit is re-centred on zero, float is scaled to
+// 24 bits); float output is normalised to [-1,1).
+void ConvertSamples(int32_t* aOut, const void* aIn, uint32_t aNFrames, uint32_t aStride, TSampleFormat aFormat);
+void ConvertSamples(float* aOut, const void* aIn, uint32_t aNFrames, uint32_t aStride, TSampleFormat aFormat);
+
+// reasons a sample source couldn't be opened or read
+enum TWavError
+{
+	EWavOk = 0,
+	EWavOpen = 1,					// file couldn't be opened
+	EWavRead = 2,					// read failed, or file too small
+	EWavNotWav = 3,					// not a RIFF, RF64 or BW64 WAVE file
+	EWavNoSection = 4,				// fmt or data chunk missing
+	EWavFormat = 5,					// sample format not supported
+};
+
+// Base class for anything which supplies interleaved PCM frames. Errors are
+// recorded rather than reported; once Error() is set ReadFrames() returns 0.
+class CSampleSource
 {
 public:
-	CWavFile(const char* aFileName);
-	void ReadSamples(void* aPtr, uint32_t aNG);
-	virtual ~CWavFile();
+	CSampleSource();
+	virtual ~CSampleSource();
+	virtual uint32_t ReadFrames(const uint8_t*& aPtr, uint32_t aMaxFrames)=0;
+	inline TWavError Error() const { return iError; }
+	static const char* ErrorText(TWavError aError);
+	double FullScale() const;
 	inline uint32_t SampleRate() const { return iFs; }
 	inline uint32_t NumChannels() const { return iNCh; }
 	inline uint32_t BitsPerSample() const { return iBitsPerSample; }
 	inline uint32_t BytesPerSample() const { return iBytesPerSample; }
 	inline uint32_t BytesPerFrame() const { return iBytesPerFrame; }
-	inline uint32_t Length() const { return iLength; }
-	inline uint32_t Index() const { return iIndex; }
-	inline uint32_t Remain() const { return iLength - iIndex; }
+	inline TSampleFormat SampleFormat() const { return iFormat; }
 public:
 	int32_t GetSample(const void* aBuf, uint32_t aFrame, uint32_t aCh);
-private:
-	uint32_t	iTotalSize;				// total size of file after first 8 bytes
+	void GetSamples(int32_t* aOut, const void* aBuf, uint32_t aNFrames, uint32_t aCh) const;
+	void GetSamples(float* aOut, const void* aBuf, uint32_t aNFrames, uint32_t aCh) const;
+protected:
+	void SetFormat(uint32_t aFs, uint32_t aNCh, TSampleFormat aFormat);
+	bool ReadWavHeader(FILE* aFile);
+protected:
+	TWavError	iError;					// first error, EWavOk if none
+	uint64_t	iTotalSize;				// total size of file after first 8 bytes
 	uint32_t	iFs;					// sample rate/Hz
 	uint16_t	iNCh;					// number of channels
 	uint16_t	iBitsPerSample;			// bits per sample
 	uint16_t	iBytesPerSample;		// bytes per sample
 	uint16_t	iBytesPerFrame;			// bytes per sample across all channel
-	uint32_t	iLength;				// number of samples for each channel
-	uint32_t	iIndex;					// index of next frame to be read
-	uint32_t	iDataSize;				// size of data section
+	TSampleFormat	iFormat;			// format of each sample
+	uint64_t	iDataSize;				// size of data section
 	uint32_t	iBytesPerSec;			// bytes of data transferred per second
-	FILE*		iFile;
 	uint8_t*	iFmtSection;
+	uint32_t	iFmtLen;				// length of fmt chunk
+	uint64_t	iDataOffset;			// offset of data section from start of file
+	bool		iRf64;					// file is RF64/BW64 with 64 bit sizes
+};
+
+class CWavFile : public CSampleSource
+{
+public:
+	CWavFile(const char* aFileName, bool aVerbose = true);
+	bool ReadSamples(void* aPtr, uint32_t aNG);
+	virtual uint32_t ReadFrames(const uint8_t*& aPtr, uint32_t aMaxFrames);
+	virtual ~CWavFile();
+	inline uint64_t Length() const { return iLength; }
+	inline uint64_t Index() const { return iIndex; }
+	inline uint64_t Remain() const { return iEnd - iIndex; }
+	bool SetRange(uint64_t aStart, uint64_t aEnd);
+	inline bool IsMapped() const { return iMapData != 0; }
+	inline const uint8_t* Data() const { return iMapData; }
+	inline uint64_t DataSize() const { return iDataSize; }
+private:
+	uint64_t	iLength;				// number of samples for each channel
+	uint64_t	iIndex;					// index of next frame to be read
+	uint64_t	iEnd;					// index of frame after the last to be read
+	FILE*		iFile;
+private:
+	bool MapFile(const char* aFileName, uint64_t aDataOffset);
+	void UnmapFile();
+private:
+	void*		iMapBase;				// base of file mapping
+	size_t		iMapSize;				// size of file mapping
+	void*		iMapHandle;				// OS handle for mapping (Windows only)
+	const uint8_t*	iMapData;			// start of data section within mapping, 0 if not mapped
+	uint8_t*	iReadBuf;				// buffer for ReadFrames() when not mapped
+	uint32_t	iReadBufFrames;			// size of iReadBuf in frames
 };